@@ -0,0 +1,33 @@
+#!/bin/bash
+# usage: build.sh <commit> [delay]
+#
+# Checks out a commit of the repository in a worktree under $BENCH_TREES
+# (/tmp/tecnicofs-trees by default), sets the DELAY spin of fs/state.h
+# to delay (0 by default, "keep" leaves it as committed) and builds the
+# server, tecnicofs-client and tecnicofs-lat there. Prints the directory
+# with the built server. A tree already built is reused.
+set -e
+[ $# -ge 1 ] || { sed -n '2,9p' "$0"; exit 1; }
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+TREES=${BENCH_TREES:-/tmp/tecnicofs-trees}
+COMMIT=$(git -C "$BENCH" rev-parse --short "$1")
+DELAY=${2:-0}
+TREE=$TREES/$COMMIT-$DELAY
+CODE=$TREE/Parte3/Codigo
+
+if [ ! -x "$CODE/client/tecnicofs-lat" ]; then
+    mkdir -p "$TREES"
+    [ -d "$TREE" ] || git -C "$BENCH" worktree add -f --detach "$TREE" "$COMMIT" > /dev/null 2>&1
+    if [ "$DELAY" != keep ]; then
+        sed -i "s/^#define DELAY .*/#define DELAY $DELAY/" "$CODE/fs/state.h"
+    fi
+    make -s -C "$CODE" > /dev/null
+    make -s -C "$CODE/client" > /dev/null
+    SHM=
+    [ -f "$CODE/client/tecnicofs-shm.o" ] && SHM=$CODE/client/tecnicofs-shm.o
+    [ -z "$SHM" ] && [ -f "$CODE/tecnicofs-shm.o" ] && SHM=$CODE/tecnicofs-shm.o
+    gcc -pthread -std=gnu99 -I"$CODE" -I"$CODE/client" -o "$CODE/client/tecnicofs-lat" \
+        "$BENCH/tecnicofs-lat.c" "$CODE/client/tecnicofs-client-api.o" $SHM -lrt
+fi
+echo "$CODE"
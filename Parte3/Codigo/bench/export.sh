@@ -0,0 +1,32 @@
+#!/bin/bash
+# usage: export.sh [runs] [commit...]
+#
+# Exports under concurrent writes (user-019): the server holds the tree
+# of inputs/test10.txt, with 8 threads and DELAY 0. One client prints it
+# 30 times while 4 others each create and delete 2000 files in their own
+# directory. Compares the print under the root write lock (d9159be), the
+# copy of each directory under its read lock (0733710) and the print
+# from a snapshot (c92edf7) unless other commits are given.
+BENCH=$(cd "$(dirname "$0")" && pwd)
+RUNS=${1:-3}
+shift
+COMMITS=${@:-d9159be 0733710 c92edf7}
+W=$(mktemp -d)
+
+for r in $(seq 30); do
+    echo "p $W/export.txt"
+done > "$W/exports"
+CLIENTS="export:$W/exports"
+for g in $(seq 0 3); do
+    awk -v g=$g 'BEGIN { for (i = 0; i < 2000; i++) printf "c d%d/e0/w%d_%d f\nd d%d/e0/w%d_%d\n", g, g, i, g, g, i }' > "$W/writes$g"
+    CLIENTS="$CLIENTS writes:$W/writes$g"
+done
+
+for run in $(seq "$RUNS"); do
+    for commit in $COMMITS; do
+        CODE=$("$BENCH/build.sh" $commit) || exit 1
+        echo "== $commit"
+        "$BENCH/run.sh" "$CODE" 8 "$BENCH/../inputs/test10.txt" $CLIENTS
+    done
+done
+rm -rf "$W"
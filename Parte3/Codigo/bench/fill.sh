@@ -0,0 +1,27 @@
+#!/bin/bash
+# usage: fill.sh [runs] [commit...]
+#
+# Create throughput as the inode table fills (user-002): one client runs
+# the 8420 creates of inputs/test10.txt on a fresh server with 4 threads
+# and DELAY 0. Prints, for each run, the seconds spent in each quarter of
+# the file and in all of it. Compares the linear scan (6db7d37) with the
+# free list (d17c380) unless other commits are given.
+BENCH=$(cd "$(dirname "$0")" && pwd)
+RUNS=${1:-3}
+shift
+COMMITS=${@:-6db7d37 d17c380}
+export BENCH_OUT=${BENCH_OUT:-/tmp/tecnicofs-bench-out}
+
+for commit in $COMMITS; do
+    CODE=$("$BENCH/build.sh" "$commit") || exit 1
+    for run in $(seq "$RUNS"); do
+        "$BENCH/run.sh" "$CODE" 4 /dev/null fill:"$BENCH/../inputs/test10.txt" > /dev/null
+        awk -v commit="$commit" '
+            { t[NR] = $2 }
+            END {
+                q = int(NR / 4)
+                for (i = 1; i <= NR; i++) { s[i <= 3 * q ? int((i - 1) / q) : 3] += t[i]; all += t[i] }
+                printf "%s  %.3f %.3f %.3f %.3f  total %.3f s\n", commit, s[0] / 1e6, s[1] / 1e6, s[2] / 1e6, s[3] / 1e6, all / 1e6
+            }' "$BENCH_OUT"/fill.1
+    done
+done
@@ -0,0 +1,29 @@
+#!/bin/bash
+# usage: lockcoupling.sh [delay] [runs]
+#
+# Tail latency of operations in a shallow directory while others run
+# deeper in the same path (user-006). Two clients create and delete
+# files in a/b/c, two do the same in a, on a server with 4 threads.
+# Compares d112610 with the lock coupling of d9159be. delay is the DELAY
+# spin: 0 (the default) runs 3000 pairs per client, "keep" runs 150.
+BENCH=$(cd "$(dirname "$0")" && pwd)
+DELAY=${1:-0}
+RUNS=${2:-3}
+PAIRS=3000
+[ "$DELAY" = keep ] && PAIRS=150
+W=$(mktemp -d)
+
+printf 'c a d\nc a/b d\nc a/b/c d\n' > "$W/setup"
+for g in 0 1; do
+    seq 0 $((PAIRS - 1)) | awk -v g=$g '{ printf "c a/b/c/x%d_%d f\nd a/b/c/x%d_%d\n", g, $1, g, $1 }' > "$W/deep$g"
+    seq 0 $((PAIRS - 1)) | awk -v g=$g '{ printf "c a/y%d_%d f\nd a/y%d_%d\n", g, $1, g, $1 }' > "$W/shallow$g"
+done
+
+for run in $(seq "$RUNS"); do
+    for commit in d112610 d9159be; do
+        CODE=$("$BENCH/build.sh" $commit "$DELAY") || exit 1
+        echo "== $commit"
+        "$BENCH/run.sh" "$CODE" 4 "$W/setup" deep:"$W/deep0" deep:"$W/deep1" shallow:"$W/shallow0" shallow:"$W/shallow1"
+    done
+done
+rm -rf "$W"
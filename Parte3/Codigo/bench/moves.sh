@@ -0,0 +1,46 @@
+#!/bin/bash
+# usage: moves.sh [delay] [runs] [commit...]
+#
+# Cross-directory moves under load (user-007). 8 clients each move their
+# 20 files around 4 shared directories, in rounds, on a server with 8
+# threads; at the end every file must be in place. Compares the global
+# move mutex of d9159be with the lock sets of 0a0d811 unless other
+# commits are given. delay is the DELAY spin: 0 (the default) runs 150
+# rounds per client, "keep" runs 10.
+BENCH=$(cd "$(dirname "$0")" && pwd)
+DELAY=${1:-0}
+RUNS=${2:-3}
+shift 2
+COMMITS=${@:-d9159be 0a0d811}
+ROUNDS=150
+[ "$DELAY" = keep ] && ROUNDS=10
+W=$(mktemp -d)
+export BENCH_OUT=${BENCH_OUT:-/tmp/tecnicofs-bench-out}
+
+awk 'BEGIN {
+    for (d = 0; d < 4; d++) printf "c m%d d\n", d
+    for (g = 0; g < 8; g++) for (i = 0; i < 20; i++) printf "c m%d/f%d_%d f\n", g % 4, g, i
+}' > "$W/setup"
+CLIENTS=
+for g in $(seq 0 7); do
+    awk -v g=$g -v rounds=$ROUNDS 'BEGIN {
+        src = g % 4
+        for (r = 0; r < rounds; r++) {
+            dst = (src + 1 + (r + g) % 3) % 4
+            for (i = 0; i < 20; i++) printf "m m%d/f%d_%d m%d/f%d_%d\n", src, g, i, dst, g, i
+            src = dst
+        }
+    }' > "$W/moves$g"
+    CLIENTS="$CLIENTS mv:$W/moves$g"
+done
+echo "p $W/tree" > "$W/print"
+
+for run in $(seq "$RUNS"); do
+    for commit in $COMMITS; do
+        CODE=$("$BENCH/build.sh" $commit "$DELAY") || exit 1
+        echo "== $commit"
+        FINAL=$W/print "$BENCH/run.sh" "$CODE" 8 "$W/setup" $CLIENTS
+        echo "files in place: $(grep -c '/f' "$W/tree")"
+    done
+done
+rm -rf "$W"
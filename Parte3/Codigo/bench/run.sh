@@ -0,0 +1,46 @@
+#!/bin/bash
+# usage: run.sh <code dir> <threads> <setup file> <label:file>...
+#
+# Starts the server built in code dir (see build.sh) with the given
+# number of threads, runs the setup file with tecnicofs-client, then
+# one tecnicofs-lat per label:file, all at once. Prints, for each label,
+# how many operations its clients ran and their latency percentiles in
+# microseconds, and the time all of them took. The raw latencies are
+# left in $BENCH_OUT (/tmp/tecnicofs-bench-out by default), one file
+# per client. If $FINAL names an input file, it is run with
+# tecnicofs-client after the others, before the server is stopped.
+[ $# -ge 4 ] || { sed -n '2,12p' "$0"; exit 1; }
+
+CODE=$1 THREADS=$2 SETUP=$3
+shift 3
+OUT=${BENCH_OUT:-/tmp/tecnicofs-bench-out}
+SOCKET=$OUT/server.sock
+rm -rf "$OUT"
+mkdir -p "$OUT"
+
+env -u TECNICOFS_WAL -u TECNICOFS_CHECKPOINT "$CODE/tecnicofs" "$THREADS" "$SOCKET" > "$OUT/server.log" 2>&1 &
+SERVER=$!
+sleep 0.3
+"$CODE/client/tecnicofs-client" "$SETUP" "$SOCKET" > /dev/null
+
+n=0
+START=$(date +%s.%N)
+for spec in "$@"; do
+    n=$((n + 1))
+    "$CODE/client/tecnicofs-lat" "${spec#*:}" "$SOCKET" > "$OUT/${spec%%:*}.$n" &
+done
+wait $(jobs -p | grep -v "^$SERVER$")
+END=$(date +%s.%N)
+[ -n "$FINAL" ] && "$CODE/client/tecnicofs-client" "$FINAL" "$SOCKET" > /dev/null
+kill $SERVER
+wait $SERVER 2> /dev/null
+
+for label in $(for spec in "$@"; do echo "${spec%%:*}"; done | sort -u); do
+    cat "$OUT/$label".* | awk '{ print $2 }' | sort -n | awk -v label="$label" '
+        { v[NR] = $1; if ($1 > 5000) slow++ }
+        END {
+            printf "%-8s n=%-6d p50=%-9.0f p90=%-9.0f p99=%-9.0f max=%-9.0f >5ms=%d\n", label, NR,
+                   v[int(NR * .5) + 1], v[int(NR * .9) + 1], v[int(NR * .99) + 1], v[NR], slow
+        }'
+done
+echo "$START $END" | awk '{ printf "wall %.2f s\n", $2 - $1 }'
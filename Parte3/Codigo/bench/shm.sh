@@ -0,0 +1,35 @@
+#!/bin/bash
+# usage: shm.sh [runs] [threads...]
+#
+# Round trips over the socket and over the shared-memory rings
+# (user-013): tecnicofs-bench runs 3 s in closed loop with the given
+# numbers of client threads (1 and 4 by default), against the current
+# commit built with DELAY 0 and 4 server threads, once with
+# TECNICOFS_SHM=0 and once with TECNICOFS_SHM=1.
+BENCH=$(cd "$(dirname "$0")" && pwd)
+RUNS=${1:-3}
+shift
+THREADS=${@:-1 4}
+CODE=$("$BENCH/build.sh" HEAD) || exit 1
+W=$(mktemp -d)
+
+env -u TECNICOFS_WAL -u TECNICOFS_CHECKPOINT TECNICOFS_LOG_LEVEL=info "$CODE/tecnicofs" 4 "$W/server.sock" > "$W/server.log" 2>&1 &
+SERVER=$!
+sleep 0.3
+for threads in $THREADS; do
+    for run in $(seq "$RUNS"); do
+        for shm in 0 1; do
+            TECNICOFS_SHM=$shm "$CODE/client/tecnicofs-bench" -p 1 -t $threads -d 3 -m c=10,d=10,l=70,w=5,r=5 \
+                -o "$W/result.json" "$W/server.sock" > /dev/null
+            awk -v threads=$threads -v shm=$shm '
+                /"ops_per_sec"/ { gsub(/[,"]/, ""); ops = $2 }
+                /^  "latency_ns"/ { gsub(/[,{}":]/, " "); for (i = 1; i < NF; i++) v[$i] = $(i + 1) }
+                END { printf "threads=%d shm=%d  %.0f ops/s  p50 %.1f us  p99 %.1f us\n", threads, shm, ops, v["p50"] / 1e3, v["p99"] / 1e3 }
+            ' "$W/result.json"
+        done
+    done
+done
+kill $SERVER
+wait $SERVER 2> /dev/null
+echo "shared memory sessions: $(grep -c 'Mount shared memory' "$W/server.log")"
+rm -rf "$W"
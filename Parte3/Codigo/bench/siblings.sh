@@ -0,0 +1,30 @@
+#!/bin/bash
+# usage: siblings.sh [runs] [commit...]
+#
+# Parallel lookups of sibling files (user-008): 8 clients each look up
+# 5000 of the 64 files of one directory, in their own order, on a
+# server with 8 threads and DELAY 0. Compares the packed i-node table
+# of 0a0d811 with the split one of fa69f8c unless other commits are
+# given. There are no cache-miss counts: they need perf and a machine
+# that exposes its counters.
+BENCH=$(cd "$(dirname "$0")" && pwd)
+RUNS=${1:-3}
+shift
+COMMITS=${@:-0a0d811 fa69f8c}
+W=$(mktemp -d)
+
+awk 'BEGIN { print "c s d"; for (i = 0; i < 64; i++) printf "c s/f%d f\n", i }' > "$W/setup"
+CLIENTS=
+for g in $(seq 0 7); do
+    awk -v g=$g 'BEGIN { for (r = 0; r < 5000; r++) printf "l s/f%d\n", (r * 7 + g) % 64 }' > "$W/lookups$g"
+    CLIENTS="$CLIENTS l:$W/lookups$g"
+done
+
+for run in $(seq "$RUNS"); do
+    for commit in $COMMITS; do
+        CODE=$("$BENCH/build.sh" $commit) || exit 1
+        echo "== $commit"
+        "$BENCH/run.sh" "$CODE" 8 "$W/setup" $CLIENTS
+    done
+done
+rm -rf "$W"
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tecnicofs-client-api.h"
+#include "tecnicofs-api-constants.h"
+
+/*
+ * Timed client: runs an input file of create, delete, lookup, move and
+ * print commands, as tecnicofs-client does, and prints one line per
+ * command with its letter and its latency in microseconds. It only uses
+ * the client API every version of the server has, so the same program
+ * measures any commit.
+ */
+
+//* Older versions have no MAX_PATH_SIZE
+#define LAT_MAX_ARG 512
+
+FILE* inputFile;
+char* serverName;
+
+static void displayUsage (const char* appName) {
+    printf("Usage: %s inputfile server_socket_name\n", appName);
+    exit(EXIT_FAILURE);
+}
+
+static void parseArgs (long argc, char* const argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Invalid format:\n");
+        displayUsage(argv[0]);
+    }
+
+    serverName = argv[2];
+
+    inputFile = fopen(argv[1], "r");
+
+    if (inputFile == NULL) {
+        fprintf(stderr, "Error: cannot open input file\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+//* Microseconds since start
+static double elapsed(struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e6 + (now.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+
+int main(int argc, char* argv[]) {
+    char line[2 * LAT_MAX_ARG + MAX_INPUT_SIZE];
+
+    parseArgs(argc, argv);
+
+    if (tfsMount(serverName) != 0) {
+        fprintf(stderr, "Error: unable to mount %s\n", serverName);
+        exit(EXIT_FAILURE);
+    }
+
+    while (fgets(line, sizeof(line), inputFile)) {
+        char op, arg1[LAT_MAX_ARG], arg2[LAT_MAX_ARG];
+        int numTokens = sscanf(line, "%c %511s %511s", &op, arg1, arg2);
+        struct timespec start;
+
+        if (numTokens < 2 || strchr("cdlmp", op) == NULL || (strchr("cm", op) && numTokens != 3)) {
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        switch (op) {
+            case 'c':
+                tfsCreate(arg1, arg2[0]);
+                break;
+            case 'd':
+                tfsDelete(arg1);
+                break;
+            case 'l':
+                tfsLookup(arg1);
+                break;
+            case 'm':
+                tfsMove(arg1, arg2);
+                break;
+            case 'p':
+                tfsPrint(arg1);
+                break;
+        }
+        printf("%c %.1f\n", op, elapsed(&start));
+    }
+
+    tfsUnmount();
+    fclose(inputFile);
+    exit(EXIT_SUCCESS);
+}
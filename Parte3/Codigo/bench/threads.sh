@@ -0,0 +1,36 @@
+#!/bin/bash
+# usage: threads.sh [runs] [commit...]
+#
+# Server throughput against its number of threads (user-014, user-020):
+# 8 clients each look up $LOOKUPS (5000) of the 64 files of one
+# directory, against servers built with DELAY 0 and 1 to 64 threads
+# ($THREADS). Prints the lookups per second of each run, sorted, for
+# every commit and thread count. Compares recvfrom in every worker
+# (feb5009), the recvmmsg reactor (ade8b29), the per-worker queues
+# (b96f048) and the current commit unless other commits are given.
+BENCH=$(cd "$(dirname "$0")" && pwd)
+RUNS=${1:-3}
+shift
+COMMITS=${@:-feb5009 ade8b29 b96f048 HEAD}
+THREADS=${THREADS:-1 2 4 8 16 32 64}
+LOOKUPS=${LOOKUPS:-5000}
+W=$(mktemp -d)
+
+awk 'BEGIN { print "c s d"; for (i = 0; i < 64; i++) printf "c s/f%d f\n", i }' > "$W/setup"
+CLIENTS=
+for g in $(seq 0 7); do
+    awk -v g=$g -v n=$LOOKUPS 'BEGIN { for (r = 0; r < n; r++) printf "l s/f%d\n", (r * 7 + g) % 64 }' > "$W/lookups$g"
+    CLIENTS="$CLIENTS l:$W/lookups$g"
+done
+
+for threads in $THREADS; do
+    for commit in $COMMITS; do
+        CODE=$("$BENCH/build.sh" $commit) || exit 1
+        printf "threads=%-3d %-8s" $threads $commit
+        for run in $(seq "$RUNS"); do
+            "$BENCH/run.sh" "$CODE" $threads "$W/setup" $CLIENTS | awk -v n=$((8 * LOOKUPS)) '/^wall/ { printf "%.0f\n", n / $2 }'
+        done | sort -n | tr '\n' ' '
+        echo
+    done
+done
+rm -rf "$W"
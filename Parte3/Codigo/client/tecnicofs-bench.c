@@ -0,0 +1,478 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "tecnicofs-client-api.h"
+#include "../tecnicofs-api-constants.h"
+
+/*
+ * Load generator: P processes of T threads, each with its own session,
+ * run a mix of operations on files of a directory of their own. In
+ * closed loop each thread sends its next operation when the last one
+ * is done; in open loop the threads send at a fixed total rate, and the
+ * latency of an operation counts from when it should have been sent,
+ * so a slow server isn't hidden by sending less. Latencies go to
+ * histograms with buckets of a fixed relative width, as HdrHistogram
+ * does, and the summary is written as JSON.
+ */
+
+//* Each power of two is split in 2^HIST_SUB_BITS buckets (1.6% wide)
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+#define BENCH_OPS 6
+#define BENCH_MAX_THREADS 256
+
+//* Latencies, in ns
+typedef struct histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total, min, max;
+    double sum;
+} Histogram;
+
+//* What a thread did, per operation
+typedef struct bench_result {
+    Histogram latency[BENCH_OPS];
+    uint64_t errors[BENCH_OPS];
+    double seconds; /* spent running the mix */
+} BenchResult;
+
+//* Shared by every process: the start barrier and a result per thread
+typedef struct bench_shared {
+    pthread_barrier_t start;
+    BenchResult results[];
+} BenchShared;
+
+const char benchOps[] = "cdlmwr";
+const char *benchOpNames[BENCH_OPS] = { "create", "delete", "lookup", "move", "write", "read" };
+
+char *serverName;
+int processes = 1, threads = 1, files = 64, ioSize = 1024, duration = 5;
+long opsLimit = 0;
+double rate = 0; /* total ops/s of the open loop, 0 for closed loop */
+int mix[BENCH_OPS] = { 20, 20, 40, 10, 5, 5 };
+int mixTotal;
+char *outputName;
+BenchShared *shared;
+
+
+static void displayUsage (const char* appName) {
+    printf("Usage: %s [-p processes] [-t threads] [-d seconds] [-n ops] [-r rate]\n"
+           "       [-m c=20,d=20,l=40,m=10,w=5,r=5] [-f files] [-s io_size] [-o output]\n"
+           "       server_socket_name\n", appName);
+    exit(EXIT_FAILURE);
+}
+
+
+/*
+ * Reads the weights of the operations, as op=weight separated by commas.
+ * Returns: SUCCESS or FAIL
+ */
+static int parseMix(char *spec) {
+    int weights[BENCH_OPS] = { 0 };
+    char *item = strtok(spec, ",");
+
+    for (; item != NULL; item = strtok(NULL, ",")) {
+        char *op = strchr(benchOps, item[0]);
+        int weight;
+
+        if (item[0] == '\0' || op == NULL || item[1] != '=' || (weight = atoi(item + 2)) < 0)
+            return FAIL;
+        weights[op - benchOps] = weight;
+    }
+    memcpy(mix, weights, sizeof(mix));
+    return SUCCESS;
+}
+
+
+static void parseArgs (long argc, char* const argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:t:d:n:r:m:f:s:o:")) != -1) {
+        switch (opt) {
+            case 'p': processes = atoi(optarg); break;
+            case 't': threads = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'n': opsLimit = atol(optarg); break;
+            case 'r': rate = atof(optarg); break;
+            case 'f': files = atoi(optarg); break;
+            case 's': ioSize = atoi(optarg); break;
+            case 'o': outputName = optarg; break;
+            case 'm':
+                if (parseMix(optarg) == FAIL) {
+                    fprintf(stderr, "Invalid mix: %s\n", optarg);
+                    displayUsage(argv[0]);
+                }
+                break;
+            default:
+                displayUsage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Invalid format:\n");
+        displayUsage(argv[0]);
+    }
+    serverName = argv[optind];
+
+    mixTotal = 0;
+    for (int i = 0; i < BENCH_OPS; i++)
+        mixTotal += mix[i];
+    if (processes < 1 || threads < 1 || processes * threads > BENCH_MAX_THREADS || files < 1
+        || ioSize < 1 || ioSize > MAX_IO_SIZE || duration < 1 || rate < 0 || mixTotal == 0) {
+        fprintf(stderr, "Invalid arguments\n");
+        displayUsage(argv[0]);
+    }
+}
+
+
+static uint64_t nanos(struct timespec *t) {
+    return (uint64_t) t->tv_sec * 1000000000ull + t->tv_nsec;
+}
+
+
+/*
+ * Returns the bucket of a latency: exact below 2^HIST_SUB_BITS, then
+ * HIST_SUB buckets for each power of two.
+ */
+static int histBucket(uint64_t value) {
+    int msb, shift;
+
+    if (value < HIST_SUB)
+        return value;
+    msb = 63 - __builtin_clzll(value);
+    shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int) ((value >> shift) - HIST_SUB);
+}
+
+
+/*
+ * Returns the largest latency of a bucket.
+ */
+static uint64_t histBucketTop(int bucket) {
+    int shift = bucket / HIST_SUB - 1;
+
+    if (shift < 0)
+        return bucket;
+    return (((uint64_t) (bucket % HIST_SUB + HIST_SUB + 1)) << shift) - 1;
+}
+
+
+static void histRecord(Histogram *h, uint64_t value) {
+    h->counts[histBucket(value)]++;
+    if (h->total == 0 || value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+    h->total++;
+    h->sum += value;
+}
+
+
+static void histAdd(Histogram *to, Histogram *from) {
+    if (from->total == 0)
+        return;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        to->counts[i] += from->counts[i];
+    if (to->total == 0 || from->min < to->min)
+        to->min = from->min;
+    if (from->max > to->max)
+        to->max = from->max;
+    to->total += from->total;
+    to->sum += from->sum;
+}
+
+
+/*
+ * Returns the latency below which the given fraction of them are, as
+ * the top of its bucket, but never above the largest one seen.
+ */
+static uint64_t histPercentile(Histogram *h, double fraction) {
+    uint64_t rank = (uint64_t) (fraction * h->total + 0.5), seen = 0;
+
+    if (rank < 1)
+        rank = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank)
+            return histBucketTop(i) < h->max ? histBucketTop(i) : h->max;
+    }
+    return h->max;
+}
+
+
+//* State of a thread of the bench
+typedef struct bench_thread {
+    int id;
+    unsigned seed;
+    char dir[MAX_FILE_NAME];
+    char *buffer;
+} BenchThread;
+
+
+static void fileName(BenchThread *t, char *name, int file) {
+    sprintf(name, "%s/f%d", t->dir, file);
+}
+
+
+/*
+ * Runs one operation of the mix on a file of the thread.
+ * Returns: the index of the operation, with *failed set if it failed
+ */
+static int runOp(BenchThread *t, int *failed) {
+    char path[MAX_PATH_SIZE], target[MAX_PATH_SIZE];
+    int pick = rand_r(&t->seed) % mixTotal, op = 0, res;
+
+    while (pick >= mix[op]) {
+        pick -= mix[op];
+        op++;
+    }
+    fileName(t, path, rand_r(&t->seed) % files);
+
+    switch (benchOps[op]) {
+        case 'c':
+            res = tfsCreate(path, 'f');
+            break;
+        case 'd':
+            res = tfsDelete(path);
+            break;
+        case 'l':
+            res = tfsLookup(path);
+            break;
+        case 'm':
+            fileName(t, target, rand_r(&t->seed) % files);
+            res = tfsMove(path, target);
+            break;
+        case 'w':
+            res = tfsWrite(path, t->buffer, ioSize, 0);
+            break;
+        default:
+            res = tfsRead(path, t->buffer, ioSize, 0);
+    }
+    *failed = res < 0;
+    return op;
+}
+
+
+/*
+ * Thread of the bench: creates its directory with half of its files,
+ * waits for every other thread, runs the mix and cleans up.
+ */
+void *benchThread(void *arg) {
+    BenchThread t = { .id = (intptr_t) arg, .seed = (intptr_t) arg * 7919 + getpid() };
+    BenchResult *result = &shared->results[t.id];
+    double interval = rate > 0 ? processes * threads / rate * 1e9 : 0;
+    struct timespec now, sent;
+    uint64_t begin, end;
+    char path[MAX_PATH_SIZE];
+    long done;
+
+    if ((t.buffer = malloc(ioSize)) == NULL) {
+        fprintf(stderr, "Error: cannot allocate io buffer\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(t.buffer, 'a' + t.id % 26, ioSize);
+    if (tfsMount(serverName) != SUCCESS) {
+        fprintf(stderr, "Error: unable to mount %s\n", serverName);
+        exit(EXIT_FAILURE);
+    }
+    sprintf(t.dir, "bench%d-%d", getpid(), t.id);
+    if (tfsCreate(t.dir, 'd') != SUCCESS) {
+        fprintf(stderr, "Error: unable to create %s\n", t.dir);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < files; i += 2) {
+        fileName(&t, path, i);
+        tfsCreate(path, 'f');
+    }
+
+    pthread_barrier_wait(&shared->start);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    begin = nanos(&now);
+    end = begin + duration * 1000000000ull;
+
+    for (done = 0; opsLimit == 0 || done < opsLimit; done++) {
+        int op, failed;
+
+        //* In open loop the latency counts from when the operation was due
+        if (interval > 0) {
+            uint64_t due = begin + (uint64_t) (done * interval);
+
+            sent.tv_sec = due / 1000000000ull;
+            sent.tv_nsec = due % 1000000000ull;
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &sent, NULL);
+        }
+        else {
+            clock_gettime(CLOCK_MONOTONIC, &sent);
+        }
+        if (nanos(&sent) >= end)
+            break;
+
+        op = runOp(&t, &failed);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        histRecord(&result->latency[op], nanos(&now) - nanos(&sent));
+        result->errors[op] += failed;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    result->seconds = (nanos(&now) - begin) / 1e9;
+
+    for (int i = 0; i < files; i++) {
+        fileName(&t, path, i);
+        tfsDelete(path);
+    }
+    tfsDelete(t.dir);
+    tfsUnmount();
+    free(t.buffer);
+    return NULL;
+}
+
+
+/*
+ * Runs the threads of a process, from the given index of the results.
+ */
+static void runProcess(int first) {
+    pthread_t tid[threads];
+
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&tid[i], NULL, benchThread, (void *) (intptr_t) (first + i)) != 0) {
+            fprintf(stderr, "Error: problems creating thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < threads; i++)
+        pthread_join(tid[i], NULL);
+}
+
+
+static void printLatency(FILE *out, Histogram *h) {
+    fprintf(out, "{\"count\": %llu, \"min\": %llu, \"mean\": %.0f, \"p50\": %llu, \"p90\": %llu, "
+            "\"p99\": %llu, \"p999\": %llu, \"max\": %llu}",
+            (unsigned long long) h->total, (unsigned long long) h->min, h->total ? h->sum / h->total : 0.0,
+            (unsigned long long) histPercentile(h, 0.5), (unsigned long long) histPercentile(h, 0.9),
+            (unsigned long long) histPercentile(h, 0.99), (unsigned long long) histPercentile(h, 0.999),
+            (unsigned long long) h->max);
+}
+
+
+/*
+ * Merges the results of every thread and writes them as JSON.
+ */
+static void printResults(FILE *out) {
+    Histogram *all = calloc(1, sizeof(Histogram)), *perOp = calloc(BENCH_OPS, sizeof(Histogram));
+    uint64_t errors[BENCH_OPS] = { 0 }, totalErrors = 0;
+    double seconds = 0;
+    int first = 1;
+
+    if (all == NULL || perOp == NULL) {
+        fprintf(stderr, "Error: cannot allocate histograms\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < processes * threads; i++) {
+        if (shared->results[i].seconds > seconds)
+            seconds = shared->results[i].seconds;
+        for (int op = 0; op < BENCH_OPS; op++) {
+            histAdd(&perOp[op], &shared->results[i].latency[op]);
+            errors[op] += shared->results[i].errors[op];
+        }
+    }
+    for (int op = 0; op < BENCH_OPS; op++) {
+        histAdd(all, &perOp[op]);
+        totalErrors += errors[op];
+    }
+
+    fprintf(out, "{\n  \"server\": \"%s\",\n  \"processes\": %d,\n  \"threads\": %d,\n", serverName, processes, threads);
+    fprintf(out, "  \"mode\": \"%s\",\n  \"target_rate\": %.1f,\n", rate > 0 ? "open" : "closed", rate);
+    fprintf(out, "  \"files_per_thread\": %d,\n  \"io_size\": %d,\n  \"mix\": {", files, ioSize);
+    for (int op = 0; op < BENCH_OPS; op++)
+        fprintf(out, "%s\"%s\": %d", op ? ", " : "", benchOpNames[op], mix[op]);
+    fprintf(out, "},\n  \"seconds\": %.3f,\n  \"ops\": %llu,\n  \"errors\": %llu,\n  \"ops_per_sec\": %.1f,\n",
+            seconds, (unsigned long long) all->total, (unsigned long long) totalErrors,
+            seconds > 0 ? all->total / seconds : 0.0);
+    fprintf(out, "  \"latency_ns\": ");
+    printLatency(out, all);
+    fprintf(out, ",\n  \"operations\": {");
+    for (int op = 0; op < BENCH_OPS; op++) {
+        if (perOp[op].total == 0)
+            continue;
+        fprintf(out, "%s\n    \"%s\": {\"errors\": %llu, \"latency_ns\": ", first ? "" : ",",
+                benchOpNames[op], (unsigned long long) errors[op]);
+        printLatency(out, &perOp[op]);
+        fprintf(out, "}");
+        first = 0;
+    }
+
+    //* Buckets in use, as [largest latency in ns, count]
+    fprintf(out, "\n  },\n  \"histogram\": [");
+    first = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        if (all->counts[i] == 0)
+            continue;
+        fprintf(out, "%s[%llu, %llu]", first ? "" : ", ",
+                (unsigned long long) histBucketTop(i), (unsigned long long) all->counts[i]);
+        first = 0;
+    }
+    fprintf(out, "]\n}\n");
+    free(all);
+    free(perOp);
+}
+
+
+int main(int argc, char* argv[]) {
+    size_t sharedSize;
+    pthread_barrierattr_t attr;
+    pid_t children[BENCH_MAX_THREADS];
+    FILE *out = stdout;
+    int failed = 0;
+
+    parseArgs(argc, argv);
+
+    //* Threads of all processes wait at the barrier, and so does this one
+    sharedSize = sizeof(BenchShared) + processes * threads * sizeof(BenchResult);
+    shared = mmap(NULL, sharedSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        fprintf(stderr, "Error: cannot allocate results\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_barrierattr_init(&attr);
+    pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_barrier_init(&shared->start, &attr, processes * threads + 1);
+    pthread_barrierattr_destroy(&attr);
+
+    for (int p = 0; p < processes; p++) {
+        if ((children[p] = fork()) < 0) {
+            fprintf(stderr, "Error: problems creating process\n");
+            exit(EXIT_FAILURE);
+        }
+        if (children[p] == 0) {
+            runProcess(p * threads);
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    pthread_barrier_wait(&shared->start);
+    for (int p = 0; p < processes; p++) {
+        int status;
+
+        waitpid(children[p], &status, 0);
+        failed |= !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS;
+    }
+    if (failed) {
+        fprintf(stderr, "Error: a bench process failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (outputName != NULL && (out = fopen(outputName, "w")) == NULL) {
+        fprintf(stderr, "Error: cannot open output file\n");
+        exit(EXIT_FAILURE);
+    }
+    printResults(out);
+    if (out != stdout)
+        fclose(out);
+
+    exit(EXIT_SUCCESS);
+}
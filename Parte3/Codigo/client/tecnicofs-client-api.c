@@ -1,17 +1,26 @@
 #include "tecnicofs-client-api.h"
+#include "../tecnicofs-protocol.h"
+#include "../tecnicofs-shm.h"
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <sched.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 
-#define MAX_SIZE 100
-
-int sockfd;
-socklen_t server_len;
-struct sockaddr_un server_addr;
-char clientName[MAX_INPUT_SIZE];
+//* Sessions are per thread: each thread that mounts gets its own
+//* Connection of the session, -1 if not mounted
+__thread int sockfd = -1;
+__thread uint32_t requestId = 0;
+//* Rings shared with the server, if it took them at mount
+__thread TfsShm *shm = NULL;
 
 int setAddr(char *path, struct sockaddr_un *addr) {
 
@@ -26,96 +35,708 @@ int setAddr(char *path, struct sockaddr_un *addr) {
 }
 
 
-void snd(char * command){
-  
-  if (sendto(sockfd, command, strlen(command), 0, (struct sockaddr *) &server_addr, server_len) < 0) {
-    fprintf(stderr,"Client: sendto error\n");
-    exit(EXIT_FAILURE);
+//* Request sent and not yet claimed with tfsWait, in the slot of its id
+typedef struct inflight {
+  uint32_t id; /* 0 if the slot is free */
+  int done;
+  int result;
+  char *reply_data;
+  int reply_len;
+  tfs_op *op; /* gets the result too, if any */
+} inflight;
+
+__thread inflight inflights[TFS_MAX_INFLIGHT];
+//* Requests sent whose reply hasn't arrived
+__thread int inflightCount = 0;
+//* Replies go here when they can't be received straight into their buffer
+__thread char staging[MAX_IO_SIZE + TFS_MAX_BATCH * sizeof(TfsResult)];
+
+
+/*
+ * Completes the request a reply is for. Replies to requests no longer
+ * waited for, left behind by errors, are dropped.
+ * Input:
+ *  - reply: header of the reply
+ *  - data: payload of the reply, unless received in place
+ *  - in_place: if the payload was received into the request's buffer
+ */
+static void complete(TfsReplyHeader *reply, char *data, int len, int in_place) {
+  inflight *e = &inflights[reply->request_id % TFS_MAX_INFLIGHT];
+
+  if (e->id != reply->request_id || e->done) {
+    return;
+  }
+  if (!in_place) {
+    memcpy(e->reply_data, data, len < e->reply_len ? len : e->reply_len);
+  }
+  //* Failures keep their TECNICOFS_ERROR_* code, if the server gave one
+  e->result = reply->status == SUCCESS || reply->value < 0 ? reply->value : FAIL;
+  if (e->op != NULL) {
+    e->op->result = e->result;
   }
+  e->done = 1;
+  inflightCount--;
 }
 
-int rcv(){
-  int res;
-  if (recvfrom(sockfd, &res, sizeof(res), 0, 0, 0) < 0) {
-    fprintf(stderr,"Client: recvfrom error\n");
+
+/*
+ * Receives one reply, on the rings if mounted with them or else on the
+ * socket. With a single request in flight its payload is received
+ * straight into the caller's buffer.
+ * Input:
+ *  - wait: if it waits for a reply when none has arrived
+ * Returns: 1 if a reply was received, 0 if none was there
+ */
+static int receiveReply(int wait) {
+  TfsReplyHeader reply;
+  struct iovec iov[2];
+  struct msghdr msg;
+  char *data = staging;
+  int len = sizeof(staging), in_place = 0, res;
+
+  if (shm != NULL) {
+    char *message;
+    uint32_t size;
+
+    if (!wait && !tfs_ring_ready(&shm->replies)) {
+      return 0;
+    }
+    if (tfs_ring_peek(shm, &shm->replies, &message, &size) != 0 || size < sizeof(reply)) {
+      fprintf(stderr,"Client: server gone\n");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(&reply, message, sizeof(reply));
+    complete(&reply, message + sizeof(reply), size - sizeof(reply), 0);
+    tfs_ring_release(&shm->replies, size);
+    return 1;
+  }
+
+  if (inflightCount == 1) {
+    for (int i = 0; i < TFS_MAX_INFLIGHT; i++) {
+      if (inflights[i].id != 0 && !inflights[i].done) {
+        data = inflights[i].reply_data;
+        len = inflights[i].reply_len;
+        in_place = 1;
+      }
+    }
+  }
+
+  iov[0].iov_base = &reply;
+  iov[0].iov_len = sizeof(reply);
+  iov[1].iov_base = data;
+  iov[1].iov_len = len;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  if ((res = recvmsg(sockfd, &msg, wait ? 0 : MSG_DONTWAIT)) < 0 && !wait
+      && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return 0;
+  }
+  if (res < (int) sizeof(reply)) {
+    fprintf(stderr,"Client: recvmsg error\n");
     exit(EXIT_FAILURE);
-  } 
-  return res;
+  }
+  complete(&reply, data, res - sizeof(reply), in_place);
+  return 1;
 }
 
+
+/*
+ * Sends a request without waiting for its reply. While the server can't
+ * take it, the replies that arrive are received, so neither side waits
+ * on the other forever.
+ * Input:
+ *  - opcode: operation requested
+ *  - flags: flags of the request
+ *  - payload: arguments, built with the tfs_put helpers
+ *  - data: bytes sent after the arguments, straight from the caller
+ *  - reply_data: where the payload of the reply goes, up to reply_len
+ *  - op: operation that gets the result, or NULL
+ * Returns: id of the request
+ */
+static uint32_t submit(int opcode, int flags, TfsBuffer *payload, char *data, int len,
+                       char *reply_data, int reply_len, tfs_op *op) {
+  TfsRequestHeader header;
+  struct iovec iov[3];
+  struct msghdr msg;
+  inflight *e;
+
+  if (++requestId > INT_MAX) {
+    requestId = 1;
+  }
+  //* The slot may still be taken by a request TFS_MAX_INFLIGHT ids older
+  e = &inflights[requestId % TFS_MAX_INFLIGHT];
+  while (e->id != 0 && !e->done) {
+    receiveReply(1);
+  }
+  e->id = requestId;
+  e->done = 0;
+  e->reply_data = reply_data;
+  e->reply_len = reply_len;
+  e->op = op;
+  inflightCount++;
+
+  header.version = TFS_PROTOCOL_VERSION;
+  header.opcode = opcode;
+  header.flags = flags;
+  header.request_id = requestId;
+  header.length = payload->pos + len;
+
+  iov[0].iov_base = &header;
+  iov[0].iov_len = sizeof(header);
+  iov[1].iov_base = payload->data;
+  iov[1].iov_len = payload->pos;
+  iov[2].iov_base = data;
+  iov[2].iov_len = len;
+
+  if (shm != NULL) {
+    while (!tfs_ring_fits(&shm->requests, sizeof(header) + header.length)) {
+      if (!receiveReply(0)) {
+        sched_yield();
+      }
+    }
+    if (tfs_ring_put(shm, &shm->requests, iov, 3) != 0) {
+      fprintf(stderr,"Client: server gone\n");
+      exit(EXIT_FAILURE);
+    }
+    return requestId;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 3;
+  while (sendmsg(sockfd, &msg, MSG_DONTWAIT) < 0) {
+    struct pollfd pfd = { sockfd, POLLIN, 0 };
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      fprintf(stderr,"Client: sendmsg error\n");
+      exit(EXIT_FAILURE);
+    }
+    if (!receiveReply(0)) {
+      poll(&pfd, 1, 1);
+    }
+  }
+  return requestId;
+}
+
+
+/*
+ * Waits for the reply to a request and frees its slot.
+ * Returns: the value of the reply, or FAIL
+ */
+static int waitReply(uint32_t id) {
+  inflight *e = &inflights[id % TFS_MAX_INFLIGHT];
+  int result;
+
+  if (e->id != id) {
+    return FAIL;
+  }
+  while (!e->done) {
+    receiveReply(1);
+  }
+  result = e->result;
+  e->id = 0;
+  return result;
+}
+
+
+/*
+ * Sends a request and waits for its reply.
+ * Returns: the value of the reply, FAIL, or
+ * TECNICOFS_ERROR_NO_OPEN_SESSION if not mounted
+ */
+static int request(int opcode, int flags, TfsBuffer *payload, char *data, int len, char *reply_data, int reply_len) {
+  if (sockfd < 0) {
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  }
+  return waitReply(submit(opcode, flags, payload, data, len, reply_data, reply_len, NULL));
+}
+
+
+/*
+ * Sends a request whose only argument is a path.
+ */
+static int pathRequest(int opcode, char *path) {
+  char args[sizeof(uint16_t) + MAX_PATH_SIZE];
+  TfsBuffer payload;
+
+  tfs_buffer_init(&payload, args, sizeof(args));
+  if (tfs_put_path(&payload, path) != 0) {
+    return FAIL;
+  }
+  return request(opcode, 0, &payload, NULL, 0, NULL, 0);
+}
+
+
 int tfsCreate(char *filename, char nodeType) {
-  char command[MAX_SIZE];
-  sprintf(command,"c %s %c", filename, nodeType);
-  
-  snd(command);
-  return rcv();
+  char args[sizeof(int32_t) + sizeof(uint16_t) + MAX_PATH_SIZE];
+  TfsBuffer payload;
+
+  tfs_buffer_init(&payload, args, sizeof(args));
+  if (tfs_put_int(&payload, nodeType == 'd' ? T_DIRECTORY : T_FILE) != 0
+      || tfs_put_path(&payload, filename) != 0) {
+    return FAIL;
+  }
+  return request(TFS_OP_CREATE, 0, &payload, NULL, 0, NULL, 0);
 }
 
 
 int tfsDelete(char *path) {
-  char command[MAX_SIZE];
-  sprintf(command,"d %s", path);
-  
-  snd(command);
-  return rcv();
+  return pathRequest(TFS_OP_DELETE, path);
 }
 
 
 int tfsMove(char *from, char *to) {
-  char command[MAX_SIZE];
-  sprintf(command,"m %s %s", from, to);
-  
-  snd(command);
-  return rcv();
+  char args[2 * (sizeof(uint16_t) + MAX_PATH_SIZE)];
+  TfsBuffer payload;
+
+  tfs_buffer_init(&payload, args, sizeof(args));
+  if (tfs_put_path(&payload, from) != 0 || tfs_put_path(&payload, to) != 0) {
+    return FAIL;
+  }
+  return request(TFS_OP_MOVE, 0, &payload, NULL, 0, NULL, 0);
 }
 
 
 int tfsLookup(char *path) {
-  char command[MAX_SIZE];
-  sprintf(command,"l %s", path);
-  
-  snd(command);
-  return rcv();
+  return pathRequest(TFS_OP_LOOKUP, path);
 }
 
 
-int tfsPrint(char *filename) {
-  char command[MAX_SIZE];
-  sprintf(command,"p %s", filename);
-  
-  snd(command);
-  return rcv();
+/*
+ * Writes len bytes of buffer to a file at an offset. The data is sent
+ * from buffer itself, in requests of at most MAX_IO_SIZE bytes that are
+ * all in flight together, up to TFS_MAX_INFLIGHT.
+ * Input:
+ *  - path: path of the file, or NULL to use fd
+ *  - fd: handle of the file, from tfsOpen
+ * Returns: number of bytes written, or FAIL
+ */
+static int writeChunks(char *path, int fd, char *buffer, int len, int offset) {
+  char args[2 * sizeof(int32_t) + sizeof(uint16_t) + MAX_PATH_SIZE];
+  uint32_t ids[TFS_MAX_INFLIGHT];
+  TfsBuffer payload;
+  int chunks = len > 0 ? (len + MAX_IO_SIZE - 1) / MAX_IO_SIZE : 1;
+  int done = 0, res, i;
+
+  if (sockfd < 0) {
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  }
+  for (i = 0; i < chunks + TFS_MAX_INFLIGHT; i++) {
+    int chunk = i - TFS_MAX_INFLIGHT;
+
+    //* The oldest request is claimed before its slot is needed again
+    if (chunk >= 0 && chunk < chunks) {
+      res = waitReply(ids[chunk % TFS_MAX_INFLIGHT]);
+      done = done < 0 ? done : res < 0 ? res : done + res;
+    }
+    if (i < chunks) {
+      int count = len - i * MAX_IO_SIZE < MAX_IO_SIZE ? len - i * MAX_IO_SIZE : MAX_IO_SIZE;
+
+      tfs_buffer_init(&payload, args, sizeof(args));
+      if (path != NULL ? tfs_put_int(&payload, offset + i * MAX_IO_SIZE) || tfs_put_path(&payload, path)
+          : tfs_put_int(&payload, fd) || tfs_put_int(&payload, offset + i * MAX_IO_SIZE)) {
+        return FAIL;
+      }
+      ids[i % TFS_MAX_INFLIGHT] = submit(path != NULL ? TFS_OP_WRITE : TFS_OP_WRITE_HANDLE, 0, &payload,
+                                         buffer + i * MAX_IO_SIZE, count, NULL, 0, NULL);
+    }
+  }
+
+  return done;
 }
 
 
-int tfsMount(char * sockPath) {
-  struct sockaddr_un client_addr;
-  socklen_t client_len;
+/*
+ * Reads up to len bytes of a file at an offset. The data is received
+ * straight into buffer, in requests of at most MAX_IO_SIZE bytes that
+ * are all in flight together, up to TFS_MAX_INFLIGHT.
+ * Input:
+ *  - path: path of the file, or NULL to use fd
+ *  - fd: handle of the file, from tfsOpen
+ * Returns: number of bytes read (less than len at the end of the file),
+ * or FAIL
+ */
+static int readChunks(char *path, int fd, char *buffer, int len, int offset) {
+  char args[3 * sizeof(int32_t) + sizeof(uint16_t) + MAX_PATH_SIZE];
+  uint32_t ids[TFS_MAX_INFLIGHT];
+  TfsBuffer payload;
+  int chunks = len > 0 ? (len + MAX_IO_SIZE - 1) / MAX_IO_SIZE : 1;
+  int done = 0, ended = 0, res, i;
 
-  //* Set up client sock
-  sprintf(clientName,"/tmp/CLIENT_%d", getpid());
+  if (sockfd < 0) {
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  }
+  for (i = 0; i < chunks + TFS_MAX_INFLIGHT; i++) {
+    int chunk = i - TFS_MAX_INFLIGHT;
 
-  if ((sockfd = socket(AF_UNIX, SOCK_DGRAM, 0) ) < 0) {
-    fprintf(stderr, "Client: Unable to create socket");
-    exit(EXIT_FAILURE);
+    //* Bytes after the first short read don't count: the file ended there
+    if (chunk >= 0 && chunk < chunks) {
+      res = waitReply(ids[chunk % TFS_MAX_INFLIGHT]);
+      if (done < 0 || res < 0) {
+        done = done < 0 ? done : res;
+      }
+      else if (!ended) {
+        done += res;
+        ended = res < len - chunk * MAX_IO_SIZE && res < MAX_IO_SIZE;
+      }
+    }
+    if (i < chunks) {
+      int count = len - i * MAX_IO_SIZE < MAX_IO_SIZE ? len - i * MAX_IO_SIZE : MAX_IO_SIZE;
+
+      tfs_buffer_init(&payload, args, sizeof(args));
+      if (path != NULL ? tfs_put_int(&payload, offset + i * MAX_IO_SIZE) || tfs_put_int(&payload, count)
+          || tfs_put_path(&payload, path)
+          : tfs_put_int(&payload, fd) || tfs_put_int(&payload, offset + i * MAX_IO_SIZE)
+          || tfs_put_int(&payload, count)) {
+        return FAIL;
+      }
+      ids[i % TFS_MAX_INFLIGHT] = submit(path != NULL ? TFS_OP_READ : TFS_OP_READ_HANDLE, 0, &payload,
+                                         NULL, 0, buffer + i * MAX_IO_SIZE, count, NULL);
+    }
   }
-  
-  unlink(clientName);
-  client_len = setAddr(clientName, &client_addr);
 
-  if (bind(sockfd, (struct sockaddr *) &client_addr, client_len) < 0) {
-    fprintf(stderr, "Client: Unable to bind socket");
+  return done;
+}
+
+
+int tfsWrite(char *path, char *buffer, int len, int offset) {
+  return writeChunks(path, -1, buffer, len, offset);
+}
+
+
+int tfsRead(char *path, char *buffer, int len, int offset) {
+  return readChunks(path, -1, buffer, len, offset);
+}
+
+
+/*
+ * Opens a file: the server resolves its path once and later requests on
+ * the handle go straight to its i-node.
+ * Input:
+ *  - mode: READ, WRITE or RW
+ * Returns: the handle, or TECNICOFS_ERROR_FILE_NOT_FOUND,
+ * TECNICOFS_ERROR_INVALID_MODE or TECNICOFS_ERROR_MAXED_OPEN_FILES
+ */
+int tfsOpen(char *filename, permission mode) {
+  char args[sizeof(int32_t) + sizeof(uint16_t) + MAX_PATH_SIZE];
+  TfsBuffer payload;
+
+  tfs_buffer_init(&payload, args, sizeof(args));
+  if (tfs_put_int(&payload, mode) != 0 || tfs_put_path(&payload, filename) != 0) {
+    return FAIL;
+  }
+  return request(TFS_OP_OPEN, 0, &payload, NULL, 0, NULL, 0);
+}
+
+
+/*
+ * Sends a request whose only argument is a handle.
+ */
+static int handleRequest(int opcode, int fd) {
+  char args[sizeof(int32_t)];
+  TfsBuffer payload;
+
+  tfs_buffer_init(&payload, args, sizeof(args));
+  tfs_put_int(&payload, fd);
+  return request(opcode, 0, &payload, NULL, 0, NULL, 0);
+}
+
+
+/*
+ * Returns: SUCCESS or TECNICOFS_ERROR_FILE_NOT_OPEN
+ */
+int tfsClose(int fd) {
+  return handleRequest(TFS_OP_CLOSE, fd);
+}
+
+
+/*
+ * Like tfsWrite, on a handle opened with WRITE or RW.
+ */
+int tfsWriteFd(int fd, char *buffer, int len, int offset) {
+  return writeChunks(NULL, fd, buffer, len, offset);
+}
+
+
+/*
+ * Like tfsRead, on a handle opened with READ or RW.
+ */
+int tfsReadFd(int fd, char *buffer, int len, int offset) {
+  return readChunks(NULL, fd, buffer, len, offset);
+}
+
+
+/*
+ * Returns: size of the file of a handle, FAIL if it was deleted, or
+ * TECNICOFS_ERROR_FILE_NOT_OPEN
+ */
+int tfsStat(int fd) {
+  return handleRequest(TFS_OP_STAT, fd);
+}
+
+
+/*
+ * Puts the arguments of an operation, all but the data of a write.
+ * Returns: opcode of the operation, or -1 if unknown or too long
+ */
+static int putArgs(TfsBuffer *args, tfs_op *op) {
+  switch (op->op) {
+    case 'c':
+      return tfs_put_int(args, op->nodeType == 'd' ? T_DIRECTORY : T_FILE) || tfs_put_path(args, op->path)
+        ? -1 : TFS_OP_CREATE;
+    case 'd':
+      return tfs_put_path(args, op->path) ? -1 : TFS_OP_DELETE;
+    case 'l':
+      return tfs_put_path(args, op->path) ? -1 : TFS_OP_LOOKUP;
+    case 'm':
+      return tfs_put_path(args, op->path) || tfs_put_path(args, op->target) ? -1 : TFS_OP_MOVE;
+    case 'w':
+      return tfs_put_int(args, op->offset) || tfs_put_path(args, op->path) ? -1 : TFS_OP_WRITE;
+    case 'r':
+      return tfs_put_int(args, op->offset) || tfs_put_int(args, op->len) || tfs_put_path(args, op->path)
+        ? -1 : TFS_OP_READ;
+    default:
+      return -1;
+  }
+}
+
+
+/*
+ * Appends an operation of tfsBatch to a batch being built.
+ * Returns: 0, or -1 if it doesn't fit
+ */
+static int batchPut(TfsBuffer *batch, tfs_op *op) {
+  TfsRequestHeader header;
+  size_t start = batch->pos;
+  int opcode;
+
+  memset(&header, 0, sizeof(header));
+  if (op->op == 'r' || tfs_put(batch, &header, sizeof(header)) != 0) {
+    return -1;
+  }
+  if ((opcode = putArgs(batch, op)) < 0 || (op->op == 'w' && tfs_put(batch, op->data, op->len) != 0)) {
+    batch->pos = start;
+    return -1;
+  }
+
+  header.version = TFS_PROTOCOL_VERSION;
+  header.opcode = opcode;
+  header.flags = 0;
+  header.request_id = 0;
+  header.length = batch->pos - start - sizeof(header);
+  memcpy(batch->data + start, &header, sizeof(header));
+  return 0;
+}
+
+
+/*
+ * Runs many operations with one request per TFS_MAX_BATCH operations,
+ * or per datagram if they fill it first. Each gets the result its own
+ * call (tfsCreate, tfsDelete, ...) would return.
+ * Input:
+ *  - ops: 'c', 'd', 'l', 'm' or 'w' operations; reads can't be batched
+ *  - count: number of operations
+ *  - mode: TFS_BATCH_ORDERED, to run them one after the other, or
+ *    TFS_BATCH_PARALLEL if they are independent
+ * Returns: SUCCESS, or FAIL if the server refused a batch
+ */
+int tfsBatch(tfs_op *ops, int count, int mode) {
+  char *args;
+  TfsResult results[TFS_MAX_BATCH];
+  TfsBuffer payload;
+  int first = 0, exit_state = SUCCESS;
+
+  if ((args = malloc(TFS_MAX_REQUEST)) == NULL) {
+    fprintf(stderr, "Client: unable to allocate batch\n");
     exit(EXIT_FAILURE);
-  }  
+  }
+
+  while (first < count) {
+    int n = 0, res;
+
+    tfs_buffer_init(&payload, args, TFS_MAX_REQUEST - sizeof(TfsRequestHeader));
+    tfs_put_int(&payload, 0);
+
+    //* An operation that can't fit even alone fails by itself
+    while (first + n < count && n < TFS_MAX_BATCH) {
+      if (batchPut(&payload, &ops[first + n]) != 0) {
+        if (n == 0) {
+          ops[first++].result = FAIL;
+          continue;
+        }
+        break;
+      }
+      n++;
+    }
+    if (n == 0) {
+      continue;
+    }
+    memcpy(args, &n, sizeof(int32_t));
+
+    res = request(TFS_OP_BATCH, mode == TFS_BATCH_PARALLEL ? TFS_FLAG_PARALLEL : 0,
+                  &payload, NULL, 0, (char *) results, sizeof(results));
+    for (int i = 0; i < n; i++) {
+      if (res == n) {
+        ops[first + i].result = results[i].status == SUCCESS ? results[i].value : FAIL;
+      }
+      else {
+        ops[first + i].result = FAIL;
+        exit_state = FAIL;
+      }
+    }
+    first += n;
+  }
+
+  free(args);
+  return exit_state;
+}
+
+
+/*
+ * Sends an operation and returns at once. Its result goes to op->result
+ * when the reply arrives, so op and the data of a read must live until
+ * then. Operations in flight together run in any order.
+ * Input:
+ *  - op: 'c', 'd', 'l', 'm', 'w' or 'r' (data gets len bytes at offset)
+ * Returns: ticket for tfsPoll and tfsWait, FAIL, or
+ * TECNICOFS_ERROR_NO_OPEN_SESSION if not mounted
+ */
+tfs_ticket tfsSubmit(tfs_op *op) {
+  char args[2 * (sizeof(int32_t) + sizeof(uint16_t) + MAX_PATH_SIZE)];
+  TfsBuffer payload;
+  int opcode, io = op->op == 'w' || op->op == 'r';
+
+  if (sockfd < 0) {
+    op->result = TECNICOFS_ERROR_NO_OPEN_SESSION;
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  }
+  tfs_buffer_init(&payload, args, sizeof(args));
+  if ((opcode = putArgs(&payload, op)) < 0 || (io && (op->len < 0 || op->len > MAX_IO_SIZE))) {
+    op->result = FAIL;
+    return FAIL;
+  }
+  return submit(opcode, 0, &payload, op->op == 'w' ? op->data : NULL, op->op == 'w' ? op->len : 0,
+                op->op == 'r' ? op->data : NULL, op->op == 'r' ? op->len : 0, op);
+}
+
+
+/*
+ * Takes the replies that already arrived, without waiting.
+ * Returns: 1 if the ticket's operation is done, 0 if not, or FAIL if
+ * the ticket is not in flight or was already claimed
+ */
+int tfsPoll(tfs_ticket ticket) {
+  inflight *e = &inflights[ticket % TFS_MAX_INFLIGHT];
+
+  if (ticket <= 0 || e->id != (uint32_t) ticket) {
+    return FAIL;
+  }
+  while (!e->done && receiveReply(0));
+  return e->done;
+}
+
+
+/*
+ * Waits for the operation of a ticket and claims it. Tickets not claimed
+ * are reclaimed TFS_MAX_INFLIGHT operations later; op->result stays.
+ * Returns: the result of the operation, or FAIL
+ */
+int tfsWait(tfs_ticket ticket) {
+  return ticket <= 0 ? FAIL : waitReply(ticket);
+}
+
+
+int tfsPrint(char *filename) {
+  return pathRequest(TFS_OP_PRINT, filename);
+}
+
+
+/*
+ * Creates the rings of this client and asks the server to take them.
+ * The object is unlinked once the server mapped it, or refused to; if
+ * it refused, requests keep going on the socket.
+ */
+static void mountShm() {
+  static int mounts = 0;
+  char name[MAX_INPUT_SIZE];
+  TfsShm *rings;
+  int fd, res;
+
+  sprintf(name, "/tecnicofs-%d-%d", getpid(), __atomic_fetch_add(&mounts, 1, __ATOMIC_RELAXED));
+  if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+    return;
+  }
+  if (ftruncate(fd, sizeof(TfsShm)) != 0
+      || (rings = mmap(NULL, sizeof(TfsShm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    close(fd);
+    shm_unlink(name);
+    return;
+  }
+  close(fd);
+  tfs_shm_init(rings);
+
+  res = pathRequest(TFS_OP_MOUNT_SHM, name);
+  shm_unlink(name);
+  if (res == SUCCESS) {
+    shm = rings;
+  }
+  else {
+    munmap(rings, sizeof(TfsShm));
+  }
+}
+
+
+/*
+ * Opens a session with the server listening at sockPath. With
+ * TECNICOFS_SHM set, it also offers the server shared memory rings.
+ * Returns: SUCCESS, TECNICOFS_ERROR_OPEN_SESSION if already mounted or
+ * TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+int tfsMount(char * sockPath) {
+  struct sockaddr_un server_addr;
+  socklen_t server_len;
+
+  if (sockfd >= 0) {
+    return TECNICOFS_ERROR_OPEN_SESSION;
+  }
+
+  if ((sockfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0) {
+    return TECNICOFS_ERROR_CONNECTION_ERROR;
+  }
 
-  //* Set up server sock
   server_len = setAddr(sockPath, &server_addr);
+  if (connect(sockfd, (struct sockaddr *) &server_addr, server_len) < 0) {
+    close(sockfd);
+    sockfd = -1;
+    return TECNICOFS_ERROR_CONNECTION_ERROR;
+  }
+
+  if (getenv("TECNICOFS_SHM") != NULL && strcmp(getenv("TECNICOFS_SHM"), "0") != 0) {
+    mountShm();
+  }
 
   return SUCCESS;
 }
 
+
+/*
+ * Closes the session; the server drops the state it kept for it.
+ * Returns: SUCCESS or TECNICOFS_ERROR_NO_OPEN_SESSION
+ */
 int tfsUnmount() {
+  if (sockfd < 0) {
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  }
+  if (shm != NULL) {
+    tfs_shm_close(shm);
+    munmap(shm, sizeof(TfsShm));
+    shm = NULL;
+  }
   close(sockfd);
-  unlink(clientName);
+  sockfd = -1;
+  memset(inflights, 0, sizeof(inflights));
+  inflightCount = 0;
   return SUCCESS;
 }
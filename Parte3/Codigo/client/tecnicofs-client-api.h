@@ -6,10 +6,47 @@
 #define SUCCESS 0
 #define FAIL -1
 
+/* Modes of tfsBatch */
+#define TFS_BATCH_ORDERED 0
+#define TFS_BATCH_PARALLEL 1
+
+/* Max operations of tfsSubmit (and chunks of tfsWrite/tfsRead) in flight */
+#define TFS_MAX_INFLIGHT 64
+
+/*
+ * Operation of tfsBatch and tfsSubmit: op is 'c' (with nodeType), 'd',
+ * 'l', 'm' (with target), 'w' (with data, len and offset) or, only for
+ * tfsSubmit, 'r' (the same, reading into data)
+ */
+typedef struct tfs_op {
+  char op;
+  char nodeType;
+  char *path;
+  char *target;
+  char *data;
+  int len;
+  int offset;
+  int result; /* filled by tfsBatch and tfsSubmit */
+} tfs_op;
+
+/* Operation in flight, returned by tfsSubmit */
+typedef int tfs_ticket;
+
 int tfsCreate(char *path, char nodeType);
 int tfsDelete(char *path);
 int tfsLookup(char *path);
 int tfsMove(char *from, char *to);
+int tfsWrite(char *path, char *buffer, int len, int offset);
+int tfsRead(char *path, char *buffer, int len, int offset);
+int tfsOpen(char *filename, permission mode);
+int tfsClose(int fd);
+int tfsWriteFd(int fd, char *buffer, int len, int offset);
+int tfsReadFd(int fd, char *buffer, int len, int offset);
+int tfsStat(int fd);
+int tfsBatch(tfs_op *ops, int count, int mode);
+tfs_ticket tfsSubmit(tfs_op *op);
+int tfsPoll(tfs_ticket ticket);
+int tfsWait(tfs_ticket ticket);
 int tfsPrint(char *filename);
 int tfsMount(char* serverName);
 int tfsUnmount();
@@ -1,8 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "tecnicofs-client-api.h"
 #include "../tecnicofs-api-constants.h"
 
+#define TFS_MAX_BATCH_OPS 100000
+
 FILE* inputFile;
 char* serverName;
 
@@ -32,20 +35,112 @@ void errorParse(){
     exit(EXIT_FAILURE);
 }
 
+//* Operations read between "b" and "e" lines, sent with tfsBatch
+tfs_op batchOps[TFS_MAX_BATCH_OPS];
+int batchCount = -1;
+int batchMode;
+
+
+/*
+ * Adds an operation to the batch being read.
+ */
+void batchAdd(char op, char *arg1, char *arg2, int offset) {
+    tfs_op *next;
+
+    if (batchCount == TFS_MAX_BATCH_OPS) {
+        fprintf(stderr, "Error: batch too long\n");
+        exit(EXIT_FAILURE);
+    }
+    next = &batchOps[batchCount];
+    next->op = op;
+    next->nodeType = arg2[0];
+    next->path = strdup(arg1);
+    next->target = strdup(arg2);
+    next->data = next->target;
+    next->len = strlen(arg2);
+    next->offset = offset;
+    batchCount++;
+}
+
+
+/*
+ * Sends the batch and prints the result of each operation.
+ */
+void batchRun() {
+    if (tfsBatch(batchOps, batchCount, batchMode) != SUCCESS)
+        printf("Unable to run batch\n");
+
+    for (int i = 0; i < batchCount; i++) {
+        tfs_op *op = &batchOps[i];
+        int res = op->result;
+
+        switch (op->op) {
+            case 'c':
+                if (!res)
+                  printf("Created %s: %s\n", op->nodeType == 'd' ? "directory" : "file", op->path);
+                else
+                  printf("Unable to create %s: %s\n", op->nodeType == 'd' ? "directory" : "file", op->path);
+                break;
+            case 'l':
+                if (res >= 0)
+                    printf("Search: %s found\n", op->path);
+                else
+                    printf("Search: %s not found\n", op->path);
+                break;
+            case 'd':
+                if (!res)
+                  printf("Deleted: %s\n", op->path);
+                else
+                  printf("Unable to delete: %s\n", op->path);
+                break;
+            case 'm':
+                if (!res)
+                  printf("Moved: %s to %s\n", op->path, op->target);
+                else
+                  printf("Unable to move: %s to %s\n", op->path, op->target);
+                break;
+            case 'w':
+                if (res >= 0)
+                  printf("Wrote: %d bytes to %s\n", res, op->path);
+                else
+                  printf("Unable to write: %s\n", op->path);
+                break;
+        }
+        free(op->path);
+        free(op->target);
+    }
+    batchCount = -1;
+}
+
+
 void *processInput() {
-    char line[MAX_INPUT_SIZE];
+    char line[2 * MAX_PATH_SIZE + MAX_INPUT_SIZE];
 
     while (fgets(line, sizeof(line)/sizeof(char), inputFile)) {
         char op;
-        char arg1[MAX_INPUT_SIZE], arg2[MAX_INPUT_SIZE];
-        int res;
+        char arg1[MAX_PATH_SIZE], arg2[MAX_PATH_SIZE];
+        char *data;
+        int res, offset, len;
 
-        int numTokens = sscanf(line, "%c %s %s", &op, arg1, arg2);
+        int numTokens = sscanf(line, "%c %511s %511s", &op, arg1, arg2);
 
         /* perform minimal validation */
         if (numTokens < 1) {
             continue;
         }
+
+        //* Inside a batch, operations are only collected
+        if (batchCount >= 0 && op != 'e' && op != '#') {
+            offset = 0;
+            if (numTokens < 2 || strchr("cdlmw", op) == NULL
+                || (op == 'w' && sscanf(line, "%*c %*s %d %511s", &offset, arg2) != 2))
+                errorParse();
+            if (numTokens == 2)
+                arg2[0] = '\0';
+            batchAdd(op, arg1, arg2, offset);
+            continue;
+        }
+
         switch (op) {
             case 'c':
                 if(numTokens != 3) {
@@ -98,6 +193,29 @@ void *processInput() {
                 else
                   printf("Unable to move: %s to %s\n", arg1, arg2);
                 break;
+            case 'w':
+                if(numTokens != 3 || sscanf(line, "%*c %*s %d %511s", &offset, arg2) != 2)
+                    errorParse();
+                res = tfsWrite(arg1, arg2, strlen(arg2), offset);
+                if (res >= 0)
+                  printf("Wrote: %d bytes to %s\n", res, arg1);
+                else
+                  printf("Unable to write: %s\n", arg1);
+                break;
+            case 'r':
+                if(numTokens != 3 || sscanf(line, "%*c %*s %d %d", &offset, &len) != 2 || len < 0)
+                    errorParse();
+                if ((data = malloc(len + 1)) == NULL) {
+                    fprintf(stderr, "Error: cannot allocate read buffer\n");
+                    exit(EXIT_FAILURE);
+                }
+                res = tfsRead(arg1, data, len, offset);
+                if (res >= 0)
+                  printf("Read: %d bytes from %s: %.*s\n", res, arg1, res, data);
+                else
+                  printf("Unable to read: %s\n", arg1);
+                free(data);
+                break;
             case 'p':
                 if(numTokens != 2)
                     errorParse();
@@ -107,6 +225,17 @@ void *processInput() {
                 else
                   printf("Unable to Print: to %s\n", arg1);
                 break;
+            case 'b':
+                if(numTokens != 2 || batchCount >= 0)
+                    errorParse();
+                batchMode = arg1[0] == 'p' ? TFS_BATCH_PARALLEL : TFS_BATCH_ORDERED;
+                batchCount = 0;
+                break;
+            case 'e':
+                if(batchCount < 0)
+                    errorParse();
+                batchRun();
+                break;
             case '#':
                 break;
             default: { /* error */
@@ -114,6 +243,8 @@ void *processInput() {
             }
         }
     }
+    if (batchCount >= 0)
+        batchRun();
     fclose(inputFile);
     return NULL;
 }
@@ -123,6 +254,10 @@ int main(int argc, char* argv[]) {
 
     if (tfsMount(serverName) == 0)
       printf("Mounted! (socket = %s)\n", serverName);
+    else {
+      fprintf(stderr, "Error: unable to mount %s\n", serverName);
+      exit(EXIT_FAILURE);
+    }
     
     processInput();
 
@@ -0,0 +1,566 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "checkpoint.h"
+#include "cow.h"
+#include "wal.h"
+#include "log.h"
+
+//* Log offset included by the last file, and growth that triggers the next
+unsigned long long ckpt_last = 0;
+unsigned long long ckpt_log_bytes = CKPT_LOG_BYTES;
+
+//* Deltas after the full image; a full image is due if there is none or a delta failed
+int ckpt_deltas = 0;
+int ckpt_full_due = 1;
+
+pthread_t ckpt_thread;
+int ckpt_running = 0;
+
+//* Dirty i-nodes of the epoch a snapshot ended
+typedef struct ckpt_cut {
+    int first;
+    unsigned int parity;
+} CkptCut;
+
+
+//* Path of the image, or NULL if there are no checkpoints
+static char *ckpt_path() {
+    char *path = getenv("TECNICOFS_CHECKPOINT");
+
+    return path != NULL && *path != '\0' ? path : NULL;
+}
+
+
+/*
+ * Builds the path of a checkpoint file: the image, or its delta n.
+ * Returns: SUCCESS, or FAIL if it doesn't fit
+ */
+static int ckpt_file(char *file, size_t size, int n, char *suffix) {
+    int len = n == 0 ? snprintf(file, size, "%s%s", ckpt_path(), suffix)
+                     : snprintf(file, size, "%s.%d%s", ckpt_path(), n, suffix);
+
+    return len < size ? SUCCESS : FAIL;
+}
+
+
+/*
+ * Checks the entry table of a directory: names that end inside their
+ * slot, as many entries in use as its size says, and inumbers in range
+ * that aren't the root. In a full image each entry must also name an
+ * i-node in use that no other entry names.
+ * Input:
+ *  - map: the mapped file
+ *  - inode: the directory
+ *  - inodes: i-nodes of a full image, or NULL for a delta
+ *  - count: how many
+ *  - seen: the i-nodes of a full image already named by an entry
+ * Returns: SUCCESS or FAIL
+ */
+static int ckpt_valid_dir(char *map, CkptInode *inode, CkptInode *inodes, int count, char *seen) {
+    DirEntry *entries = (DirEntry *) (map + inode->entries);
+    int used = 0;
+
+    for (int i = 0; i < inode->capacity; i++) {
+        int inumber = entries[i].inumber;
+
+        if (inumber == FREE_INODE) {
+            continue;
+        }
+        if (memchr(entries[i].name, '\0', MAX_FILE_NAME) == NULL || entries[i].name[0] == '\0'
+            || inumber <= FS_ROOT || inumber >= MAX_INODES) {
+            return FAIL;
+        }
+        if (inodes != NULL) {
+            if (inumber >= count || inodes[inumber].nodeType == T_NONE || seen[inumber]) {
+                return FAIL;
+            }
+            seen[inumber] = 1;
+        }
+        used++;
+    }
+    return used == inode->size ? SUCCESS : FAIL;
+}
+
+
+/*
+ * Checks that a mapped file is complete, of this server, and that its
+ * i-nodes and entry tables stay inside it and hold only valid entries.
+ * A full image must have every inumber in order, starting with the root
+ * directory, and every other i-node in use named by exactly one entry.
+ * Reads every entry table, so a bad file is refused before any
+ * directory points into it.
+ * Returns: SUCCESS or FAIL
+ */
+static int ckpt_valid(char *map, size_t size, uint32_t magic) {
+    CkptHeader *header = (CkptHeader *) map;
+    CkptInode *inodes = (CkptInode *) (header + 1);
+    char *seen = NULL;
+    int result = SUCCESS;
+
+    if (size < sizeof(CkptHeader) || header->magic != magic || header->version != CKPT_VERSION
+        || header->entry_size != sizeof(DirEntry) || header->size != size || header->inodes < 0
+        || (size - sizeof(CkptHeader)) / sizeof(CkptInode) < header->inodes
+        || (magic == CKPT_MAGIC && (header->inodes <= FS_ROOT || inodes[FS_ROOT].nodeType != T_DIRECTORY))) {
+        return FAIL;
+    }
+
+    for (int i = 0; i < header->inodes; i++) {
+        CkptInode *inode = &inodes[i];
+
+        if (inode->inumber < 0 || inode->inumber >= MAX_INODES
+            || (magic == CKPT_MAGIC && inode->inumber != i)
+            || (inode->inumber == FS_ROOT && inode->nodeType != T_DIRECTORY)) {
+            return FAIL;
+        }
+        if (inode->nodeType == T_DIRECTORY) {
+            if (inode->capacity <= 0 || (inode->capacity & (inode->capacity - 1)) != 0
+                || inode->size < 0 || inode->size >= inode->capacity
+                || inode->entries % sizeof(int) != 0 || inode->entries > size
+                || (size - inode->entries) / sizeof(DirEntry) < inode->capacity) {
+                return FAIL;
+            }
+        }
+        else if (inode->nodeType != T_FILE && inode->nodeType != T_NONE) {
+            return FAIL;
+        }
+    }
+
+    //* The tables are inside the file now, check what they hold
+    if (magic == CKPT_MAGIC && (seen = calloc(header->inodes, 1)) == NULL) {
+        fprintf(stderr, "Error: problem allocating the checkpoint\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < header->inodes && result == SUCCESS; i++) {
+        if (inodes[i].nodeType == T_DIRECTORY) {
+            result = ckpt_valid_dir(map, &inodes[i], seen != NULL ? inodes : NULL, header->inodes, seen);
+        }
+    }
+    for (int i = FS_ROOT + 1; seen != NULL && i < header->inodes && result == SUCCESS; i++) {
+        if (inodes[i].nodeType != T_NONE && !seen[i]) {
+            result = FAIL;
+        }
+    }
+    free(seen);
+    return result;
+}
+
+
+/*
+ * Maps a checkpoint file and checks it.
+ * Input:
+ *  - file: its path
+ *  - magic: of a full image or of a delta
+ *  - size: filled with its size
+ * Returns: the mapping, or NULL if missing or invalid
+ */
+static char *ckpt_map(char *file, uint32_t magic, size_t *size) {
+    struct stat st;
+    char *map;
+    int fd;
+
+    if ((fd = open(file, O_RDONLY | O_CLOEXEC)) < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(CkptHeader)) {
+        close(fd);
+        return NULL;
+    }
+    //* Private and writable: changed entry pages are copied, never written back
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    if (ckpt_valid(map, st.st_size, magic) == FAIL) {
+        log_printf(LOG_WARN, "Checkpoint: %s is not valid, ignoring it\n", file);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    *size = st.st_size;
+    return map;
+}
+
+
+/*
+ * Restores the i-nodes of a mapped file, over those of the files before.
+ * The mapping is kept: directories use its entry tables.
+ */
+static void ckpt_apply(char *map, size_t size) {
+    CkptHeader *header = (CkptHeader *) map;
+    CkptInode *inodes = (CkptInode *) (header + 1);
+
+    if (dir_entries_map(map, size) == FAIL) {
+        fprintf(stderr, "Error: too many checkpoint files\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < header->inodes; i++) {
+        int result = SUCCESS;
+
+        inode_forget(inodes[i].inumber);
+        if (inodes[i].nodeType == T_FILE) {
+            result = inode_restore(inodes[i].inumber, T_FILE);
+        }
+        else if (inodes[i].nodeType == T_DIRECTORY) {
+            result = inode_restore_dir(inodes[i].inumber, inodes[i].size, inodes[i].capacity,
+                                       (DirEntry *) (map + inodes[i].entries));
+        }
+        if (result == FAIL) {
+            fprintf(stderr, "Error: problem restoring the checkpoint\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    ckpt_last = header->log_offset;
+}
+
+
+/*
+ * Maps the image, if there is a valid one, and its deltas, and restores
+ * their i-nodes. Deltas that don't follow the files before are left
+ * over from an older image and deleted. Runs on start, before any other
+ * thread.
+ * Input:
+ *  - log_offset: filled with the bytes of the log the files include
+ * Returns: SUCCESS, or FAIL if there is no image to start from
+ */
+int ckpt_load(unsigned long long *log_offset) {
+    char file[PATH_MAX], *map;
+    unsigned int parity;
+    size_t size;
+
+    if (ckpt_path() == NULL || ckpt_file(file, sizeof(file), 0, "") == FAIL
+        || (map = ckpt_map(file, CKPT_MAGIC, &size)) == NULL) {
+        return FAIL;
+    }
+    ckpt_apply(map, size);
+
+    for (int n = 1; n <= CKPT_MAX_DELTAS && ckpt_file(file, sizeof(file), n, "") == SUCCESS; n++) {
+        if (ckpt_deltas == n - 1 && (map = ckpt_map(file, CKPT_DELTA_MAGIC, &size)) != NULL) {
+            if (((CkptHeader *) map)->base_offset == ckpt_last) {
+                ckpt_apply(map, size);
+                ckpt_deltas = n;
+                continue;
+            }
+            munmap(map, size);
+        }
+        unlink(file);
+    }
+
+    //* The restored i-nodes are in the files already
+    inode_dirty_cut(&parity);
+    ckpt_full_due = 0;
+    *log_offset = ckpt_last;
+    log_printf(LOG_INFO, "Checkpoint: loaded image and %d deltas, log offset %llu\n", ckpt_deltas, ckpt_last);
+    return SUCCESS;
+}
+
+
+/*
+ * Returns the capacity a directory with count entries has in a file:
+ * the one it would have grown to.
+ */
+static int ckpt_dir_capacity(int count) {
+    int capacity = DIR_INITIAL_CAPACITY;
+
+    while (count * 4 > capacity * 3) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+
+/*
+ * Writes the entry table of a directory image, hashed as in memory.
+ * Returns: SUCCESS or FAIL
+ */
+static int ckpt_write_dir(FILE *fp, CowImage *image, int capacity) {
+    DirEntry *entries = calloc(capacity, sizeof(DirEntry));
+    int mask = capacity - 1, result;
+
+    if (entries == NULL) {
+        fprintf(stderr, "Error: problem allocating directory entries\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < capacity; i++) {
+        entries[i].inumber = FREE_INODE;
+    }
+    for (int i = 0; i < image->count; i++) {
+        int slot = image->entries[i].hash & mask;
+
+        while (entries[slot].inumber != FREE_INODE) {
+            slot = (slot + 1) & mask;
+        }
+        entries[slot] = image->entries[i];
+    }
+    result = fwrite(entries, sizeof(DirEntry), capacity, fp) == capacity ? SUCCESS : FAIL;
+    free(entries);
+    return result;
+}
+
+
+/*
+ * Syncs the directory of a path, so a rename in it is on disk.
+ */
+static void ckpt_sync_dir(char *path) {
+    char copy[PATH_MAX];
+    int fd;
+
+    snprintf(copy, sizeof(copy), "%s", path);
+    if ((fd = open(dirname(copy), O_RDONLY | O_CLOEXEC)) >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+
+/*
+ * Writes a checkpoint file from the images of a snapshot. The log is
+ * synced up to the snapshot before the file is renamed into place.
+ * Input:
+ *  - n: 0 for the full image, or the number of the delta
+ *  - snapshot: the snapshot
+ *  - inumbers: the i-nodes to write
+ *  - images: their images, NULL for those not in use
+ *  - count: how many
+ * Returns: SUCCESS or FAIL
+ */
+static int ckpt_write_file(int n, CowSnapshot *snapshot, int *inumbers, CowImage **images, int count) {
+    char file[PATH_MAX], tmp[PATH_MAX];
+    CkptHeader header;
+    CkptInode *inodes;
+    uint64_t offset = sizeof(CkptHeader) + count * sizeof(CkptInode);
+    int result = SUCCESS;
+    FILE *fp;
+
+    if (ckpt_file(file, sizeof(file), n, "") == FAIL || ckpt_file(tmp, sizeof(tmp), n, ".tmp") == FAIL) {
+        return FAIL;
+    }
+    if ((inodes = calloc(count > 0 ? count : 1, sizeof(CkptInode))) == NULL) {
+        fprintf(stderr, "Error: problem allocating the checkpoint\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < count; i++) {
+        inodes[i].inumber = inumbers[i];
+        inodes[i].nodeType = images[i] != NULL ? images[i]->nodeType : T_NONE;
+        if (inodes[i].nodeType == T_DIRECTORY) {
+            inodes[i].size = images[i]->count;
+            inodes[i].capacity = ckpt_dir_capacity(images[i]->count);
+            inodes[i].entries = offset;
+            offset += inodes[i].capacity * sizeof(DirEntry);
+        }
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = n == 0 ? CKPT_MAGIC : CKPT_DELTA_MAGIC;
+    header.version = CKPT_VERSION;
+    header.entry_size = sizeof(DirEntry);
+    header.inodes = count;
+    header.base_offset = ckpt_last;
+    header.log_offset = snapshot->log_offset;
+    header.size = offset;
+
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        result = FAIL;
+    }
+    else {
+        if (fwrite(&header, sizeof(header), 1, fp) != 1
+            || fwrite(inodes, sizeof(CkptInode), count, fp) != count) {
+            result = FAIL;
+        }
+        for (int i = 0; i < count && result == SUCCESS; i++) {
+            if (inodes[i].nodeType == T_DIRECTORY) {
+                result = ckpt_write_dir(fp, images[i], inodes[i].capacity);
+            }
+        }
+        if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+            result = FAIL;
+        }
+        fclose(fp);
+    }
+
+    if (result == SUCCESS) {
+        wal_flush(snapshot->log_offset);
+        if (rename(tmp, file) != 0) {
+            result = FAIL;
+        }
+        ckpt_sync_dir(file);
+    }
+    if (result == SUCCESS) {
+        ckpt_last = snapshot->log_offset;
+        log_printf(LOG_INFO, "Checkpoint: wrote %s, %d i-nodes, log offset %llu\n", file, count, ckpt_last);
+    }
+    else {
+        log_printf(LOG_ERROR, "Checkpoint: problem writing %s\n", tmp);
+        unlink(tmp);
+    }
+    free(inodes);
+    return result;
+}
+
+
+/*
+ * Ends the dirty epoch at the cut of a snapshot.
+ */
+static void ckpt_cut(void *arg) {
+    CkptCut *cut = arg;
+
+    cut->first = inode_dirty_cut(&cut->parity);
+}
+
+
+/*
+ * Writes a full image, walking the namespace of a snapshot, and deletes
+ * the deltas it replaces.
+ * Returns: SUCCESS or FAIL
+ */
+static int ckpt_write_full() {
+    char file[PATH_MAX];
+    CkptCut cut;
+    CowSnapshot *snapshot = cow_take(ckpt_cut, &cut);
+    CowImage **images = calloc(snapshot->capacity, sizeof(CowImage *));
+    int *stack = malloc(snapshot->capacity * sizeof(int));
+    int top = 0, count = FS_ROOT + 1, result;
+
+    if (images == NULL || stack == NULL) {
+        fprintf(stderr, "Error: problem allocating the checkpoint\n");
+        exit(EXIT_FAILURE);
+    }
+
+    //* Every i-node is reached once, from its only parent
+    stack[top++] = FS_ROOT;
+    while (top > 0) {
+        int inumber = stack[--top];
+        CowImage *image = images[inumber] = inode_image(snapshot, inumber);
+
+        if (inumber >= count) {
+            count = inumber + 1;
+        }
+        for (int i = 0; i < image->count; i++) {
+            stack[top++] = image->entries[i].inumber;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        stack[i] = i;
+    }
+
+    if ((result = ckpt_write_file(0, snapshot, stack, images, count)) == SUCCESS) {
+        for (int n = 1; n <= CKPT_MAX_DELTAS; n++) {
+            if (ckpt_file(file, sizeof(file), n, "") == SUCCESS) {
+                unlink(file);
+            }
+        }
+        ckpt_deltas = 0;
+        ckpt_full_due = 0;
+    }
+    free(stack);
+    free(images);
+    cow_release(snapshot);
+    return result;
+}
+
+
+/*
+ * Writes a delta with the i-nodes changed since the last checkpoint.
+ * Returns: SUCCESS or FAIL
+ */
+static int ckpt_write_delta() {
+    CkptCut cut;
+    CowSnapshot *snapshot = cow_take(ckpt_cut, &cut);
+    CowImage **images = NULL;
+    int *inumbers = NULL, count = 0, size = 0, result;
+
+    for (int inumber = cut.first; inumber != FREE_INODE; inumber = inode_dirty_next(inumber, cut.parity)) {
+        if (count == size) {
+            size = size > 0 ? size * 2 : 64;
+            if ((inumbers = realloc(inumbers, size * sizeof(int))) == NULL
+                || (images = realloc(images, size * sizeof(CowImage *))) == NULL) {
+                fprintf(stderr, "Error: problem allocating the checkpoint\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        inumbers[count] = inumber;
+        images[count++] = inode_image(snapshot, inumber);
+    }
+
+    if ((result = ckpt_write_file(ckpt_deltas + 1, snapshot, inumbers, images, count)) == SUCCESS) {
+        ckpt_deltas++;
+    }
+    else {
+        //* Its changes are only in memory now
+        ckpt_full_due = 1;
+    }
+    free(inumbers);
+    free(images);
+    cow_release(snapshot);
+    return result;
+}
+
+
+/*
+ * Writes a checkpoint: a delta, or a full image when there is none yet,
+ * the deltas are at their limit or one failed.
+ * Returns: SUCCESS or FAIL
+ */
+int ckpt_write() {
+    if (ckpt_path() == NULL) {
+        return FAIL;
+    }
+    if (ckpt_full_due || ckpt_deltas == CKPT_MAX_DELTAS) {
+        return ckpt_write_full();
+    }
+    return ckpt_write_delta();
+}
+
+
+/*
+ * Checkpointer: writes a checkpoint every time the log grew enough.
+ */
+static void *ckpt_run() {
+    while (__atomic_load_n(&ckpt_running, __ATOMIC_ACQUIRE)) {
+        sleep(CKPT_POLL_SEC);
+        if (wal_position() - ckpt_last >= ckpt_log_bytes) {
+            ckpt_write();
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Starts the checkpointer, if there is an image to keep.
+ */
+void ckpt_start() {
+    char *bytes = getenv("TECNICOFS_CHECKPOINT_BYTES");
+
+    if (ckpt_path() == NULL) {
+        return;
+    }
+    if (bytes != NULL && strtoull(bytes, NULL, 10) > 0) {
+        ckpt_log_bytes = strtoull(bytes, NULL, 10);
+    }
+    ckpt_running = 1;
+    if (pthread_create(&ckpt_thread, NULL, ckpt_run, NULL) != 0) {
+        fprintf(stderr, "Error: problems creating thread\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+ * Stops the checkpointer. The mapped files stay: directories may still
+ * use their tables.
+ */
+void ckpt_stop() {
+    if (!ckpt_running) {
+        return;
+    }
+    __atomic_store_n(&ckpt_running, 0, __ATOMIC_RELEASE);
+    pthread_join(ckpt_thread, NULL);
+}
@@ -0,0 +1,57 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+#include "state.h"
+
+/*
+ * Checkpoint image of the namespace, in the file named by
+ * TECNICOFS_CHECKPOINT, plus deltas named after it with .1, .2, ...
+ * Each file has a header, then one CkptInode per i-node it has, then
+ * the entry table of its directories laid out exactly as in memory. A
+ * full image has every inumber; a delta has only the i-nodes changed
+ * since the file before it, whose log offset is its base. On start the
+ * files are checked, entry by entry, and mapped privately, and each
+ * directory points at its table in the mapping, so starting copies no
+ * entries: their pages are only copied when changed. A file that isn't
+ * valid is ignored, with the deltas after it, and the log is replayed
+ * from the offset the last valid file includes, or from the start.
+ * A background thread writes a delta from a snapshot every time the
+ * log grows by TECNICOFS_CHECKPOINT_BYTES (CKPT_LOG_BYTES by default):
+ * changed i-nodes are tracked in a dirty set, so it costs what changed,
+ * not the size of the namespace. After CKPT_MAX_DELTAS deltas the next
+ * checkpoint is a full image that replaces them all. Every file is
+ * written to a temporary one and renamed.
+ */
+#define CKPT_MAGIC 0x50434654 /* "TFCP" */
+#define CKPT_DELTA_MAGIC 0x44434654 /* "TFCD" */
+#define CKPT_VERSION 2
+#define CKPT_LOG_BYTES (1024 * 1024)
+#define CKPT_MAX_DELTAS 8
+/* How often the checkpointer looks at the log, in seconds */
+#define CKPT_POLL_SEC 1
+
+typedef struct ckpt_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t entry_size; /* sizeof(DirEntry) of the server that wrote it */
+	int32_t inodes; /* CkptInode that follow */
+	uint64_t base_offset; /* log offset of the file a delta applies to */
+	uint64_t log_offset; /* bytes of the log it includes */
+	uint64_t size; /* of the whole file */
+} CkptHeader;
+
+typedef struct ckpt_inode {
+	int32_t inumber;
+	int32_t nodeType; /* T_NONE if deleted */
+	int32_t size; /* entries in use, of a directory */
+	int32_t capacity; /* slots of its entry table, a power of 2 */
+	uint64_t entries; /* offset of the entry table in the file */
+} CkptInode;
+
+int ckpt_load(unsigned long long *log_offset);
+int ckpt_write();
+void ckpt_start();
+void ckpt_stop();
+
+#endif /* CHECKPOINT_H */
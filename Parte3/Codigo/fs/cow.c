@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+#include "cow.h"
+#include "wal.h"
+
+//* Snapshot the operations that start now save images for, if any
+CowSnapshot *cow_current = NULL;
+
+//* Set while the snapshot is switched: operations wait to start
+int cow_gate = 0;
+pthread_mutex_t cow_gate_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cow_gate_open = PTHREAD_COND_INITIALIZER;
+
+//* One export at a time
+pthread_mutex_t cow_export_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//* Records of every running thread that changed the tree
+CowThread *cow_threads = NULL;
+pthread_mutex_t cow_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//* Releases the record of a thread when it exits
+pthread_key_t cow_key;
+pthread_once_t cow_key_once = PTHREAD_ONCE_INIT;
+
+static __thread CowThread *cow_self = NULL;
+
+
+/*
+ * Unlinks and frees the record of an exiting thread, which is in no
+ * operation.
+ */
+static void cow_release_thread(void *record) {
+    CowThread *self = record, **link;
+
+    pthread_mutex_lock(&cow_threads_lock);
+    for (link = &cow_threads; *link != self; link = &(*link)->next) {}
+    *link = self->next;
+    pthread_mutex_unlock(&cow_threads_lock);
+
+    cow_self = NULL;
+    free(self);
+}
+
+
+static void cow_key_create() {
+    if (pthread_key_create(&cow_key, cow_release_thread) != 0) {
+        fprintf(stderr, "Error: problem creating snapshot key\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+ * Returns the record of the calling thread, registering it on first use.
+ */
+static CowThread *cow_thread() {
+    CowThread *self = cow_self;
+
+    if (self != NULL) {
+        return self;
+    }
+
+    if (posix_memalign((void **) &self, 64, sizeof(CowThread)) != 0) {
+        fprintf(stderr, "Error: problem allocating snapshot record\n");
+        exit(EXIT_FAILURE);
+    }
+    self->active = 0;
+    self->snapshot = NULL;
+
+    pthread_mutex_lock(&cow_threads_lock);
+    self->next = cow_threads;
+    cow_threads = self;
+    pthread_mutex_unlock(&cow_threads_lock);
+
+    pthread_once(&cow_key_once, cow_key_create);
+    pthread_setspecific(cow_key, self);
+    cow_self = self;
+    return self;
+}
+
+
+/*
+ * Starts an operation that may change the tree, waiting if a snapshot
+ * is being switched.
+ */
+void cow_op_begin() {
+    CowThread *self = cow_thread();
+
+    while (1) {
+        __atomic_store_n(&self->active, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&cow_gate, __ATOMIC_SEQ_CST)) {
+            break;
+        }
+        __atomic_store_n(&self->active, 0, __ATOMIC_SEQ_CST);
+
+        pthread_mutex_lock(&cow_gate_lock);
+        while (__atomic_load_n(&cow_gate, __ATOMIC_ACQUIRE)) {
+            pthread_cond_wait(&cow_gate_open, &cow_gate_lock);
+        }
+        pthread_mutex_unlock(&cow_gate_lock);
+    }
+    self->snapshot = __atomic_load_n(&cow_current, __ATOMIC_ACQUIRE);
+}
+
+
+void cow_op_end() {
+    cow_self->snapshot = NULL;
+    __atomic_store_n(&cow_self->active, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Returns the image the running operation must save before changing
+ * the i-node, or NULL if there is none to save. The caller holds the
+ * i-node's write lock.
+ */
+CowImage *cow_image(int inumber) {
+    CowSnapshot *snapshot = cow_self != NULL ? cow_self->snapshot : NULL;
+
+    if (snapshot == NULL || inumber >= snapshot->capacity
+        || snapshot->images[inumber].state != COW_LIVE) {
+        return NULL;
+    }
+    return &snapshot->images[inumber];
+}
+
+
+/*
+ * Closes the gate to new operations and waits for those running. The
+ * list lock keeps exiting threads from freeing their records meanwhile.
+ */
+static void cow_quiesce() {
+    __atomic_store_n(&cow_gate, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&cow_threads_lock);
+    for (CowThread *t = cow_threads; t != NULL; t = t->next) {
+        while (__atomic_load_n(&t->active, __ATOMIC_SEQ_CST)) {
+            sched_yield();
+        }
+    }
+    pthread_mutex_unlock(&cow_threads_lock);
+}
+
+
+/*
+ * Lets operations start again, saving images for snapshot.
+ */
+static void cow_resume(CowSnapshot *snapshot) {
+    __atomic_store_n(&cow_current, snapshot, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&cow_gate_lock);
+    __atomic_store_n(&cow_gate, 0, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&cow_gate_open);
+    pthread_mutex_unlock(&cow_gate_lock);
+}
+
+
+/*
+ * Takes a snapshot of the tree as it is between the operations running
+ * now and the next ones.
+ * Input:
+ *  - cut: if not NULL, called with arg at that point, with no operation running
+ */
+CowSnapshot *cow_take(void (*cut)(void *), void *arg) {
+    CowSnapshot *snapshot;
+
+    pthread_mutex_lock(&cow_export_lock);
+    cow_quiesce();
+    //* No i-node can be created while the gate is closed
+    snapshot = malloc(sizeof(CowSnapshot));
+    if (snapshot == NULL
+        || (snapshot->images = calloc(inode_table_capacity(), sizeof(CowImage))) == NULL) {
+        fprintf(stderr, "Error: problem allocating snapshot\n");
+        exit(EXIT_FAILURE);
+    }
+    snapshot->capacity = inode_table_capacity();
+    //* Operations log before they end, so the log is cut here too
+    snapshot->log_offset = wal_position();
+    if (cut != NULL) {
+        cut(arg);
+    }
+    cow_resume(snapshot);
+    return snapshot;
+}
+
+
+/*
+ * Drops a snapshot, once no operation saves images for it anymore.
+ */
+void cow_release(CowSnapshot *snapshot) {
+    cow_quiesce();
+    cow_resume(NULL);
+    pthread_mutex_unlock(&cow_export_lock);
+
+    for (int i = 0; i < snapshot->capacity; i++) {
+        free(snapshot->images[i].entries);
+    }
+    free(snapshot->images);
+    free(snapshot);
+}
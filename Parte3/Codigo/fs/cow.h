@@ -0,0 +1,52 @@
+#ifndef COW_H
+#define COW_H
+
+#include "state.h"
+
+/*
+ * Copy-on-write snapshots of the tree, for exports that run alongside
+ * the other operations. A snapshot doesn't copy anything when taken:
+ * the operations that change a directory, or delete an i-node, first
+ * save its image (type and entries) if the snapshot needs it. An
+ * export reads the saved image of an i-node, or the live one, which
+ * then can't change anymore for that snapshot. Both happen under the
+ * i-node lock, so every i-node is seen as it was when the snapshot was
+ * taken. A snapshot is taken, and dropped, between operations: new ones
+ * wait while those running finish, so none straddles it.
+ */
+
+/* State of the image of an i-node in a snapshot */
+#define COW_LIVE 0 /* not changed since the snapshot, nor read */
+#define COW_SAVED 1 /* saved by the first change */
+#define COW_READ 2 /* read live by the export; later changes don't matter */
+
+typedef struct cow_image {
+	int state;
+	type nodeType;
+	int count;
+	DirEntry *entries;
+} CowImage;
+
+typedef struct cow_snapshot {
+	int capacity; /* i-nodes created after it can't be reached from it */
+	unsigned long long log_offset; /* bytes of the log it includes */
+	CowImage *images;
+} CowSnapshot;
+
+/*
+ * Per-thread record, on its own cache line: if it is in a changing
+ * operation, and the snapshot that operation saves images for
+ */
+typedef struct cow_thread {
+	int active;
+	CowSnapshot *snapshot;
+	struct cow_thread *next;
+} __attribute__((aligned(64))) CowThread;
+
+void cow_op_begin();
+void cow_op_end();
+CowImage *cow_image(int inumber);
+CowSnapshot *cow_take(void (*cut)(void *), void *arg);
+void cow_release(CowSnapshot *snapshot);
+
+#endif /* COW_H */
@@ -0,0 +1,379 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "dcache.h"
+
+DcacheBucket dcache[DCACHE_BUCKETS];
+DcacheTags dcache_tags[DCACHE_BUCKETS];
+
+//* Bumped when a move starts and when it ends
+unsigned long dcache_current_epoch = 0;
+//* Moves running: while there are any, nothing is cached
+int dcache_moves = 0;
+
+//* Counters of every running thread that used the cache
+DcacheCounters *dcache_counters = NULL;
+pthread_mutex_t dcache_counters_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//* Counters of the threads that exited, kept for dcache_stats
+long dcache_exited_hits = 0, dcache_exited_misses = 0;
+
+//* Releases the counters of a thread when it exits
+pthread_key_t dcache_key;
+pthread_once_t dcache_key_once = PTHREAD_ONCE_INIT;
+
+static __thread DcacheCounters *dcache_self = NULL;
+
+
+/*
+ * Hash of a path (FNV-1a).
+ * Input:
+ *  - path: normalized path
+ *  - prefixes: if not NULL, filled with a bit for the hash of each
+ *    directory on the path and one for the path's own
+ */
+static unsigned int dcache_hash(char *path, unsigned long long *prefixes) {
+    unsigned int hash = 2166136261u;
+    unsigned long long bits = 0;
+
+    for (; *path != '\0'; path++) {
+        if (*path == '/') {
+            bits |= 1ULL << (hash % 64);
+        }
+        hash ^= (unsigned char) *path;
+        hash *= 16777619u;
+    }
+    if (prefixes != NULL) {
+        *prefixes = bits | 1ULL << (hash % 64);
+    }
+    return hash;
+}
+
+
+//* Locks a bucket for write, making its sequence odd
+static void dcache_lock(DcacheBucket *bucket) {
+    if (pthread_mutex_lock(&bucket->lock) != 0) {
+        fprintf(stderr, "Error: problem locking the dentry cache\n");
+        exit(EXIT_FAILURE);
+    }
+    __atomic_store_n(&bucket->tags->seq, bucket->tags->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+static void dcache_unlock(DcacheBucket *bucket) {
+    __atomic_store_n(&bucket->tags->seq, bucket->tags->seq + 1, __ATOMIC_RELEASE);
+    if (pthread_mutex_unlock(&bucket->lock) != 0) {
+        fprintf(stderr, "Error: problem unlocking the dentry cache\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+ * Adds the counters of an exiting thread to those of the exited threads
+ * and frees them.
+ */
+static void dcache_release(void *record) {
+    DcacheCounters *self = record, **link;
+
+    pthread_mutex_lock(&dcache_counters_lock);
+    for (link = &dcache_counters; *link != self; link = &(*link)->next) {}
+    *link = self->next;
+    dcache_exited_hits += self->hits;
+    dcache_exited_misses += self->misses;
+    pthread_mutex_unlock(&dcache_counters_lock);
+
+    dcache_self = NULL;
+    free(self);
+}
+
+
+static void dcache_key_create() {
+    if (pthread_key_create(&dcache_key, dcache_release) != 0) {
+        fprintf(stderr, "Error: problem creating dentry cache key\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+ * Returns the counters of the calling thread, registering them on first use.
+ */
+static DcacheCounters *dcache_thread_counters() {
+    DcacheCounters *self = dcache_self;
+
+    if (self != NULL) {
+        return self;
+    }
+
+    if (posix_memalign((void **) &self, 64, sizeof(DcacheCounters)) != 0) {
+        fprintf(stderr, "Error: problem allocating dentry cache counters\n");
+        exit(EXIT_FAILURE);
+    }
+    self->hits = 0;
+    self->misses = 0;
+
+    pthread_mutex_lock(&dcache_counters_lock);
+    self->next = dcache_counters;
+    dcache_counters = self;
+    pthread_mutex_unlock(&dcache_counters_lock);
+
+    pthread_once(&dcache_key_once, dcache_key_create);
+    pthread_setspecific(dcache_key, self);
+    dcache_self = self;
+    return self;
+}
+
+
+/*
+ * Finds the entry of a path in a bucket.
+ * Returns: the entry or NULL
+ */
+static DcacheEntry *dcache_find(DcacheBucket *bucket, char *path, unsigned int hash) {
+    for (int i = 0; i < DCACHE_WAYS; i++) {
+        DcacheEntry *entry = &bucket->entries[i];
+
+        if (entry->inumber != FREE_INODE && entry->hash == hash && strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Initializes the dentry cache.
+ */
+void dcache_init() {
+    for (int b = 0; b < DCACHE_BUCKETS; b++) {
+        pthread_mutex_init(&dcache[b].lock, NULL);
+        dcache[b].tags = &dcache_tags[b];
+        dcache[b].tags->seq = 0;
+        dcache[b].next_victim = 0;
+        for (int i = 0; i < DCACHE_WAYS; i++) {
+            dcache[b].tags->prefixes[i] = 0;
+            dcache[b].entries[i].inumber = FREE_INODE;
+        }
+    }
+    dcache_current_epoch = 0;
+    dcache_moves = 0;
+}
+
+
+/*
+ * Destroys the dentry cache.
+ */
+void dcache_destroy() {
+    for (int b = 0; b < DCACHE_BUCKETS; b++) {
+        pthread_mutex_destroy(&dcache[b].lock);
+    }
+    while (dcache_counters != NULL) {
+        DcacheCounters *next = dcache_counters->next;
+        free(dcache_counters);
+        dcache_counters = next;
+    }
+    if (dcache_self != NULL) {
+        pthread_setspecific(dcache_key, NULL);
+    }
+    dcache_self = NULL;
+    dcache_exited_hits = dcache_exited_misses = 0;
+}
+
+
+/*
+ * Returns the current epoch. Entries created by a lookup must carry the
+ * epoch read before the lookup started, and a walk that took a path from
+ * the cache is only valid if the epoch didn't change meanwhile.
+ */
+unsigned long dcache_epoch() {
+    return __atomic_load_n(&dcache_current_epoch, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Tells whether an entry is of a path or of a path under it.
+ */
+static int dcache_under(DcacheEntry *entry, char *path, size_t len) {
+    return entry->inumber != FREE_INODE && strncmp(entry->path, path, len) == 0
+           && (entry->path[len] == '\0' || entry->path[len] == '/');
+}
+
+
+//* Whether a move is running
+static int dcache_moving() {
+    return __atomic_load_n(&dcache_moves, __ATOMIC_SEQ_CST) > 0;
+}
+
+
+/*
+ * Starts a move: removes the cached paths under the node it moves and
+ * keeps the cache from being filled until dcache_move_end. Must be called
+ * before the move changes any directory, holding the origin parent, so
+ * no lookup resolves a path under it meanwhile. Paths read from the cache
+ * before that change were right when read; walks that validate after it
+ * see the epoch changed. Buckets without such paths are only read.
+ * Input:
+ *  - path: normalized path of the node moved
+ */
+void dcache_move_begin(char *path) {
+    size_t len = strlen(path);
+    unsigned long long bit = 1ULL << (dcache_hash(path, NULL) % 64);
+
+    __atomic_add_fetch(&dcache_moves, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&dcache_current_epoch, 1, __ATOMIC_SEQ_CST);
+    for (int b = 0; b < DCACHE_BUCKETS; b++) {
+        DcacheBucket *bucket = &dcache[b];
+        DcacheTags *tags = &dcache_tags[b];
+        unsigned int seq = __atomic_load_n(&tags->seq, __ATOMIC_ACQUIRE);
+        int found = seq & 1;
+
+        for (int i = 0; i < DCACHE_WAYS && !found; i++) {
+            found = (tags->prefixes[i] & bit) && dcache_under(&bucket->entries[i], path, len);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (!found && __atomic_load_n(&tags->seq, __ATOMIC_RELAXED) == seq) {
+            continue;
+        }
+
+        dcache_lock(bucket);
+        for (int i = 0; i < DCACHE_WAYS; i++) {
+            if (dcache_under(&bucket->entries[i], path, len)) {
+                bucket->entries[i].inumber = FREE_INODE;
+            }
+        }
+        dcache_unlock(bucket);
+    }
+}
+
+
+/*
+ * Ends a move, once it changed its directories.
+ */
+void dcache_move_end() {
+    __atomic_add_fetch(&dcache_current_epoch, 1, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&dcache_moves, 1, __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ * Looks for a path in the cache without writing to the bucket.
+ * A bucket being written counts as a miss.
+ * Input:
+ *  - path: normalized path
+ *  - inumber, generation: filled with the entry, if found
+ * Returns: SUCCESS (hit) or FAIL (miss)
+ */
+int dcache_get(char *path, int *inumber, unsigned int *generation) {
+    unsigned int hash = dcache_hash(path, NULL);
+    DcacheBucket *bucket = &dcache[hash % DCACHE_BUCKETS];
+    DcacheCounters *counters = dcache_thread_counters();
+    unsigned int seq = __atomic_load_n(&bucket->tags->seq, __ATOMIC_ACQUIRE);
+    DcacheEntry found;
+    int result = FAIL;
+
+    if (!(seq & 1)) {
+        for (int i = 0; i < DCACHE_WAYS; i++) {
+            DcacheEntry *entry = &bucket->entries[i];
+
+            if (entry->inumber != FREE_INODE && entry->hash == hash
+                && strncmp(entry->path, path, MAX_PATH_SIZE) == 0) {
+                found.inumber = entry->inumber;
+                found.generation = entry->generation;
+                result = SUCCESS;
+                break;
+            }
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&bucket->tags->seq, __ATOMIC_RELAXED) != seq) {
+            result = FAIL;
+        }
+    }
+
+    if (result == SUCCESS) {
+        *inumber = found.inumber;
+        *generation = found.generation;
+        __atomic_store_n(&counters->hits, counters->hits + 1, __ATOMIC_RELAXED);
+    }
+    else {
+        __atomic_store_n(&counters->misses, counters->misses + 1, __ATOMIC_RELAXED);
+    }
+    return result;
+}
+
+
+/*
+ * Caches a path, unless a move ran since it was resolved or is running.
+ * This is checked under the bucket lock, so a move either removes the
+ * entry or keeps it out. Replaces the entry of the same path, a free one or, if
+ * there are none, the bucket entries in round robin.
+ * Input:
+ *  - path: normalized path
+ *  - inumber, generation: i-node the path resolved to
+ *  - epoch: epoch read before resolving the path
+ */
+void dcache_put(char *path, int inumber, unsigned int generation, unsigned long epoch) {
+    unsigned long long prefixes;
+    unsigned int hash = dcache_hash(path, &prefixes);
+    DcacheBucket *bucket = &dcache[hash % DCACHE_BUCKETS];
+    DcacheEntry *entry;
+
+    if (epoch != dcache_epoch() || dcache_moving()) {
+        return;
+    }
+
+    dcache_lock(bucket);
+    if (epoch != dcache_epoch() || dcache_moving()) {
+        dcache_unlock(bucket);
+        return;
+    }
+    if ((entry = dcache_find(bucket, path, hash)) == NULL) {
+        for (int i = 0; i < DCACHE_WAYS && entry == NULL; i++) {
+            if (bucket->entries[i].inumber == FREE_INODE) {
+                entry = &bucket->entries[i];
+            }
+        }
+        if (entry == NULL) {
+            entry = &bucket->entries[bucket->next_victim];
+            bucket->next_victim = (bucket->next_victim + 1) % DCACHE_WAYS;
+        }
+        strcpy(entry->path, path);
+        entry->hash = hash;
+        bucket->tags->prefixes[entry - bucket->entries] = prefixes;
+    }
+    entry->inumber = inumber;
+    entry->generation = generation;
+    dcache_unlock(bucket);
+}
+
+
+/*
+ * Removes a path from the cache.
+ */
+void dcache_remove(char *path) {
+    unsigned int hash = dcache_hash(path, NULL);
+    DcacheBucket *bucket = &dcache[hash % DCACHE_BUCKETS];
+    DcacheEntry *entry;
+
+    dcache_lock(bucket);
+    if ((entry = dcache_find(bucket, path, hash)) != NULL) {
+        entry->inumber = FREE_INODE;
+    }
+    dcache_unlock(bucket);
+}
+
+
+/*
+ * Sums the hit and miss counters of every thread.
+ */
+void dcache_stats(long *hits, long *misses) {
+    pthread_mutex_lock(&dcache_counters_lock);
+    *hits = dcache_exited_hits;
+    *misses = dcache_exited_misses;
+    for (DcacheCounters *counters = dcache_counters; counters != NULL; counters = counters->next) {
+        *hits += __atomic_load_n(&counters->hits, __ATOMIC_RELAXED);
+        *misses += __atomic_load_n(&counters->misses, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&dcache_counters_lock);
+}
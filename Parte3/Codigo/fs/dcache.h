@@ -0,0 +1,62 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include "state.h"
+
+/*
+ * Dentry cache: maps full (normalized) paths to inumbers.
+ * The cache is a set-associative table of DCACHE_BUCKETS buckets with
+ * DCACHE_WAYS entries each. Writers of a bucket take its mutex and make
+ * its sequence odd; readers don't lock, they retry if the sequence moved.
+ * The sequences are kept apart from the entries, with a summary of their
+ * paths, so that a move reads all of them without reading the entries.
+ */
+#define DCACHE_BUCKETS 1024
+#define DCACHE_WAYS 4
+
+/*
+ * Cached path. An entry is only valid while the i-node still has the
+ * same generation (bumped by every delete); a move removes the entries
+ * of the paths under the node it moves.
+ */
+typedef struct dcache_entry {
+	char path[MAX_PATH_SIZE];
+	unsigned int hash;
+	int inumber;
+	unsigned int generation;
+} DcacheEntry;
+
+typedef struct dcache_tags {
+	unsigned int seq;
+	/* per entry, a bit for the hash of each directory on its path and of
+	 * the path itself, so a move only reads the entries it may remove */
+	unsigned long long prefixes[DCACHE_WAYS];
+} DcacheTags;
+
+typedef struct dcache_bucket {
+	pthread_mutex_t lock;
+	DcacheTags *tags;
+	int next_victim;
+	DcacheEntry entries[DCACHE_WAYS];
+} DcacheBucket;
+
+/*
+ * Hit and miss counters of one thread, summed by dcache_stats
+ */
+typedef struct dcache_counters {
+	long hits;
+	long misses;
+	struct dcache_counters *next;
+} __attribute__((aligned(CACHE_LINE_SIZE))) DcacheCounters;
+
+void dcache_init();
+void dcache_destroy();
+unsigned long dcache_epoch();
+void dcache_move_begin(char *path);
+void dcache_move_end();
+int dcache_get(char *path, int *inumber, unsigned int *generation);
+void dcache_put(char *path, int inumber, unsigned int generation, unsigned long epoch);
+void dcache_remove(char *path);
+void dcache_stats(long *hits, long *misses);
+
+#endif /* DCACHE_H */
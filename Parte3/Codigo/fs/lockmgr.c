@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "lockmgr.h"
+
+
+/*
+ * Initializes an empty lock set.
+ */
+void lockset_init(LockSet *set) {
+    set->size = 0;
+    set->locked = 0;
+}
+
+
+/*
+ * Adds an i-node to the set, kept sorted by inumber. An i-node added
+ * twice is locked once, for write if any of the requests was.
+ * Input:
+ *  - set: lock set, not yet acquired
+ *  - inumber: identifier of the i-node
+ *  - mode: LOCK_READ or LOCK_WRITE
+ */
+void lockset_add(LockSet *set, int inumber, int mode) {
+    int i;
+
+    for (i = 0; i < set->size && set->inumbers[i] < inumber; i++) {}
+
+    if (i < set->size && set->inumbers[i] == inumber) {
+        if (mode == LOCK_WRITE) {
+            set->modes[i] = LOCK_WRITE;
+        }
+        return;
+    }
+
+    if (set->size == MAX_LOCKSET) {
+        fprintf(stderr, "Error: too many i-nodes in a lock set\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int j = set->size; j > i; j--) {
+        set->inumbers[j] = set->inumbers[j-1];
+        set->modes[j] = set->modes[j-1];
+    }
+    set->inumbers[i] = inumber;
+    set->modes[i] = mode;
+    set->size++;
+}
+
+
+/*
+ * Locks every i-node of the set in increasing inumber order.
+ */
+void lockset_acquire(LockSet *set) {
+    for (int i = 0; i < set->size; i++) {
+        if (set->modes[i] == LOCK_WRITE) {
+            wrLock(set->inumbers[i]);
+        }
+        else {
+            rdLock(set->inumbers[i]);
+        }
+    }
+    set->locked = 1;
+}
+
+
+/*
+ * Unlocks every i-node of the set and empties it.
+ */
+void lockset_release(LockSet *set) {
+    if (set->locked) {
+        for (int i = set->size - 1; i >= 0; i--) {
+            unlock(set->inumbers[i]);
+        }
+    }
+    lockset_init(set);
+}
+
+
+/*
+ * Checks if the set has the i-node locked.
+ * Returns: SUCCESS or FAIL
+ */
+int lockset_holds(LockSet *set, int inumber) {
+    if (set == NULL || !set->locked) {
+        return FAIL;
+    }
+    for (int i = 0; i < set->size; i++) {
+        if (set->inumbers[i] == inumber) {
+            return SUCCESS;
+        }
+    }
+    return FAIL;
+}
+
+
+/*
+ * Waits for the writer of an i-node to finish. Must be called holding
+ * no locks, it's how operations back off after a failed validation.
+ */
+void inode_wait(int inumber) {
+    rdLock(inumber);
+    unlock(inumber);
+}
@@ -0,0 +1,32 @@
+#ifndef LOCKMGR_H
+#define LOCKMGR_H
+
+#include "state.h"
+
+//* Type of lock
+#define LOCK_READ 0
+#define LOCK_WRITE 1
+
+//* Max i-nodes locked by one operation
+#define MAX_LOCKSET 8
+
+/*
+ * Set of i-nodes an operation needs, locked together in increasing
+ * inumber order. As every operation that blocks on more than one i-node
+ * goes through a lock set, the global order makes deadlocks impossible.
+ */
+typedef struct lock_set {
+	int inumbers[MAX_LOCKSET];
+	int modes[MAX_LOCKSET];
+	int size;
+	int locked;
+} LockSet;
+
+void lockset_init(LockSet *set);
+void lockset_add(LockSet *set, int inumber, int mode);
+void lockset_acquire(LockSet *set);
+void lockset_release(LockSet *set);
+int lockset_holds(LockSet *set, int inumber);
+void inode_wait(int inumber);
+
+#endif /* LOCKMGR_H */
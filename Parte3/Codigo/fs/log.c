@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include "log.h"
+
+#define LOG_WRAP 0xFFFFFFFFu
+
+log_level log_current = LOG_INFO;
+
+//* Rings of every thread that logged, never freed until log_destroy
+LogRing *log_rings = NULL;
+pthread_mutex_t log_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//* Releases the ring of a thread when it exits
+pthread_key_t log_key;
+
+pthread_t log_drainer;
+int log_stop = 0;
+
+static __thread LogRing *log_self = NULL;
+
+
+static inline unsigned int log_align(unsigned int len) {
+    return (len + sizeof(unsigned int) + 3) & ~3u;
+}
+
+
+static void log_release(void *ring) {
+    __atomic_store_n(&((LogRing *) ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Returns the ring of the calling thread: one left by a thread that
+ * exited, or a new one.
+ */
+static LogRing *log_thread() {
+    LogRing *self = log_self;
+    int unused = 0;
+
+    if (self != NULL) {
+        return self;
+    }
+
+    pthread_mutex_lock(&log_rings_lock);
+    for (self = log_rings; self != NULL; self = self->next) {
+        if (__atomic_compare_exchange_n(&self->in_use, &unused, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+        unused = 0;
+    }
+    if (self == NULL) {
+        if (posix_memalign((void **) &self, 64, sizeof(LogRing)) != 0) {
+            fprintf(stderr, "Error: problem allocating log ring\n");
+            exit(EXIT_FAILURE);
+        }
+        self->head = self->tail = 0;
+        self->in_use = 1;
+        self->next = log_rings;
+        __atomic_store_n(&log_rings, self, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&log_rings_lock);
+
+    pthread_setspecific(log_key, self);
+    log_self = self;
+    return self;
+}
+
+
+/*
+ * Writes out the records of a ring.
+ * Returns: number of records written
+ */
+static int log_drain_ring(LogRing *ring) {
+    unsigned int head = ring->head, tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    int count = 0;
+
+    while (head != tail) {
+        unsigned int index = head & (LOG_RING_SIZE - 1);
+        unsigned int word = *(unsigned int *) (ring->data + index);
+
+        if (word == LOG_WRAP) {
+            head += LOG_RING_SIZE - index;
+            continue;
+        }
+        fwrite(ring->data + index + sizeof(unsigned int), 1, word & 0xFFFFFF,
+               (word >> 24) == LOG_ERROR ? stderr : stdout);
+        head += log_align(word & 0xFFFFFF);
+        count++;
+    }
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+
+/*
+ * Writes out every ring.
+ * Returns: number of records written
+ */
+static int log_drain_all() {
+    int count = 0;
+
+    for (LogRing *ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        count += log_drain_ring(ring);
+    }
+    if (count > 0) {
+        fflush(stdout);
+        fflush(stderr);
+    }
+    return count;
+}
+
+
+static void *log_drain() {
+    while (!__atomic_load_n(&log_stop, __ATOMIC_ACQUIRE)) {
+        if (log_drain_all() == 0) {
+            usleep(LOG_IDLE_USEC);
+        }
+    }
+    log_drain_all();
+    return NULL;
+}
+
+
+/*
+ * Reads the level from the environment and starts the drainer. Must be
+ * called before anything is logged.
+ */
+void log_init() {
+    static const char *names[] = { "none", "error", "warn", "info", "debug" };
+    char *level = getenv("TECNICOFS_LOG_LEVEL");
+
+    for (int i = LOG_NONE; level != NULL && i <= LOG_DEBUG; i++) {
+        if (strcasecmp(level, names[i]) == 0) {
+            log_set_level(i);
+        }
+    }
+
+    if (pthread_key_create(&log_key, log_release) != 0
+        || pthread_create(&log_drainer, NULL, log_drain, NULL) != 0) {
+        fprintf(stderr, "Error: problem starting the logger\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+ * Writes out what is left and frees the rings. No thread may log after.
+ */
+void log_destroy() {
+    __atomic_store_n(&log_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(log_drainer, NULL);
+
+    while (log_rings != NULL) {
+        LogRing *next = log_rings->next;
+
+        free(log_rings);
+        log_rings = next;
+    }
+    log_self = NULL;
+}
+
+
+void log_set_level(log_level level) {
+    __atomic_store_n(&log_current, level, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Logs a message, if its level is enabled. It's formatted by the caller
+ * and then only copied to its ring.
+ */
+void log_printf(log_level level, const char *format, ...) {
+    char message[LOG_MAX_MESSAGE];
+    LogRing *ring;
+    unsigned int len, total, tail, index;
+    va_list args;
+    int res;
+
+    if (level > __atomic_load_n(&log_current, __ATOMIC_RELAXED) || level == LOG_NONE) {
+        return;
+    }
+
+    va_start(args, format);
+    res = vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    if (res < 0) {
+        return;
+    }
+    len = res < (int) sizeof(message) ? (unsigned int) res : sizeof(message) - 1;
+
+    ring = log_thread();
+    tail = ring->tail;
+    total = log_align(len);
+    index = tail & (LOG_RING_SIZE - 1);
+    //* Records are contiguous: a short end of the ring is skipped
+    if (LOG_RING_SIZE - index < total) {
+        total += LOG_RING_SIZE - index;
+    }
+    while (LOG_RING_SIZE - (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) < total) {
+        sched_yield();
+    }
+    if (LOG_RING_SIZE - index < log_align(len)) {
+        *(unsigned int *) (ring->data + index) = LOG_WRAP;
+        index = 0;
+    }
+
+    *(unsigned int *) (ring->data + index) = (level << 24) | len;
+    memcpy(ring->data + index + sizeof(unsigned int), message, len);
+    __atomic_store_n(&ring->tail, tail + total, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,41 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include "../tecnicofs-api-constants.h"
+
+/*
+ * Asynchronous logger. Each thread formats its messages into a ring of
+ * its own, without taking any lock, and a background thread writes the
+ * rings out to stdout (stderr for errors). Messages of one thread keep
+ * their order. A thread whose ring is full waits for the drainer, so no
+ * message is lost. The level is read from TECNICOFS_LOG_LEVEL (none,
+ * error, warn, info or debug; info by default) and can be changed at
+ * any time with log_set_level.
+ */
+#define LOG_RING_SIZE (64 * 1024)
+#define LOG_MAX_MESSAGE (2 * MAX_PATH_SIZE + 128)
+/* How long the drainer sleeps when every ring is empty, in microseconds */
+#define LOG_IDLE_USEC 1000
+
+typedef enum log_level { LOG_NONE, LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG } log_level;
+
+/*
+ * Ring of one thread: records are a header word (level and length) and
+ * the message, padded to 4 bytes. A ring whose thread exited is adopted
+ * by the next new thread.
+ */
+typedef struct log_ring {
+	unsigned int head; /* written by the drainer */
+	char pad0[60];
+	unsigned int tail; /* written by the owner */
+	int in_use;
+	struct log_ring *next;
+	char data[LOG_RING_SIZE];
+} __attribute__((aligned(64))) LogRing;
+
+void log_init();
+void log_destroy();
+void log_set_level(log_level level);
+void log_printf(log_level level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#endif /* LOG_H */
@@ -1,57 +1,76 @@
 #include "operations.h"
+#include "dcache.h"
+#include "reclaim.h"
+#include "lockmgr.h"
+#include "slab.h"
+#include "log.h"
+#include "cow.h"
+#include "wal.h"
+#include "checkpoint.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <sched.h>
 
-//* Type of lock
-#define READ 0
-#define WRITE 1
+//* Max nodes in a path, root included
+#define MAX_DEPTH (MAX_PATH_SIZE / 2 + 1)
 
+//* Max nodes read by the walks of one validation: two paths
+#define MAX_SNAPSHOT (2 * MAX_DEPTH)
 
-//* Save the entries of the inode_table that have been locked
-typedef struct locks_to_unlock{
-	int lockArray[INODE_TABLE_SIZE];
-	int size;
-} locks_to_unlock;
+//* Returned by the _aux functions when their nodes changed before being locked
+#define RETRY 1
 
+//* Optimistic lookups tried before falling back to locking
+#define OPTIMISTIC_RETRIES 8
 
-int check(locks_to_unlock *ltu, int inumber){
-	for(int i = 0; i < ltu->size; i++){
-		if(inumber == ltu->lockArray[i]){
-			return SUCCESS;
-		}
-	}
-	return FAIL;	
-}
+
+//* Nodes read by optimistic walks, validated together at the end
+typedef struct snapshot {
+	int inumbers[MAX_SNAPSHOT];
+	unsigned int versions[MAX_SNAPSHOT];
+	int size;
+	unsigned long epoch;
+	int cached;
+	int busy;
+} Snapshot;
 
 
 /*
- * Locks the inumber and adds to the ltu
+ * Copies a path without the leading, trailing and repeated slashes,
+ * so that every node has only one name in the dentry cache.
  * Input:
- *  - ltu: Struct that has the inumber that are locked
- *  - inumber
- * 	- mode: type of lock
+ *  - dest: buffer with at least MAX_PATH_SIZE chars
+ *  - path: path to normalize
  */
-void lock_inode(locks_to_unlock *ltu, int inumber, int mode){
-	if(check(ltu, inumber) != FAIL){
-		return;
-	}
+void normalize_path(char *dest, char *path) {
+	int len = 0;
 
-	if(mode == WRITE){
-		wrLock(inumber);
+	for (int i = 0; path[i] != '\0' && len < MAX_PATH_SIZE - 1; i++) {
+		if (path[i] == '/' && (len == 0 || dest[len-1] == '/')) {
+			continue;
+		}
+		dest[len++] = path[i];
 	}
-	else if(mode == READ){
-		rdLock(inumber);
+	if (len > 0 && dest[len-1] == '/') {
+		len--;
 	}
-	ltu->lockArray[(ltu->size)++] = inumber;
+	dest[len] = '\0';
 }
 
 
-void ltu_unlock(locks_to_unlock *ltu){
-	for(int i = 0; i < ltu->size; i++){
-		unlock(ltu->lockArray[i]);
+/*
+ * Checks if a normalized path is the given directory or is inside it.
+ * Returns: SUCCESS or FAIL
+ */
+int is_path_inside(char *path, char *dir) {
+	int len = strlen(dir);
+
+	if (strncmp(path, dir, len) == 0 && (path[len] == '\0' || path[len] == '/')) {
+		return SUCCESS;
 	}
+	return FAIL;
 }
 
 
@@ -67,6 +86,12 @@ void split_parent_child_from_path(char * path, char ** parent, char ** child) {
 	int n_slashes = 0, last_slash_location = 0;
 	int len = strlen(path);
 
+	if (len == 0) {
+		*parent = "";
+		*child = path;
+		return;
+	}
+
 	// deal with trailing slash ( a/x vs a/x/ )
 	if (path[len-1] == '/') {
 		path[len-1] = '\0';
@@ -93,18 +118,65 @@ void split_parent_child_from_path(char * path, char ** parent, char ** child) {
 
 
 /*
- * Initializes tecnicofs and creates root node.
+ * Redoes a change read from the log, on the i-nodes it names. Runs on
+ * start, before any other thread, so nothing is locked.
+ */
+static void redo(WalRecord *record, char *name, char *target_name) {
+	int result = FAIL;
+
+	switch (record->op) {
+		case WAL_CREATE:
+			result = inode_restore(record->inumber, record->nodeType);
+			if (result == SUCCESS) {
+				result = dir_add_entry(record->parent, record->inumber, name);
+			}
+			break;
+		case WAL_DELETE:
+			result = dir_reset_entry(record->parent, record->inumber, name);
+			if (result == SUCCESS) {
+				result = inode_delete(record->inumber);
+			}
+			break;
+		case WAL_MOVE:
+			result = dir_reset_entry(record->parent, record->inumber, name);
+			if (result == SUCCESS) {
+				result = dir_add_entry(record->target, record->inumber, target_name);
+			}
+			break;
+	}
+	if (result == FAIL) {
+		fprintf(stderr, "Error: log doesn't match the file system\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+/*
+ * Initializes tecnicofs from the checkpoint, if there is one, or with
+ * just the root node, then redoes the changes in the log after it.
  */
 void init_fs() {
+	unsigned long long log_offset = 0;
+
 	inode_table_init();
-	
-	/* create root inode */
-	int root = inode_create(T_DIRECTORY);
-	
-	if (root != FS_ROOT) {
-		printf("failed to create node for tecnicofs root\n");
-		exit(EXIT_FAILURE);
+	dcache_init();
+
+	if (ckpt_load(&log_offset) == FAIL) {
+		/* create root inode */
+		int root = inode_create(T_DIRECTORY);
+
+		if (root != FS_ROOT) {
+			log_printf(LOG_ERROR, "failed to create node for tecnicofs root\n");
+			exit(EXIT_FAILURE);
+		}
 	}
+
+	//* Redoing the log is not an operation under test
+	insert_delay_skip(1);
+	wal_open(redo, log_offset);
+	insert_delay_skip(0);
+	inode_free_rebuild();
+	ckpt_start();
 }
 
 
@@ -112,26 +184,25 @@ void init_fs() {
  * Destroy tecnicofs and inode table.
  */
 void destroy_fs() {
+	ckpt_stop();
+	wal_close();
 	inode_table_destroy();
+	dcache_destroy();
+	slab_destroy();
 }
 
 
 /*
  * Checks if content of directory is not empty.
  * Input:
- *  - entries: entries of directory
+ *  - dir: directory
  * Returns: SUCCESS or FAIL
  */
 
-int is_dir_empty(DirEntry *dirEntries) {
-	if (dirEntries == NULL) {
+int is_dir_empty(Directory *dir) {
+	if (dir == NULL || dir->size != 0) {
 		return FAIL;
 	}
-	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-		if (dirEntries[i].inumber != FREE_INODE) {
-			return FAIL;
-		}
-	}
 	return SUCCESS;
 }
 
@@ -140,76 +211,294 @@ int is_dir_empty(DirEntry *dirEntries) {
  * Looks for node in directory entry from name.
  * Input:
  *  - name: path of node
- *  - entries: entries of directory
+ *  - dir: directory
  * Returns:
  *  - inumber: found node's inumber
  *  - FAIL: if not found
  */
-int lookup_sub_node(char *name, DirEntry *entries) {
-	if (entries == NULL) {
+int lookup_sub_node(char *name, Directory *dir) {
+	return dir_lookup_entry(dir, name);
+}
+
+
+/*
+ * Starts a snapshot with no nodes read.
+ */
+void snapshot_init(Snapshot *snap) {
+	snap->size = 0;
+	snap->epoch = dcache_epoch();
+	snap->cached = 0;
+	snap->busy = FAIL;
+}
+
+
+/*
+ * Records a node read by a walk. Nodes held by the caller can't change,
+ * so they aren't recorded.
+ * Input:
+ *  - snap: snapshot of the walk
+ *  - inumber: identifier of the node
+ *  - version: version returned by inode_read_begin
+ *  - held: locks held by the caller, may be NULL
+ * Returns: SUCCESS, or FAIL if the node is being written
+ */
+int snapshot_add(Snapshot *snap, int inumber, unsigned int version, LockSet *held) {
+	if (lockset_holds(held, inumber) == SUCCESS) {
+		return SUCCESS;
+	}
+	if (version & 1) {
+		snap->busy = inumber;
 		return FAIL;
 	}
-	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (entries[i].inumber != FREE_INODE && strcmp(entries[i].name, name) == 0) {
-            return entries[i].inumber;
-        }
-    }
-	return FAIL;
+	snap->inumbers[snap->size] = inumber;
+	snap->versions[snap->size++] = version;
+	return SUCCESS;
+}
+
+
+/*
+ * Checks that no node read since snapshot_init changed, so that every
+ * walk saw the tree as it is now: a writer holds the write lock (odd
+ * version) of every node it changes for its whole operation.
+ * Returns: SUCCESS, or FAIL with snap->busy set to the node that changed
+ */
+int snapshot_validate(Snapshot *snap) {
+	for (int i = 0; i < snap->size; i++) {
+		if (inode_read_validate(snap->inumbers[i], snap->versions[i]) == FAIL) {
+			snap->busy = snap->inumbers[i];
+			return FAIL;
+		}
+	}
+	//* A move changes paths without touching the cached nodes
+	if (snap->cached && dcache_epoch() != snap->epoch) {
+		return FAIL;
+	}
+	return SUCCESS;
 }
 
 
 /*
- * Lookup for a given path.
+ * Walks a path without taking any lock, recording the nodes it reads.
+ * The result is only meaningful if snapshot_validate succeeds afterwards;
+ * the caller must be inside reclaim_enter/exit.
  * Input:
- *  - name: path of node
- * 	- ltu: Struct that has the inumber that are locked
- * 	- mode: type of lock
- * 	- command: used for special cases
- * Returns:
- *  inumber: identifier of the i-node, if found
- *     FAIL: otherwise
+ *  - name: normalized path of node
+ *  - held: locks held by the caller, may be NULL
+ *  - snap: snapshot the walk is part of
+ *  - result: filled with the inumber, or FAIL if not found
+ * Returns: SUCCESS, or FAIL if a node is being written
  */
-int lookup(char *name, locks_to_unlock *ltu, int mode) {
-	char *saveptr;
-	char full_path[MAX_FILE_NAME];
-	char delim[] = "/";
+int walk_path(char *name, LockSet *held, Snapshot *snap, int *result) {
+	char *saveptr, *path;
+	char full_path[MAX_PATH_SIZE];
+	unsigned int version, generation;
+	int current_inumber;
+
+	//* A cached node is valid if it wasn't deleted; moves remove the paths they change
+	if (name[0] != '\0' && dcache_get(name, &current_inumber, &generation) == SUCCESS) {
+		version = inode_read_begin(current_inumber);
+
+		if (inode_generation(current_inumber) == generation) {
+			snap->cached = 1;
+			*result = current_inumber;
+			return snapshot_add(snap, current_inumber, version, held);
+		}
+	}
 
 	strcpy(full_path, name);
+	current_inumber = FS_ROOT;
+	version = inode_read_begin(current_inumber);
+	if (snapshot_add(snap, current_inumber, version, held) == FAIL) {
+		return FAIL;
+	}
 
-	//* Start at root node
-	int current_inumber = FS_ROOT;
+	for (path = strtok_r(full_path, "/", &saveptr); path != NULL; path = strtok_r(NULL, "/", &saveptr)) {
+		int locked = lockset_holds(held, current_inumber) == SUCCESS;
 
-	//* Use for copy
-	type nType;
-	union Data data;
+		if ((current_inumber = inode_lookup_child(current_inumber, version, path, locked)) == FAIL) {
+			break;
+		}
+		version = inode_read_begin(current_inumber);
+		if (snapshot_add(snap, current_inumber, version, held) == FAIL) {
+			return FAIL;
+		}
+	}
+
+	*result = current_inumber;
+	return SUCCESS;
+}
+
+
+/*
+ * Lookup for a given path without blocking.
+ * Input:
+ *  - name: normalized path of node
+ *  - held: locks held by the caller, may be NULL
+ *  - result: filled with the inumber, or FAIL if not found
+ *  - busy: filled with the node that changed, or FAIL
+ * Returns: SUCCESS, or FAIL if a node changed and the lookup must be retried
+ */
+int lookup_optimistic(char *name, LockSet *held, int *result, int *busy) {
+	Snapshot snap;
+	unsigned int generation = 0;
+	int current_inumber;
 
-	char *path = strtok_r(full_path, delim, &saveptr);
+	snapshot_init(&snap);
+	reclaim_enter();
 
-	if(path == NULL && mode == WRITE){
-		lock_inode(ltu, current_inumber, WRITE);
-	}else{
-		lock_inode(ltu, current_inumber, READ);
+	if (walk_path(name, held, &snap, &current_inumber) == FAIL) {
+		reclaim_exit();
+		*busy = snap.busy;
+		return FAIL;
 	}
+	if (current_inumber != FAIL) {
+		generation = inode_generation(current_inumber);
+	}
+	if (snapshot_validate(&snap) == FAIL) {
+		reclaim_exit();
+		*busy = snap.busy;
+		return FAIL;
+	}
+	reclaim_exit();
 
-	//* Get ROOT inode data
-	inode_get(current_inumber, &nType, &data);
+	if (current_inumber != FAIL && name[0] != '\0' && !snap.cached) {
+		dcache_put(name, current_inumber, generation, snap.epoch);
+	}
+	*result = current_inumber;
+	return SUCCESS;
+}
 
-	//* search for all sub nodes 
-	while (path != NULL && (current_inumber = lookup_sub_node(path, data.dirEntries)) != FAIL){
-		path = strtok_r(NULL, delim, &saveptr);
 
-		//* If it's the last node of the search
-		if(path == NULL && mode == WRITE){
-			lock_inode(ltu, current_inumber, WRITE);
+/*
+ * Waits before retrying an operation, holding no locks: on the node that
+ * changed under it, if there is one.
+ */
+void backoff(int busy) {
+	if (busy != FAIL) {
+		inode_wait(busy);
+	}
+	else {
+		sched_yield();
+	}
+}
+
+
+/*
+ * Walks a path with lock coupling: the read lock of each node is released
+ * as soon as its child is locked, so at most two are held. Locks are only
+ * waited for in increasing inumber order, as a lock set takes them, so
+ * the walk can't deadlock with the writers. A child with a lower inumber
+ * than its parent is only tried; if it's being written, the parent is
+ * released, both are locked in order and the walk goes on if the parent
+ * still names the child and no move or delete happened meanwhile.
+ * Input:
+ *  - name: normalized path of node
+ *  - result: filled with the inumber, or FAIL if not found
+ * Returns: SUCCESS, or FAIL if the walk must start over
+ */
+int walk_path_locked(char *name, int *result) {
+	char *saveptr, *path;
+	char full_path[MAX_PATH_SIZE];
+	int current_inumber = FS_ROOT, child_inumber;
+
+	strcpy(full_path, name);
+	rdLock(current_inumber);
+
+	for (path = strtok_r(full_path, "/", &saveptr); path != NULL; path = strtok_r(NULL, "/", &saveptr)) {
+		if ((child_inumber = inode_lookup_child(current_inumber, 0, path, 1)) == FAIL) {
+			unlock(current_inumber);
+			*result = FAIL;
+			return SUCCESS;
+		}
+
+		if (child_inumber > current_inumber) {
+			rdLock(child_inumber);
 		}
-		else{
-			lock_inode(ltu, current_inumber, READ);
+		else if (tryRdLock(child_inumber) == FAIL) {
+			unsigned long epoch = dcache_epoch();
+			unsigned int generation = inode_generation(current_inumber);
+
+			unlock(current_inumber);
+			rdLock(child_inumber);
+			rdLock(current_inumber);
+			if (dcache_epoch() != epoch || inode_generation(current_inumber) != generation
+			    || inode_lookup_child(current_inumber, 0, path, 1) != child_inumber) {
+				unlock(current_inumber);
+				unlock(child_inumber);
+				return FAIL;
+			}
 		}
+		unlock(current_inumber);
+		current_inumber = child_inumber;
+	}
 
-		inode_get(current_inumber, &nType, &data);
+	unlock(current_inumber);
+	*result = current_inumber;
+	return SUCCESS;
+}
+
+
+/*
+ * Lookup for a given path, optimistically first. Only falls back to
+ * locking the nodes if writers keep changing them, so a lookup can't
+ * starve under constant writes. Must be called holding no locks.
+ * Returns:
+ *  inumber: identifier of the i-node, if found
+ *     FAIL: otherwise
+ */
+int lookup(char *name) {
+	int result, busy;
+
+	for (int i = 0; i < OPTIMISTIC_RETRIES; i++) {
+		if (lookup_optimistic(name, NULL, &result, &busy) == SUCCESS) {
+			return result;
+		}
+		backoff(busy);
+	}
+	while (walk_path_locked(name, &result) == FAIL) {
+		sched_yield();
 	}
+	return result;
+}
+
+
+/*
+ * Checks, holding the lock set, that the paths still resolve to the nodes
+ * found before locking. All paths are checked in the same snapshot.
+ * Input:
+ *  - names: normalized paths
+ *  - inumbers: nodes the paths resolved to
+ *  - count: number of paths
+ *  - set: acquired lock set
+ *  - busy: filled with the node to wait for, or FAIL
+ *  - epoch: if not NULL, filled with the dentry cache epoch the paths
+ *    were valid in, to cache paths found under the locks
+ * Returns: SUCCESS or FAIL
+ */
+int validate_paths(char **names, int *inumbers, int count, LockSet *set, int *busy, unsigned long *epoch) {
+	Snapshot snap;
+	int result;
+
+	snapshot_init(&snap);
+	reclaim_enter();
 
-	return current_inumber;
+	for (int i = 0; i < count; i++) {
+		if (walk_path(names[i], set, &snap, &result) == FAIL || result != inumbers[i]) {
+			reclaim_exit();
+			*busy = snap.busy;
+			return FAIL;
+		}
+	}
+	if (snapshot_validate(&snap) == FAIL) {
+		reclaim_exit();
+		*busy = snap.busy;
+		return FAIL;
+	}
+	reclaim_exit();
+	if (epoch != NULL) {
+		*epoch = snap.epoch;
+	}
+	return SUCCESS;
 }
 
 
@@ -218,13 +507,15 @@ int lookup(char *name, locks_to_unlock *ltu, int mode) {
  * Input:
  *  - name: path of node
  *  - nodeType: type of node
- * 	- ltu: Struct that has the inumber that are locked
- * Returns: SUCCESS or FAIL
+ * 	- set: empty lock set, released by the caller
+ * 	- busy: filled with the node to wait for when retrying
+ * Returns: SUCCESS, FAIL or RETRY
  */
-int create_aux(char *name, type nodeType, locks_to_unlock *ltu){
+int create_aux(char *name, type nodeType, LockSet *set, int *busy){
 
 	int parent_inumber, child_inumber;
-	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
+	char *parent_name, *child_name, name_copy[MAX_PATH_SIZE];
+	unsigned long epoch;
 	
 	//* use for copy 
 	type pType;
@@ -233,45 +524,62 @@ int create_aux(char *name, type nodeType, locks_to_unlock *ltu){
 	strcpy(name_copy, name);
 	split_parent_child_from_path(name_copy, &parent_name, &child_name);
 
-	parent_inumber = lookup(parent_name, ltu, WRITE);
+	if (child_name[0] == '\0' || strlen(child_name) >= MAX_FILE_NAME) {
+		log_printf(LOG_WARN, "failed to create %s, invalid name\n", name);
+		return FAIL;
+	}
+
+	parent_inumber = lookup(parent_name);
 
 	if (parent_inumber == FAIL) {
-		printf("failed to create %s, invalid parent dir %s\n",
+		log_printf(LOG_WARN, "failed to create %s, invalid parent dir %s\n",
 		        name, parent_name);
 		return FAIL;
 	}
 
+	lockset_add(set, parent_inumber, LOCK_WRITE);
+	lockset_acquire(set);
+
+	if (validate_paths(&parent_name, &parent_inumber, 1, set, busy, &epoch) == FAIL) {
+		return RETRY;
+	}
+
 	inode_get(parent_inumber, &pType, &pdata);
 
 	if(pType != T_DIRECTORY) {
-		printf("failed to create %s, parent %s is not a dir\n",
+		log_printf(LOG_WARN, "failed to create %s, parent %s is not a dir\n",
 		        name, parent_name);
 		return FAIL;
 	}
 
-	if (lookup_sub_node(child_name, pdata.dirEntries) != FAIL) {
-		printf("failed to create %s, already exists in dir %s\n",
+	if (lookup_sub_node(child_name, pdata.dir) != FAIL) {
+		log_printf(LOG_WARN, "failed to create %s, already exists in dir %s\n",
 		       child_name, parent_name);
 		return FAIL;
 	}
 
-	/* create node and add entry to folder that contains new node */
+	/*
+	 * create node and add entry to folder that contains new node. The new
+	 * node is out of inumber order with the parent, so inode_create never
+	 * waits for it.
+	 */
 	child_inumber = inode_create(nodeType);
 
 	if (child_inumber == FAIL) {
-		printf("failed to create %s in  %s, couldn't allocate inode\n",
+		log_printf(LOG_WARN, "failed to create %s in  %s, couldn't allocate inode\n",
 		        child_name, parent_name);
 		return FAIL;
 	}
 
-	//* Lock the created node
-	lock_inode(ltu, child_inumber, WRITE);
-
 	if (dir_add_entry(parent_inumber, child_inumber, child_name) == FAIL) {
-		printf("could not add entry %s in dir %s\n",
+		log_printf(LOG_WARN, "could not add entry %s in dir %s\n",
 		       child_name, parent_name);
 		return FAIL;
 	}
+	wal_append(WAL_CREATE, nodeType, parent_inumber, FREE_INODE, child_inumber, child_name, NULL);
+
+	//* In the epoch the parent was validated in: a later move makes it stale
+	dcache_put(name, child_inumber, inode_generation(child_inumber), epoch);
 
 	return SUCCESS;
 }
@@ -281,13 +589,14 @@ int create_aux(char *name, type nodeType, locks_to_unlock *ltu){
  * Deletes a node given a path.
  * Input:
  *  - name: path of node
- * 	- ltu: Struct that has the inumber that are locked
- * Returns: SUCCESS or FAIL
+ * 	- set: empty lock set, released by the caller
+ * 	- busy: filled with the node to wait for when retrying
+ * Returns: SUCCESS, FAIL or RETRY
  */
-int delete_aux(char *name, locks_to_unlock *ltu){
+int delete_aux(char *name, LockSet *set, int *busy){
 
-	int parent_inumber, child_inumber;
-	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
+	int parent_inumber, child_inumber, found_inumber;
+	char *parent_name, *child_name, name_copy[MAX_PATH_SIZE];
 	//* use for copy 
 	type pType, cType;
 	union Data pdata, cdata;
@@ -295,53 +604,78 @@ int delete_aux(char *name, locks_to_unlock *ltu){
 	strcpy(name_copy, name);
 	split_parent_child_from_path(name_copy, &parent_name, &child_name);
 
-	parent_inumber = lookup(parent_name, ltu, WRITE);
+	if (child_name[0] == '\0') {
+		log_printf(LOG_WARN, "failed to delete %s, invalid name\n", name);
+		return FAIL;
+	}
+
+	parent_inumber = lookup(parent_name);
 
 	if (parent_inumber == FAIL) {
-		printf("failed to delete %s, invalid parent dir %s\n",
+		log_printf(LOG_WARN, "failed to delete %s, invalid parent dir %s\n",
 		        child_name, parent_name);
 				
 		return FAIL;
 	}
+
+	//* Both nodes are found first, so they can be locked in order
+	child_inumber = lookup(name);
+
+	lockset_add(set, parent_inumber, LOCK_WRITE);
+	if (child_inumber != FAIL) {
+		lockset_add(set, child_inumber, LOCK_WRITE);
+	}
+	lockset_acquire(set);
+
+	if (validate_paths(&parent_name, &parent_inumber, 1, set, busy, NULL) == FAIL) {
+		return RETRY;
+	}
 	
 	inode_get(parent_inumber, &pType, &pdata);
 
 	if(pType != T_DIRECTORY) {
-		printf("failed to delete %s, parent %s is not a dir\n",
+		log_printf(LOG_WARN, "failed to delete %s, parent %s is not a dir\n",
 		        child_name, parent_name);
 		return FAIL;
 	}
 
-	child_inumber = lookup_sub_node(child_name, pdata.dirEntries);
+	found_inumber = lookup_sub_node(child_name, pdata.dir);
+
+	//* The entry changed between the lookup and the locking
+	if (found_inumber != child_inumber) {
+		*busy = FAIL;
+		return RETRY;
+	}
 	
 	if (child_inumber == FAIL) {
-		printf("could not delete %s, does not exist in dir %s\n",
+		log_printf(LOG_WARN, "could not delete %s, does not exist in dir %s\n",
 		       name, parent_name);
 		return FAIL;
 	}
 
-	//* Lock the node that is going to be deleted
-	lock_inode(ltu, child_inumber, WRITE);
 	inode_get(child_inumber, &cType, &cdata);
 
-	if (cType == T_DIRECTORY && is_dir_empty(cdata.dirEntries) == FAIL) {
-		printf("could not delete %s: is a directory and not empty\n",
+	if (cType == T_DIRECTORY && is_dir_empty(cdata.dir) == FAIL) {
+		log_printf(LOG_WARN, "could not delete %s: is a directory and not empty\n",
 		       name);
 		return FAIL;
 	}
 
 	//* remove entry from folder that contained deleted node
-	if (dir_reset_entry(parent_inumber, child_inumber) == FAIL) {
-		printf("failed to delete %s from dir %s\n",
+	if (dir_reset_entry(parent_inumber, child_inumber, child_name) == FAIL) {
+		log_printf(LOG_WARN, "failed to delete %s from dir %s\n",
 		       child_name, parent_name);
 		return FAIL;
 	}
 
+	dcache_remove(name);
+
 	if (inode_delete(child_inumber) == FAIL) {
-		printf("could not delete inode number %d from dir %s\n",
+		log_printf(LOG_WARN, "could not delete inode number %d from dir %s\n",
 		       child_inumber, parent_name);
 		return FAIL;
 	}
+	wal_append(WAL_DELETE, T_NONE, parent_inumber, FREE_INODE, child_inumber, child_name, NULL);
 
 	return SUCCESS;
 }
@@ -352,21 +686,25 @@ int delete_aux(char *name, locks_to_unlock *ltu){
  * Input:
  *  - origin: path of node
  * 	- destiny: path of node
- * 	- ltu: Struct that has the inumber that are locked
- * Returns: SUCCESS or FAIL
+ * 	- set: empty lock set, released by the caller
+ * 	- busy: filled with the node to wait for when retrying
+ * Returns: SUCCESS, FAIL or RETRY
  */
-int move_aux(char *origin, char *destiny, locks_to_unlock *ltu){
+int move_aux(char *origin, char *destiny, LockSet *set, int *busy){
 	//* Use for copy
-	char origin_copy[MAX_FILE_NAME];
-	char destiny_copy[MAX_FILE_NAME];
+	char origin_copy[MAX_PATH_SIZE];
+	char destiny_copy[MAX_PATH_SIZE];
 	union Data pdata;
 	type pType;
 	//* Origin variables
-	int originParent_inumber, originChild_inumber;
+	int originParent_inumber, originChild_inumber, found_inumber;
 	char *originParent_name, *originChild_name;
 	//* Destiny variables
 	int destinyParent_inumber; 
 	char *destinyParent_name, *destinyChild_name;
+	//* Parents validated together
+	char *parent_names[2];
+	int parent_inumbers[2];
 
 
 	//* Get the names
@@ -376,136 +714,424 @@ int move_aux(char *origin, char *destiny, locks_to_unlock *ltu){
 	strcpy(destiny_copy, destiny);
 	split_parent_child_from_path(destiny_copy, &destinyParent_name, &destinyChild_name);
 
-	//* Defines an order for the locks
-	if(strcmp(originParent_name, destinyParent_name) < 0){
-		originParent_inumber = lookup(originParent_name, ltu, WRITE);
-		destinyParent_inumber = lookup(destinyParent_name, ltu, WRITE);
+	//* The root has no parent to move it from
+	if (originChild_name[0] == '\0') {
+		log_printf(LOG_WARN, "failed to move %s, invalid name\n", origin);
+		return FAIL;
+	}
+
+	//* Paths are normalized, so nesting is a prefix check
+	if (is_path_inside(destinyParent_name, origin) == SUCCESS) {
+		log_printf(LOG_WARN, "failed to move %s, cannot move to inside of itslef\n",
+		    originChild_name);
+		return FAIL;
 	}
-	else{
-		destinyParent_inumber = lookup(destinyParent_name, ltu, WRITE);
-		originParent_inumber = lookup(originParent_name, ltu, WRITE);
+
+	if (destinyChild_name[0] == '\0' || strlen(destinyChild_name) >= MAX_FILE_NAME) {
+		log_printf(LOG_WARN, "failed to move %s, invalid name\n", originChild_name);
+		return FAIL;
 	}
 
+	originParent_inumber = lookup(originParent_name);
+
 	if (originParent_inumber == FAIL) {
-		printf("failed to move %s, invalid parent dir %s\n",
+		log_printf(LOG_WARN, "failed to move %s, invalid parent dir %s\n",
 		        originChild_name, originParent_name);
 		return FAIL;
 	}
 
+	destinyParent_inumber = lookup(destinyParent_name);
+
 	if (destinyParent_inumber == FAIL) {
-		printf("failed to move %s, target dir doesn't exist %s\n",
+		log_printf(LOG_WARN, "failed to move %s, target dir doesn't exist %s\n",
 		        destinyChild_name, destinyParent_name);
 		return FAIL;
 	}
 
+	originChild_inumber = lookup(origin);
+
+	/*
+	 * The lock manager orders the locks, so no lock is taken while walking.
+	 * A move that would nest this one's nodes must hold one of them, so
+	 * one of both validations fails until the other move is done.
+	 */
+	lockset_add(set, originParent_inumber, LOCK_WRITE);
+	lockset_add(set, destinyParent_inumber, LOCK_WRITE);
+	if (originChild_inumber != FAIL) {
+		lockset_add(set, originChild_inumber, LOCK_WRITE);
+	}
+	lockset_acquire(set);
+
+	parent_names[0] = originParent_name;
+	parent_inumbers[0] = originParent_inumber;
+	parent_names[1] = destinyParent_name;
+	parent_inumbers[1] = destinyParent_inumber;
+
+	if (validate_paths(parent_names, parent_inumbers, 2, set, busy, NULL) == FAIL) {
+		return RETRY;
+	}
 	
 	inode_get(originParent_inumber, &pType, &pdata);
 	if(pType != T_DIRECTORY) {
-		printf("failed to move %s, parent %s is not a dir\n",
+		log_printf(LOG_WARN, "failed to move %s, parent %s is not a dir\n",
 		        originChild_name, originParent_name);
 		return FAIL;
 	}
 
-	originChild_inumber = lookup_sub_node(originChild_name, pdata.dirEntries);	
-	if (originChild_inumber == FAIL) {
-		printf("could not move %s, does not exist in dir %s\n",
-		       originChild_name, originParent_name);
-		return FAIL;
+	found_inumber = lookup_sub_node(originChild_name, pdata.dir);
+
+	//* The entry changed between the lookup and the locking
+	if (found_inumber != originChild_inumber) {
+		*busy = FAIL;
+		return RETRY;
 	}
 
-	if(check(ltu, originChild_inumber) != FAIL){
-		printf("failed to move %s, cannot move to inside of itslef\n",
-		    originChild_name);
+	if (originChild_inumber == FAIL) {
+		log_printf(LOG_WARN, "could not move %s, does not exist in dir %s\n",
+		       originChild_name, originParent_name);
 		return FAIL;
 	}
-	
-	//* Lock the node that is going to be deleted and moved
-	lock_inode(ltu, originChild_inumber, WRITE);
 
 	inode_get(destinyParent_inumber, &pType, &pdata);
 	if(pType != T_DIRECTORY) {
-		printf("failed to move %s, %s is not a dir\n",
+		log_printf(LOG_WARN, "failed to move %s, %s is not a dir\n",
 		        originChild_name, destinyParent_name);
 		return FAIL;
 	}
 
-	if (lookup_sub_node(destinyChild_name, pdata.dirEntries) != FAIL) {
-		printf("failed to move %s, already exists in dir %s\n",
+	if (lookup_sub_node(destinyChild_name, pdata.dir) != FAIL) {
+		log_printf(LOG_WARN, "failed to move %s, already exists in dir %s\n",
 		       destinyChild_name, destinyParent_name);
 		return FAIL;
 	}
 
 
+	//* Every cached path under the moved node becomes stale
+	dcache_move_begin(origin);
+
 	//* Removes from from thr original dir
-	if (dir_reset_entry(originParent_inumber, originChild_inumber) == FAIL) {
-		printf("failed to remove %s from dir %s\n",
+	if (dir_reset_entry(originParent_inumber, originChild_inumber, originChild_name) == FAIL) {
+		log_printf(LOG_WARN, "failed to remove %s from dir %s\n",
 		       originChild_name, originParent_name);
+		dcache_move_end();
 		return FAIL;
 	}
 
 	//* Adds to the destiny dir
 	if (dir_add_entry(destinyParent_inumber, originChild_inumber, destinyChild_name) == FAIL) {
-		printf("could not add entry %s in dir %s\n",
+		log_printf(LOG_WARN, "could not add entry %s in dir %s\n",
 		       destinyChild_name, destinyParent_name);
+		dcache_move_end();
 		return FAIL;
 	}
+	dcache_move_end();
+	wal_append(WAL_MOVE, T_NONE, originParent_inumber, destinyParent_inumber, originChild_inumber,
+	           originChild_name, destinyChild_name);
 
 	return SUCCESS;
 }
 
 
 /*
- * Prints tecnicofs tree.
+ * Locks the file a path names, to read or write its contents.
+ * Input:
+ *  - name: normalized path of node
+ *  - mode: LOCK_READ or LOCK_WRITE
+ * 	- set: empty lock set, released by the caller
+ * 	- busy: filled with the node to wait for when retrying
+ * 	- inumber: filled with the inumber of the file
+ * Returns: SUCCESS, FAIL or RETRY
+ */
+int lock_file(char *name, int mode, LockSet *set, int *busy, int *inumber){
+	type nType;
+
+	if ((*inumber = lookup(name)) == FAIL) {
+		log_printf(LOG_WARN, "failed to access %s, does not exist\n", name);
+		return FAIL;
+	}
+
+	lockset_add(set, *inumber, mode);
+	lockset_acquire(set);
+
+	if (validate_paths(&name, inumber, 1, set, busy, NULL) == FAIL) {
+		return RETRY;
+	}
+
+	inode_get(*inumber, &nType, NULL);
+	if (nType != T_FILE) {
+		log_printf(LOG_WARN, "failed to access %s, is not a file\n", name);
+		return FAIL;
+	}
+	return SUCCESS;
+}
+
+
+/*
+ * Writes to a file at an offset.
+ * Input:
+ *  - name: path of node
+ *  - buffer: data to write
+ *  - len: number of bytes
+ *  - offset: position in the file
+ * Returns: number of bytes written, or FAIL
+ */
+int write_file(char *name, char *buffer, int len, int offset){
+	int exit_state, busy, inumber, written = FAIL;
+	char path[MAX_PATH_SIZE];
+	LockSet set;
+
+	normalize_path(path, name);
+	do {
+		lockset_init(&set);
+		exit_state = lock_file(path, LOCK_WRITE, &set, &busy, &inumber);
+		if (exit_state == SUCCESS && (written = inode_file_write(inumber, buffer, len, offset)) == FAIL) {
+			log_printf(LOG_WARN, "failed to write %s, invalid offset %d\n", path, offset);
+		}
+		lockset_release(&set);
+		if (exit_state == RETRY) {
+			backoff(busy);
+		}
+	} while (exit_state == RETRY);
+	return exit_state == SUCCESS ? written : FAIL;
+}
+
+
+/*
+ * Reads from a file at an offset. The data isn't copied: reply gets the
+ * extents that hold it while the file is locked, and can write them
+ * straight to a socket.
+ * Input:
+ *  - name: path of node
+ *  - len: max number of bytes
+ *  - offset: position in the file
+ *  - reply: called once with the result and the data (none on FAIL)
+ *  - arg: passed to reply
+ * Returns: number of bytes read, or FAIL
+ */
+int read_file(char *name, int len, int offset, read_reply_t reply, void *arg){
+	int exit_state, busy, inumber, iovcnt = 0, mapped = FAIL;
+	char path[MAX_PATH_SIZE];
+	struct iovec iov[FILE_MAX_EXTENTS];
+	LockSet set;
+
+	normalize_path(path, name);
+	do {
+		lockset_init(&set);
+		exit_state = lock_file(path, LOCK_READ, &set, &busy, &inumber);
+		if (exit_state == SUCCESS) {
+			if ((mapped = inode_file_map(inumber, offset, len, iov, &iovcnt)) == FAIL) {
+				log_printf(LOG_WARN, "failed to read %s, invalid offset %d\n", path, offset);
+			}
+			reply(mapped, iov, iovcnt, arg);
+		}
+		lockset_release(&set);
+		if (exit_state == RETRY) {
+			backoff(busy);
+		}
+	} while (exit_state == RETRY);
+
+	if (exit_state == FAIL) {
+		reply(FAIL, iov, 0, arg);
+	}
+	return exit_state == SUCCESS ? mapped : FAIL;
+}
+
+
+/*
+ * Resolves a file once, for the handles of tfsOpen.
+ * Input:
+ *  - name: path of node
+ *  - generation: filled with the generation of the i-node
+ * Returns: inumber of the file, or FAIL
+ */
+int open_file(char *name, unsigned int *generation){
+	int exit_state, busy, inumber;
+	char path[MAX_PATH_SIZE];
+	LockSet set;
+
+	normalize_path(path, name);
+	do {
+		lockset_init(&set);
+		exit_state = lock_file(path, LOCK_READ, &set, &busy, &inumber);
+		if (exit_state == SUCCESS) {
+			*generation = inode_generation(inumber);
+		}
+		lockset_release(&set);
+		if (exit_state == RETRY) {
+			backoff(busy);
+		}
+	} while (exit_state == RETRY);
+	return exit_state == SUCCESS ? inumber : FAIL;
+}
+
+
+/*
+ * Locks the file of a handle without walking any path. A generation
+ * other than the one the handle was opened on means the file was
+ * deleted, and the i-node maybe reused, since.
+ * Returns: SUCCESS or FAIL
+ */
+static int lock_handle(int inumber, unsigned int generation, int mode, LockSet *set){
+	lockset_init(set);
+	lockset_add(set, inumber, mode);
+	lockset_acquire(set);
+	if (inode_generation(inumber) != generation) {
+		log_printf(LOG_WARN, "failed to access i-node %d, was deleted\n", inumber);
+		return FAIL;
+	}
+	return SUCCESS;
+}
+
+
+/*
+ * Writes to the file of a handle, see write_file.
+ * Returns: number of bytes written, or FAIL
+ */
+int write_handle(int inumber, unsigned int generation, char *buffer, int len, int offset){
+	int written = FAIL;
+	LockSet set;
+
+	if (lock_handle(inumber, generation, LOCK_WRITE, &set) == SUCCESS
+	    && (written = inode_file_write(inumber, buffer, len, offset)) == FAIL) {
+		log_printf(LOG_WARN, "failed to write i-node %d, invalid offset %d\n", inumber, offset);
+	}
+	lockset_release(&set);
+	return written;
+}
+
+
+/*
+ * Reads from the file of a handle, see read_file.
+ * Returns: number of bytes read, or FAIL
+ */
+int read_handle(int inumber, unsigned int generation, int len, int offset, read_reply_t reply, void *arg){
+	int iovcnt = 0, mapped = FAIL;
+	struct iovec iov[FILE_MAX_EXTENTS];
+	LockSet set;
+
+	if (lock_handle(inumber, generation, LOCK_READ, &set) == SUCCESS
+	    && (mapped = inode_file_map(inumber, offset, len, iov, &iovcnt)) == FAIL) {
+		log_printf(LOG_WARN, "failed to read i-node %d, invalid offset %d\n", inumber, offset);
+	}
+	reply(mapped, iov, iovcnt, arg);
+	lockset_release(&set);
+	return mapped;
+}
+
+
+/*
+ * Returns the size of the file of a handle, or FAIL.
+ */
+int stat_handle(int inumber, unsigned int generation){
+	int size = FAIL;
+	LockSet set;
+
+	if (lock_handle(inumber, generation, LOCK_READ, &set) == SUCCESS) {
+		size = inode_file_size(inumber);
+	}
+	lockset_release(&set);
+	return size;
+}
+
+
+/*
+ * Prints tecnicofs tree, as it was when the print started, while the
+ * other operations go on.
  * Input:
  *  - fp: pointer to output file
  */
 int print_tecnicofs_tree(FILE *fp){
-	wrLock(FS_ROOT);
-	inode_print_tree(fp, FS_ROOT, "");
-	unlock(FS_ROOT);
+	CowSnapshot *snapshot = cow_take(NULL, NULL);
+
+	inode_print_tree(fp, snapshot, FS_ROOT, "");
+	cow_release(snapshot);
 	return SUCCESS;
 }
 
 
+/*
+ * Looks for a path without locking, waiting for the writers that change
+ * the nodes it reads, and locking them if that keeps failing.
+ */
 int lookfor(char *name){
-	int exit_state;
-	locks_to_unlock ltu;
-	ltu.size = 0;
+	char path[MAX_PATH_SIZE];
 
-	exit_state = lookup(name, &ltu, READ);
-	ltu_unlock(&ltu);
-	return exit_state;
+	normalize_path(path, name);
+	return lookup(path);
 }
 	
 
 int create(char *name, type nodeType){
-	int exit_state;
-	locks_to_unlock ltu;
-	ltu.size = 0;
+	int exit_state, busy;
+	char path[MAX_PATH_SIZE];
+	LockSet set;
+
+	normalize_path(path, name);
+	do {
+		cow_op_begin();
+		lockset_init(&set);
+		exit_state = create_aux(path, nodeType, &set, &busy);
+		lockset_release(&set);
+		cow_op_end();
+		if (exit_state == RETRY) {
+			backoff(busy);
+		}
+	} while (exit_state == RETRY);
 
-	exit_state = create_aux(name, nodeType, &ltu);
-	ltu_unlock(&ltu);
+	//* Replies only once the change is on disk, though others may see it sooner (wal.h)
+	if (exit_state == SUCCESS) {
+		wal_commit();
+	}
 	return exit_state;
 }
 
 
 int delete(char *name){
-	int exit_state;
-	locks_to_unlock ltu;
-	ltu.size = 0;
+	int exit_state, busy;
+	char path[MAX_PATH_SIZE];
+	LockSet set;
+
+	normalize_path(path, name);
+	do {
+		cow_op_begin();
+		lockset_init(&set);
+		exit_state = delete_aux(path, &set, &busy);
+		lockset_release(&set);
+		cow_op_end();
+		if (exit_state == RETRY) {
+			backoff(busy);
+		}
+	} while (exit_state == RETRY);
 
-	exit_state = delete_aux(name, &ltu);
-	ltu_unlock(&ltu);
+	//* Replies only once the change is on disk, though others may see it sooner (wal.h)
+	if (exit_state == SUCCESS) {
+		wal_commit();
+	}
 	return exit_state;
 }
 
 
 int move(char *origin, char *destiny){
-	int exit_state;
-	locks_to_unlock ltu;
-	ltu.size = 0;
+	int exit_state, busy;
+	char origin_path[MAX_PATH_SIZE], destiny_path[MAX_PATH_SIZE];
+	LockSet set;
+
+	normalize_path(origin_path, origin);
+	normalize_path(destiny_path, destiny);
+	do {
+		cow_op_begin();
+		lockset_init(&set);
+		exit_state = move_aux(origin_path, destiny_path, &set, &busy);
+		lockset_release(&set);
+		cow_op_end();
+		if (exit_state == RETRY) {
+			backoff(busy);
+		}
+	} while (exit_state == RETRY);
 
-	exit_state = move_aux(origin, destiny, &ltu);
-	ltu_unlock(&ltu);
+	//* Replies only once the change is on disk, though others may see it sooner (wal.h)
+	if (exit_state == SUCCESS) {
+		wal_commit();
+	}
 	return exit_state;
 }
@@ -2,13 +2,22 @@
 #define FS_H
 #include "state.h"
 
+/* Receives the result of read_file and the data, while the file is locked */
+typedef void (*read_reply_t)(int result, struct iovec *iov, int iovcnt, void *arg);
+
 void init_fs();
 void destroy_fs();
-int is_dir_empty(DirEntry *dirEntries);
+int is_dir_empty(Directory *dir);
 int create(char *name, type nodeType);
 int delete(char *name);
 int lookfor(char *name);
 int move(char *origin, char *dest);
+int write_file(char *name, char *buffer, int len, int offset);
+int read_file(char *name, int len, int offset, read_reply_t reply, void *arg);
+int open_file(char *name, unsigned int *generation);
+int write_handle(int inumber, unsigned int generation, char *buffer, int len, int offset);
+int read_handle(int inumber, unsigned int generation, int len, int offset, read_reply_t reply, void *arg);
+int stat_handle(int inumber, unsigned int generation);
 int print_tecnicofs_tree(FILE *fp);
 
 #endif /* FS_H */
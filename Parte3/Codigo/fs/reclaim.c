@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "reclaim.h"
+#include "slab.h"
+
+unsigned long reclaim_epoch = 0;
+
+//* Records of every running thread that used the module, and the
+//* memory left by those that exited
+ReclaimThread *reclaim_threads = NULL;
+LimboBatch *reclaim_orphans = NULL;
+pthread_mutex_t reclaim_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//* Releases the record of a thread when it exits
+pthread_key_t reclaim_key;
+pthread_once_t reclaim_key_once = PTHREAD_ONCE_INIT;
+
+static __thread ReclaimThread *reclaim_self = NULL;
+
+
+/*
+ * Hands the memory an exiting thread retired to the orphans, freed once
+ * safe by reclaim_try_advance, and frees its record. The thread is out
+ * of any read section.
+ */
+static void reclaim_release(void *record) {
+    ReclaimThread *self = record, **link;
+    LimboBatch *batches[3];
+
+    for (int i = 0; i < 3; i++) {
+        batches[i] = NULL;
+        if (self->limbo[i] != NULL && (batches[i] = malloc(sizeof(LimboBatch))) == NULL) {
+            fprintf(stderr, "Error: problem allocating limbo batch\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_mutex_lock(&reclaim_threads_lock);
+    for (link = &reclaim_threads; *link != self; link = &(*link)->next) {}
+    *link = self->next;
+    for (int i = 0; i < 3; i++) {
+        if (batches[i] != NULL) {
+            batches[i]->epoch = self->limbo_epoch[i];
+            batches[i]->limbo = self->limbo[i];
+            batches[i]->next = reclaim_orphans;
+            reclaim_orphans = batches[i];
+        }
+    }
+    pthread_mutex_unlock(&reclaim_threads_lock);
+
+    reclaim_self = NULL;
+    free(self);
+}
+
+
+static void reclaim_key_create() {
+    if (pthread_key_create(&reclaim_key, reclaim_release) != 0) {
+        fprintf(stderr, "Error: problem creating reclaim key\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+ * Returns the record of the calling thread, registering it on first use.
+ */
+static ReclaimThread *reclaim_thread() {
+    ReclaimThread *self = reclaim_self;
+
+    if (self != NULL) {
+        return self;
+    }
+
+    if (posix_memalign((void **) &self, 64, sizeof(ReclaimThread)) != 0) {
+        fprintf(stderr, "Error: problem allocating reclaim record\n");
+        exit(EXIT_FAILURE);
+    }
+    self->state = 0;
+    self->retired = 0;
+    for (int i = 0; i < 3; i++) {
+        self->limbo_epoch[i] = 0;
+        self->limbo[i] = NULL;
+    }
+
+    pthread_mutex_lock(&reclaim_threads_lock);
+    self->next = reclaim_threads;
+    reclaim_threads = self;
+    pthread_mutex_unlock(&reclaim_threads_lock);
+
+    pthread_once(&reclaim_key_once, reclaim_key_create);
+    pthread_setspecific(reclaim_key, self);
+    reclaim_self = self;
+    return self;
+}
+
+
+static void limbo_free(LimboNode *node) {
+    while (node != NULL) {
+        LimboNode *next = node->next;
+        slab_free(node->ptr);
+        slab_free(node);
+        node = next;
+    }
+}
+
+
+/*
+ * Advances the global epoch if every thread in a read section already
+ * saw the current one, and frees the orphans that became safe. The
+ * list lock keeps exiting threads from freeing their records meanwhile.
+ */
+static void reclaim_try_advance() {
+    unsigned long epoch;
+    LimboBatch **link, *safe = NULL;
+    int quiet = 1;
+
+    pthread_mutex_lock(&reclaim_threads_lock);
+    epoch = __atomic_load_n(&reclaim_epoch, __ATOMIC_ACQUIRE);
+    for (ReclaimThread *thread = reclaim_threads; thread != NULL && quiet; thread = thread->next) {
+        unsigned long state = __atomic_load_n(&thread->state, __ATOMIC_ACQUIRE);
+
+        quiet = !(state & 1) || (state >> 1) == epoch;
+    }
+    if (quiet && __atomic_compare_exchange_n(&reclaim_epoch, &epoch, epoch + 1, 0,
+                                             __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        epoch++;
+    }
+
+    //* As in reclaim_retire, memory retired in e is safe from e + 2 on
+    for (link = &reclaim_orphans; *link != NULL;) {
+        LimboBatch *batch = *link;
+
+        if (batch->epoch + 2 <= epoch) {
+            *link = batch->next;
+            batch->next = safe;
+            safe = batch;
+        }
+        else {
+            link = &batch->next;
+        }
+    }
+    pthread_mutex_unlock(&reclaim_threads_lock);
+
+    while (safe != NULL) {
+        LimboBatch *next = safe->next;
+
+        limbo_free(safe->limbo);
+        free(safe);
+        safe = next;
+    }
+}
+
+
+/*
+ * Starts a read section. Only writes to the thread's own record.
+ */
+void reclaim_enter() {
+    ReclaimThread *self = reclaim_thread();
+    unsigned long epoch = __atomic_load_n(&reclaim_epoch, __ATOMIC_ACQUIRE);
+
+    __atomic_store_n(&self->state, (epoch << 1) | 1, __ATOMIC_RELAXED);
+    /* the state must be visible before any shared pointer is read */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+/*
+ * Ends a read section.
+ */
+void reclaim_exit() {
+    __atomic_store_n(&reclaim_self->state, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Frees memory from slab_alloc once no reader can reach it. The pointer
+ * must already be unreachable for new readers.
+ * Memory retired in epoch e is freed by a later retire in epoch e + 3 or
+ * after; it's safe from e + 2 on, as the epoch can't pass e + 1 while a
+ * reader that entered in e is still active.
+ */
+void reclaim_retire(void *ptr) {
+    ReclaimThread *self = reclaim_thread();
+    unsigned long epoch = __atomic_load_n(&reclaim_epoch, __ATOMIC_ACQUIRE);
+    int index = epoch % 3;
+    LimboNode *node;
+
+    if (self->limbo_epoch[index] != epoch) {
+        limbo_free(self->limbo[index]);
+        self->limbo[index] = NULL;
+        self->limbo_epoch[index] = epoch;
+    }
+
+    if ((node = slab_alloc(sizeof(LimboNode))) == NULL) {
+        fprintf(stderr, "Error: problem allocating limbo node\n");
+        exit(EXIT_FAILURE);
+    }
+    node->ptr = ptr;
+    node->next = self->limbo[index];
+    self->limbo[index] = node;
+
+    if (++self->retired % RECLAIM_ADVANCE_PERIOD == 0) {
+        reclaim_try_advance();
+    }
+}
+
+
+/*
+ * Frees all the retired memory. No reader may be active.
+ */
+void reclaim_destroy() {
+    ReclaimThread *thread = reclaim_threads;
+
+    while (thread != NULL) {
+        ReclaimThread *next = thread->next;
+
+        for (int i = 0; i < 3; i++) {
+            limbo_free(thread->limbo[i]);
+        }
+        free(thread);
+        thread = next;
+    }
+    while (reclaim_orphans != NULL) {
+        LimboBatch *next = reclaim_orphans->next;
+
+        limbo_free(reclaim_orphans->limbo);
+        free(reclaim_orphans);
+        reclaim_orphans = next;
+    }
+    if (reclaim_self != NULL) {
+        pthread_setspecific(reclaim_key, NULL);
+    }
+    reclaim_threads = NULL;
+    reclaim_self = NULL;
+}
@@ -0,0 +1,48 @@
+#ifndef RECLAIM_H
+#define RECLAIM_H
+
+/*
+ * Epoch based reclamation for memory read by optimistic (lock-free)
+ * readers: memory unlinked by a writer is only freed once every reader
+ * that could still be looking at it has left its read section. What a
+ * thread retired and hasn't freed when it exits is freed by the others.
+ */
+
+/* Retires between tries to advance the global epoch */
+#define RECLAIM_ADVANCE_PERIOD 32
+
+/*
+ * Memory waiting to be freed
+ */
+typedef struct limbo_node {
+	void *ptr;
+	struct limbo_node *next;
+} LimboNode;
+
+/*
+ * Memory left by a thread that exited, retired in epoch
+ */
+typedef struct limbo_batch {
+	unsigned long epoch;
+	LimboNode *limbo;
+	struct limbo_batch *next;
+} LimboBatch;
+
+/*
+ * Per-thread record, on its own cache line.
+ * state is (epoch << 1) | 1 while in a read section, 0 otherwise.
+ */
+typedef struct reclaim_thread {
+	unsigned long state;
+	unsigned long limbo_epoch[3];
+	LimboNode *limbo[3];
+	int retired;
+	struct reclaim_thread *next;
+} __attribute__((aligned(64))) ReclaimThread;
+
+void reclaim_enter();
+void reclaim_exit();
+void reclaim_retire(void *ptr);
+void reclaim_destroy();
+
+#endif /* RECLAIM_H */
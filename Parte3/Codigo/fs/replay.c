@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "replay.h"
+#include "state.h"
+#include "log.h"
+
+//* Replay shared by the pool: records ready to run, as a stack
+typedef struct replay {
+    ReplayEntry *entries;
+    int count;
+    wal_apply_t apply;
+    int *ready;
+    int readyCount;
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t posted;
+} Replay;
+
+
+/*
+ * Returns the i-nodes a record names, -1 for none.
+ */
+static void replay_nodes(WalRecord *record, int nodes[REPLAY_NODES]) {
+    nodes[0] = record->parent;
+    nodes[1] = record->op == WAL_MOVE && record->target != record->parent ? record->target : -1;
+    nodes[2] = record->inumber;
+}
+
+
+/*
+ * Links every record to the next one naming each of its i-nodes, and
+ * counts the ones it waits for.
+ * Returns: SUCCESS, or FAIL if a record names an invalid inumber
+ */
+static int replay_link(ReplayEntry *entries, int count) {
+    int maxInumber = 0, *last, *lastSlot;
+
+    for (int i = 0; i < count; i++) {
+        int nodes[REPLAY_NODES];
+
+        replay_nodes(&entries[i].record, nodes);
+        for (int k = 0; k < REPLAY_NODES; k++) {
+            if (nodes[k] < -1) {
+                return FAIL;
+            }
+            if (nodes[k] > maxInumber) {
+                maxInumber = nodes[k];
+            }
+        }
+    }
+
+    last = malloc((maxInumber + 1) * sizeof(int));
+    lastSlot = malloc((maxInumber + 1) * sizeof(int));
+    if (last == NULL || lastSlot == NULL) {
+        fprintf(stderr, "Error: problem allocating the replay\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(last, -1, (maxInumber + 1) * sizeof(int));
+
+    //* A record naming two i-nodes both last named by r waits for r twice
+    for (int i = 0; i < count; i++) {
+        int nodes[REPLAY_NODES];
+
+        replay_nodes(&entries[i].record, nodes);
+        entries[i].waiting = 0;
+        for (int k = 0; k < REPLAY_NODES; k++) {
+            entries[i].next[k] = -1;
+            if (nodes[k] < 0) {
+                continue;
+            }
+            if (last[nodes[k]] >= 0) {
+                entries[last[nodes[k]]].next[lastSlot[nodes[k]]] = i;
+                entries[i].waiting++;
+            }
+            last[nodes[k]] = i;
+            lastSlot[nodes[k]] = k;
+        }
+    }
+    free(last);
+    free(lastSlot);
+    return SUCCESS;
+}
+
+
+/*
+ * Thread of the pool: runs ready records until all are done. Of the
+ * records one makes ready, it runs the first itself.
+ */
+static void *replay_worker(void *arg) {
+    Replay *r = arg;
+    int current = -1;
+
+    while (1) {
+        if (current < 0) {
+            pthread_mutex_lock(&r->lock);
+            while (r->readyCount == 0 && r->done < r->count) {
+                pthread_cond_wait(&r->posted, &r->lock);
+            }
+            if (r->readyCount == 0) {
+                pthread_mutex_unlock(&r->lock);
+                return NULL;
+            }
+            current = r->ready[--r->readyCount];
+            pthread_mutex_unlock(&r->lock);
+        }
+
+        ReplayEntry *entry = &r->entries[current];
+        int next = -1;
+
+        r->apply(&entry->record, entry->name, entry->target_name);
+        for (int k = 0; k < REPLAY_NODES; k++) {
+            int after = entry->next[k];
+
+            if (after < 0 || __atomic_sub_fetch(&r->entries[after].waiting, 1, __ATOMIC_ACQ_REL) > 0) {
+                continue;
+            }
+            if (next < 0) {
+                next = after;
+                continue;
+            }
+            pthread_mutex_lock(&r->lock);
+            r->ready[r->readyCount++] = after;
+            pthread_cond_signal(&r->posted);
+            pthread_mutex_unlock(&r->lock);
+        }
+
+        if (__atomic_add_fetch(&r->done, 1, __ATOMIC_ACQ_REL) == r->count) {
+            pthread_mutex_lock(&r->lock);
+            pthread_cond_broadcast(&r->posted);
+            pthread_mutex_unlock(&r->lock);
+        }
+        current = next;
+    }
+}
+
+
+/*
+ * Returns how many threads replay the log.
+ */
+static int replay_threads() {
+    char *value = getenv("TECNICOFS_REPLAY_THREADS");
+    long threads = value != NULL ? atol(value) : sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (threads < 1) {
+        return 1;
+    }
+    return threads > REPLAY_MAX_THREADS ? REPLAY_MAX_THREADS : threads;
+}
+
+
+/*
+ * Redoes the records of the log, in parallel where they are independent.
+ * Runs on start, before any other thread changes the file system.
+ * Input:
+ *  - entries: the records, in log order
+ *  - count: how many
+ *  - apply: redoes one record
+ */
+void replay_run(ReplayEntry *entries, int count, wal_apply_t apply) {
+    int threads = count >= REPLAY_MIN_PARALLEL ? replay_threads() : 1;
+    struct timespec start, end;
+    double seconds;
+    Replay r;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (threads == 1 || replay_link(entries, count) == FAIL) {
+        threads = 1;
+        for (int i = 0; i < count; i++) {
+            apply(&entries[i].record, entries[i].name, entries[i].target_name);
+        }
+    }
+    else {
+        pthread_t tid[threads];
+
+        r.entries = entries;
+        r.count = count;
+        r.apply = apply;
+        r.readyCount = 0;
+        r.done = 0;
+        pthread_mutex_init(&r.lock, NULL);
+        pthread_cond_init(&r.posted, NULL);
+        if ((r.ready = malloc(count * sizeof(int))) == NULL) {
+            fprintf(stderr, "Error: problem allocating the replay\n");
+            exit(EXIT_FAILURE);
+        }
+        //* Pushed backwards, so the first records are taken first
+        for (int i = count - 1; i >= 0; i--) {
+            if (entries[i].waiting == 0) {
+                r.ready[r.readyCount++] = i;
+            }
+        }
+
+        for (int i = 0; i < threads; i++) {
+            if (pthread_create(&tid[i], NULL, replay_worker, &r) != 0) {
+                fprintf(stderr, "Error: problems creating thread\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (int i = 0; i < threads; i++) {
+            pthread_join(tid[i], NULL);
+        }
+        free(r.ready);
+        pthread_mutex_destroy(&r.lock);
+        pthread_cond_destroy(&r.posted);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    log_printf(LOG_INFO, "Log: replayed %d records in %.3f s with %d threads (%.0f records/s)\n",
+               count, seconds, threads, seconds > 0 ? count / seconds : 0.0);
+}
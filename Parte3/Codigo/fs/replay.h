@@ -0,0 +1,32 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "wal.h"
+
+/*
+ * Parallel replay of the log. Records name the i-nodes they change, so
+ * each one only has to wait for the records before it that name any of
+ * the same i-nodes: every i-node then goes through its changes in log
+ * order, and the result is the one of replaying in order. Records
+ * become ready when the last of those is done and are run by a pool of
+ * threads, TECNICOFS_REPLAY_THREADS or one per online CPU. Short logs
+ * are replayed in order by the calling thread.
+ */
+#define REPLAY_MIN_PARALLEL 1024
+#define REPLAY_MAX_THREADS 64
+
+/* I-nodes a record names: its parent, its target and the entry */
+#define REPLAY_NODES 3
+
+/* A record of the log, with its names */
+typedef struct replay_entry {
+	WalRecord record;
+	char *name;
+	char *target_name;
+	int waiting; /* records before it still to be done */
+	int next[REPLAY_NODES]; /* next record naming each of its i-nodes, or -1 */
+} ReplayEntry;
+
+void replay_run(ReplayEntry *entries, int count, wal_apply_t apply);
+
+#endif /* REPLAY_H */
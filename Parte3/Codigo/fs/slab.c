@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "slab.h"
+
+//* Depot of every class
+SlabDepot slab_depots[SLAB_CLASSES] = {
+    [0 ... SLAB_CLASSES - 1] = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 }
+};
+
+//* Pages carved so far, linked through their first bytes
+void *slab_pages = NULL;
+pthread_mutex_t slab_pages_lock = PTHREAD_MUTEX_INITIALIZER;
+
+long slab_bytes_reserved = 0;
+
+//* Records of every running thread that used the allocator
+SlabThread *slab_threads = NULL;
+pthread_mutex_t slab_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//* Counters of the threads that exited, kept for slab_stats
+SlabThread slab_exited;
+
+//* Releases the record of a thread when it exits
+pthread_key_t slab_key;
+pthread_once_t slab_key_once = PTHREAD_ONCE_INIT;
+
+static __thread SlabThread *slab_self = NULL;
+
+static void slab_flush(SlabThread *self, unsigned int size_class);
+
+
+/*
+ * Gives the cached blocks of an exiting thread back to the depots, adds
+ * its counters to those of the exited threads and frees its record.
+ */
+static void slab_release(void *record) {
+    SlabThread *self = record, **link;
+
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        while (self->cache[i] != NULL) {
+            slab_flush(self, i);
+        }
+    }
+
+    pthread_mutex_lock(&slab_threads_lock);
+    for (link = &slab_threads; *link != self; link = &(*link)->next) {}
+    *link = self->next;
+    slab_exited.allocs += self->allocs;
+    slab_exited.frees += self->frees;
+    slab_exited.bytes_allocated += self->bytes_allocated;
+    slab_exited.bytes_freed += self->bytes_freed;
+    pthread_mutex_unlock(&slab_threads_lock);
+
+    slab_self = NULL;
+    free(self);
+}
+
+
+static void slab_key_create() {
+    if (pthread_key_create(&slab_key, slab_release) != 0) {
+        fprintf(stderr, "Error: problem creating slab key\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+ * Returns the record of the calling thread, registering it on first use.
+ */
+static SlabThread *slab_thread() {
+    SlabThread *self = slab_self;
+
+    if (self != NULL) {
+        return self;
+    }
+
+    if (posix_memalign((void **) &self, 64, sizeof(SlabThread)) != 0) {
+        fprintf(stderr, "Error: problem allocating slab record\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        self->cache[i] = NULL;
+        self->cached[i] = 0;
+    }
+    self->allocs = 0;
+    self->frees = 0;
+    self->bytes_allocated = 0;
+    self->bytes_freed = 0;
+
+    pthread_mutex_lock(&slab_threads_lock);
+    self->next = slab_threads;
+    slab_threads = self;
+    pthread_mutex_unlock(&slab_threads_lock);
+
+    pthread_once(&slab_key_once, slab_key_create);
+    pthread_setspecific(slab_key, self);
+    slab_self = self;
+    return self;
+}
+
+
+/*
+ * Returns the smallest class that fits size bytes plus the header,
+ * or SLAB_LARGE.
+ */
+static unsigned int slab_class(size_t size) {
+#ifdef SLAB_MALLOC
+    return SLAB_LARGE;
+#else
+    size_t total = size + sizeof(SlabHeader);
+    unsigned int size_class = 0;
+
+    while (size_class < SLAB_CLASSES && ((size_t) 1 << (SLAB_MIN_SHIFT + size_class)) < total) {
+        size_class++;
+    }
+    return size_class;
+#endif
+}
+
+
+/*
+ * Carves a new page into blocks of the class and adds them to the depot.
+ * The depot lock must be held.
+ */
+static void slab_depot_grow(SlabDepot *depot, unsigned int size_class) {
+    size_t block_size = (size_t) 1 << (SLAB_MIN_SHIFT + size_class);
+    char *page;
+
+    if (posix_memalign((void **) &page, 64, SLAB_PAGE_SIZE) != 0) {
+        fprintf(stderr, "Error: problem allocating slab page\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock(&slab_pages_lock);
+    *(void **) page = slab_pages;
+    slab_pages = page;
+    pthread_mutex_unlock(&slab_pages_lock);
+    __atomic_fetch_add(&slab_bytes_reserved, SLAB_PAGE_SIZE, __ATOMIC_RELAXED);
+
+    //* The first line of the page links it to the others
+    for (char *block = page + 64; block + block_size <= page + SLAB_PAGE_SIZE; block += block_size) {
+        ((SlabBlock *) block)->next = depot->head;
+        depot->head = (SlabBlock *) block;
+        depot->count++;
+    }
+}
+
+
+/*
+ * Moves up to SLAB_BATCH blocks of the class from the depot to the
+ * thread cache.
+ */
+static void slab_refill(SlabThread *self, unsigned int size_class) {
+    SlabDepot *depot = &slab_depots[size_class];
+
+    if (pthread_mutex_lock(&depot->lock) != 0) {
+        fprintf(stderr, "Error: problem locking the slab depot\n");
+        exit(EXIT_FAILURE);
+    }
+    if (depot->head == NULL) {
+        slab_depot_grow(depot, size_class);
+    }
+    for (int i = 0; i < SLAB_BATCH && depot->head != NULL; i++) {
+        SlabBlock *block = depot->head;
+
+        depot->head = block->next;
+        depot->count--;
+        block->next = self->cache[size_class];
+        self->cache[size_class] = block;
+        self->cached[size_class]++;
+    }
+    pthread_mutex_unlock(&depot->lock);
+}
+
+
+/*
+ * Moves SLAB_BATCH blocks of the class from the thread cache back to
+ * the depot.
+ */
+static void slab_flush(SlabThread *self, unsigned int size_class) {
+    SlabDepot *depot = &slab_depots[size_class];
+
+    if (pthread_mutex_lock(&depot->lock) != 0) {
+        fprintf(stderr, "Error: problem locking the slab depot\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < SLAB_BATCH && self->cache[size_class] != NULL; i++) {
+        SlabBlock *block = self->cache[size_class];
+
+        self->cache[size_class] = block->next;
+        self->cached[size_class]--;
+        block->next = depot->head;
+        depot->head = block;
+        depot->count++;
+    }
+    pthread_mutex_unlock(&depot->lock);
+}
+
+
+/*
+ * Allocates memory for a payload.
+ * Input:
+ *  - size: number of bytes
+ * Returns: pointer to the memory, or NULL if there's none left
+ */
+void *slab_alloc(size_t size) {
+    SlabThread *self = slab_thread();
+    unsigned int size_class = slab_class(size);
+    SlabHeader *header;
+
+    if (size_class == SLAB_LARGE) {
+        if ((header = malloc(sizeof(SlabHeader) + size)) == NULL) {
+            return NULL;
+        }
+        header->size = sizeof(SlabHeader) + size;
+        __atomic_fetch_add(&slab_bytes_reserved, header->size, __ATOMIC_RELAXED);
+    }
+    else {
+        if (self->cache[size_class] == NULL) {
+            slab_refill(self, size_class);
+        }
+        header = (SlabHeader *) self->cache[size_class];
+        self->cache[size_class] = self->cache[size_class]->next;
+        self->cached[size_class]--;
+        header->size = (size_t) 1 << (SLAB_MIN_SHIFT + size_class);
+    }
+    header->size_class = size_class;
+
+    //* Only the owner writes its counters, others just read them
+    __atomic_store_n(&self->allocs, self->allocs + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&self->bytes_allocated, self->bytes_allocated + header->size, __ATOMIC_RELAXED);
+    return header + 1;
+}
+
+
+/*
+ * Frees memory returned by slab_alloc. It goes to the cache of the
+ * calling thread, even if another thread allocated it.
+ */
+void slab_free(void *ptr) {
+    SlabThread *self;
+    SlabHeader *header;
+    unsigned int size_class;
+
+    if (ptr == NULL) {
+        return;
+    }
+    self = slab_thread();
+    header = (SlabHeader *) ptr - 1;
+    size_class = header->size_class;
+
+    __atomic_store_n(&self->frees, self->frees + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&self->bytes_freed, self->bytes_freed + header->size, __ATOMIC_RELAXED);
+
+    if (size_class == SLAB_LARGE) {
+        __atomic_fetch_sub(&slab_bytes_reserved, header->size, __ATOMIC_RELAXED);
+        free(header);
+        return;
+    }
+
+    ((SlabBlock *) header)->next = self->cache[size_class];
+    self->cache[size_class] = (SlabBlock *) header;
+    if (++self->cached[size_class] > SLAB_CACHE_SIZE) {
+        slab_flush(self, size_class);
+    }
+}
+
+
+/*
+ * Sums the counters of every thread.
+ */
+void slab_stats(SlabStats *stats) {
+    long allocated, freed;
+
+    pthread_mutex_lock(&slab_threads_lock);
+    stats->allocs = slab_exited.allocs;
+    stats->frees = slab_exited.frees;
+    allocated = slab_exited.bytes_allocated;
+    freed = slab_exited.bytes_freed;
+    for (SlabThread *thread = slab_threads; thread != NULL; thread = thread->next) {
+        stats->allocs += __atomic_load_n(&thread->allocs, __ATOMIC_RELAXED);
+        stats->frees += __atomic_load_n(&thread->frees, __ATOMIC_RELAXED);
+        allocated += __atomic_load_n(&thread->bytes_allocated, __ATOMIC_RELAXED);
+        freed += __atomic_load_n(&thread->bytes_freed, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&slab_threads_lock);
+
+    stats->bytes_in_use = allocated - freed;
+    stats->bytes_reserved = __atomic_load_n(&slab_bytes_reserved, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Gives every page back to the system. No block may still be in use.
+ */
+void slab_destroy() {
+    while (slab_pages != NULL) {
+        void *next = *(void **) slab_pages;
+        free(slab_pages);
+        slab_pages = next;
+    }
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        slab_depots[i].head = NULL;
+        slab_depots[i].count = 0;
+    }
+    while (slab_threads != NULL) {
+        SlabThread *next = slab_threads->next;
+        free(slab_threads);
+        slab_threads = next;
+    }
+    if (slab_self != NULL) {
+        pthread_setspecific(slab_key, NULL);
+    }
+    slab_self = NULL;
+    slab_exited.allocs = slab_exited.frees = 0;
+    slab_exited.bytes_allocated = slab_exited.bytes_freed = 0;
+    slab_bytes_reserved = 0;
+}
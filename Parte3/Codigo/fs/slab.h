@@ -0,0 +1,82 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Size-classed slab allocator for directory and file payloads.
+ * Class k holds blocks of (1 << (SLAB_MIN_SHIFT + k)) bytes, header
+ * included. Each thread keeps a cache of free blocks per class and
+ * exchanges them in batches with a global depot, so most allocations
+ * and frees take no lock. A thread's cache goes back to the depot when
+ * it exits. Blocks are carved from SLAB_PAGE_SIZE pages,
+ * only given back to the system by slab_destroy; bigger requests go to
+ * malloc. Compiling with -DSLAB_MALLOC sends every request to malloc,
+ * still counted, to compare against the baseline.
+ */
+#define SLAB_MIN_SHIFT 5
+#define SLAB_CLASSES 12
+#define SLAB_PAGE_SIZE (256 * 1024)
+#define SLAB_CACHE_SIZE 64
+#define SLAB_BATCH 32
+
+/* Largest request served by a block of the given size, header excluded */
+#define SLAB_PAYLOAD(size) ((size) - sizeof(SlabHeader))
+
+/* Class of the blocks that come straight from malloc */
+#define SLAB_LARGE SLAB_CLASSES
+
+/*
+ * Header before every block: the class, and the bytes it takes
+ */
+typedef struct slab_header {
+	unsigned int size_class;
+	size_t size;
+} __attribute__((aligned(16))) SlabHeader;
+
+/*
+ * Free block, linked through its own memory
+ */
+typedef struct slab_block {
+	struct slab_block *next;
+} SlabBlock;
+
+/*
+ * Free blocks of one class shared by all threads
+ */
+typedef struct slab_depot {
+	pthread_mutex_t lock;
+	SlabBlock *head;
+	int count;
+} SlabDepot;
+
+/*
+ * Cache and counters of one thread, on its own cache line
+ */
+typedef struct slab_thread {
+	SlabBlock *cache[SLAB_CLASSES];
+	int cached[SLAB_CLASSES];
+	long allocs;
+	long frees;
+	long bytes_allocated;
+	long bytes_freed;
+	struct slab_thread *next;
+} __attribute__((aligned(64))) SlabThread;
+
+/*
+ * Totals of every thread, see slab_stats
+ */
+typedef struct slab_stats {
+	long allocs;
+	long frees;
+	long bytes_in_use; /* of the blocks handed out, headers included */
+	long bytes_reserved; /* taken from the system: pages and big blocks */
+} SlabStats;
+
+void *slab_alloc(size_t size);
+void slab_free(void *ptr);
+void slab_stats(SlabStats *stats);
+void slab_destroy();
+
+#endif /* SLAB_H */
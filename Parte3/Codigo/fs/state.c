@@ -1,292 +1,1199 @@
-#include <string.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <pthread.h>
-#include <errno.h>
-#include "state.h"
-#include "../tecnicofs-api-constants.h"
-
-inode_t inode_table[INODE_TABLE_SIZE];
-
-//* Lock the inode_table[inumber] for write 
-void wrLock(int inumber){
-    if(pthread_rwlock_wrlock(&(inode_table[inumber].lock)) != 0){
-        fprintf(stderr, "Error: problem locking in wrlock\n");
-        exit(EXIT_FAILURE);
-    }
-    
-}
-
-
-//* Tries to wrlock the inode_table[inumber]
-int try_wrLock(int inumber){
-    int error;
-    error = pthread_rwlock_trywrlock(&(inode_table[inumber].lock));
-    if(error == 0){
-        return SUCCESS;
-    }
-    else if(error == EBUSY){
-        return FAIL;
-    }
-    else{
-        fprintf(stderr, "Error: problem locking in trywrlock\n");
-        exit(EXIT_FAILURE);
-    }
-}
-
-
-//* Lock the inode_table[inumber] for read
-void rdLock(int inumber){
-    if(pthread_rwlock_rdlock(&(inode_table[inumber].lock)) != 0){
-        fprintf(stderr, "Error: problem locking in rdlock\n");
-        exit(EXIT_FAILURE);
-    }
-}
-
-
-//* Unlock the inode_table[inumber]
-void unlock(int inumber){
-    if(pthread_rwlock_unlock(&(inode_table[inumber].lock)) != 0){
-        fprintf(stderr, "Error: problem unlocking\n");
-        exit(EXIT_FAILURE);
-    }
-}
-
-
-/*
- * Sleeps for synchronization testing.
- */
-void insert_delay(int cycles) {
-    for (int i = 0; i < cycles; i++) {}
-}
-
-
-/*
- * Initializes the i-nodes table.
- */
-void inode_table_init() {
-
-    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
-        inode_table[i].nodeType = T_NONE;
-        inode_table[i].data.dirEntries = NULL;
-        inode_table[i].data.fileContents = NULL;
-        pthread_rwlock_init(&inode_table[i].lock, NULL);
-    }
-}
-
-
-/*
- * Releases the allocated memory for the i-nodes tables.
- */
-
-void inode_table_destroy() {
-    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
-        pthread_rwlock_destroy(&inode_table[i].lock);
-        if (inode_table[i].nodeType != T_NONE) {
-            /* as data is an union, the same pointer is used for both dirEntries and fileContents */
-            /* just release one of them */
-	    if (inode_table[i].data.dirEntries)
-            free(inode_table[i].data.dirEntries);
-        }
-    }
-}
-
-
-/*
- * Creates a new i-node in the table with the given information.
- * Input:
- *  - nType: the type of the node (file or directory)
- * Returns:
- *  inumber: identifier of the new i-node, if successfully created
- *     FAIL: if an error occurs
- */
-int inode_create(type nType) {
-    /* Used for testing synchronization speedup */
-    insert_delay(DELAY);
-
-    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if(try_wrLock(inumber) == 0){
-            if (inode_table[inumber].nodeType == T_NONE) {
-                inode_table[inumber].nodeType = nType;
-
-                if (nType == T_DIRECTORY) {
-                    /* Initializes entry table */
-                    inode_table[inumber].data.dirEntries = malloc(sizeof(DirEntry) * MAX_DIR_ENTRIES);
-                
-                    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-                        inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
-                    }
-                }
-                else {
-                inode_table[inumber].data.fileContents = NULL;
-                }
-                unlock(inumber);
-                return inumber;
-            }
-            unlock(inumber);
-        }
-    }
-    return FAIL;
-}
-
-
-/*
- * Deletes the i-node.
- * Input:
- *  - inumber: identifier of the i-node
- * Returns: SUCCESS or FAIL
- */
-int inode_delete(int inumber) {
-    /* Used for testing synchronization speedup */
-    insert_delay(DELAY);
-
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
-        printf("inode_delete: invalid inumber\n");
-        return FAIL;
-    } 
-
-    inode_table[inumber].nodeType = T_NONE;
-    /* see inode_table_destroy function */
-    if (inode_table[inumber].data.dirEntries)
-        free(inode_table[inumber].data.dirEntries);
-
-    return SUCCESS;
-}
-
-
-/*
- * Copies the contents of the i-node into the arguments.
- * Only the fields referenced by non-null arguments are copied.
- * Input:
- *  - inumber: identifier of the i-node
- *  - nType: pointer to type
- *  - data: pointer to data
- * Returns: SUCCESS or FAIL
- */
-int inode_get(int inumber, type *nType, union Data *data) {
-    /* Used for testing synchronization speedup */
-    insert_delay(DELAY);
-
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
-        printf("inode_get: invalid inumber %d\n", inumber);
-        return FAIL;
-    }
-    
-    if (nType)
-        *nType = inode_table[inumber].nodeType;
-
-    if (data)
-        *data = inode_table[inumber].data;
-
-    return SUCCESS;
-}
-
-
-/*
- * Resets an entry for a directory.
- * Input:
- *  - inumber: identifier of the i-node
- *  - sub_inumber: identifier of the sub i-node entry
- * Returns: SUCCESS or FAIL
- */
-int dir_reset_entry(int inumber, int sub_inumber) {
-    /* Used for testing synchronization speedup */
-    insert_delay(DELAY);    
-
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
-        printf("inode_reset_entry: invalid inumber\n");
-        return FAIL;
-    }
-
-    if (inode_table[inumber].nodeType != T_DIRECTORY) {
-        printf("inode_reset_entry: can only reset entry to directories\n");
-        return FAIL;
-    }
-
-    if ((sub_inumber < FREE_INODE) || (sub_inumber > INODE_TABLE_SIZE) || (inode_table[sub_inumber].nodeType == T_NONE)) {
-        printf("inode_reset_entry: invalid entry inumber\n");
-        return FAIL;
-    }
-
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (inode_table[inumber].data.dirEntries[i].inumber == sub_inumber) {
-            inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
-            inode_table[inumber].data.dirEntries[i].name[0] = '\0';
-            return SUCCESS;
-        }
-    }
-
-    return FAIL;
-}
-
-
-/*
- * Adds an entry to the i-node directory data.
- * Input:
- *  - inumber: identifier of the i-node
- *  - sub_inumber: identifier of the sub i-node entry
- *  - sub_name: name of the sub i-node entry 
- * Returns: SUCCESS or FAIL
- */
-int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
-    /* Used for testing synchronization speedup */
-    insert_delay(DELAY);
-
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
-        printf("inode_add_entry: invalid inumber\n");
-        return FAIL;
-    }
-
-    if (inode_table[inumber].nodeType != T_DIRECTORY) {
-        printf("inode_add_entry: can only add entry to directories\n");
-        return FAIL;
-    }
-
-    if ((sub_inumber < 0) || (sub_inumber > INODE_TABLE_SIZE) || (inode_table[sub_inumber].nodeType == T_NONE)) {
-        printf("inode_add_entry: invalid entry inumber\n");
-        return FAIL;
-    }
-
-    if (strlen(sub_name) == 0 ) {
-        printf("inode_add_entry: \
-               entry name must be non-empty\n");
-        return FAIL;
-    }
-    
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (inode_table[inumber].data.dirEntries[i].inumber == FREE_INODE) {
-            inode_table[inumber].data.dirEntries[i].inumber = sub_inumber;
-            strcpy(inode_table[inumber].data.dirEntries[i].name, sub_name);
-            return SUCCESS;
-        }
-    }
-    return FAIL;
-}
-
-
-/*
- * Prints the i-nodes table.
- * Input:
- *  - inumber: identifier of the i-node
- *  - name: pointer to the name of current file/dir
- */
-void inode_print_tree(FILE *fp, int inumber, char *name) {
-    if (inode_table[inumber].nodeType == T_FILE) {
-        fprintf(fp, "%s\n", name);
-        return;
-    }
-
-    if (inode_table[inumber].nodeType == T_DIRECTORY) {
-        fprintf(fp, "%s\n", name);
-        for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-            if (inode_table[inumber].data.dirEntries[i].inumber != FREE_INODE) {
-                char path[MAX_FILE_NAME];
-                if (snprintf(path, sizeof(path), "%s/%s", name, inode_table[inumber].data.dirEntries[i].name) > sizeof(path)) {
-                    fprintf(stderr, "truncation when building full path\n");
-                }
-                inode_print_tree(fp, inode_table[inumber].data.dirEntries[i].inumber, path);
-            }
-        }
-    }
-}
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <limits.h>
+#include "state.h"
+#include "reclaim.h"
+#include "slab.h"
+#include "log.h"
+#include "cow.h"
+#include "../tecnicofs-api-constants.h"
+
+/*
+ * Segments of the inode table, allocated on demand. A segment of size n
+ * is one block with n InodeLock, then n InodeHot, then n InodeCold.
+ */
+char *inode_table[MAX_INODE_SEGMENTS];
+
+//* Number of inodes in the allocated segments
+int inode_capacity = 0;
+
+//* Serializes the growth of the table
+pthread_mutex_t inode_table_grow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//* Entry tables used in place from mapped checkpoint files: never freed
+struct {
+    char *base;
+    size_t size;
+} dir_mapped[MAX_MAPPED_IMAGES];
+int dir_mapped_count = 0;
+
+/*
+ * Dirty i-nodes: those changed since the last checkpoint cut, on a
+ * lock-free stack per epoch parity, linked by next_dirty[parity] and
+ * only pushed to. Changes hold the write lock of the i-node, so the
+ * first one of an epoch pushes it alone. Cuts happen between
+ * operations, so every change of an epoch is on its stack when the
+ * epoch ends.
+ */
+unsigned int inode_dirty_epoch = 1;
+int inode_dirty_head[2] = { FREE_INODE, FREE_INODE };
+
+/*
+ * Free i-nodes allocator: a lock-free stack of deleted i-nodes, linked
+ * by next_free, plus the first inumber that was never handed out.
+ * The head keeps (inumber + 1) in the low 32 bits, 0 meaning empty, and
+ * a counter in the high 32 bits that changes on every pop to avoid ABA.
+ */
+unsigned long long inode_free_head = 0;
+int inode_next_unused = 0;
+
+//* Set while the log is redone on start, which needs no testing delay
+int delay_skipped = 0;
+
+
+/*
+ * Finds the segment of the inumber, its size and the index there.
+ * The segment is found from the position of the highest bit of
+ * (inumber + INODE_SEGMENT_BASE), so the access is O(1).
+ */
+static inline char *inode_segment(int inumber, unsigned int *index, unsigned int *size) {
+    unsigned int pos = (unsigned int) inumber + INODE_SEGMENT_BASE;
+    int high_bit = 31 - __builtin_clz(pos);
+
+    *size = 1u << high_bit;
+    *index = pos - *size;
+    return __atomic_load_n(&inode_table[high_bit - INODE_SEGMENT_SHIFT], __ATOMIC_ACQUIRE);
+}
+
+
+//* Returns the lock and version of the i-node
+static inline InodeLock *inode_lock_at(int inumber) {
+    unsigned int index, size;
+    char *segment = inode_segment(inumber, &index, &size);
+
+    return (InodeLock *) segment + index;
+}
+
+
+//* Returns the type and data of the i-node
+static inline InodeHot *inode_hot_at(int inumber) {
+    unsigned int index, size;
+    char *segment = inode_segment(inumber, &index, &size);
+
+    return (InodeHot *) (segment + size * sizeof(InodeLock)) + index;
+}
+
+
+//* Returns the attributes of the i-node that are rarely used
+static inline InodeCold *inode_cold_at(int inumber) {
+    unsigned int index, size;
+    char *segment = inode_segment(inumber, &index, &size);
+
+    return (InodeCold *) (segment + size * (sizeof(InodeLock) + sizeof(InodeHot))) + index;
+}
+
+
+/*
+ * Checks if the inumber belongs to an allocated segment.
+ */
+static inline int inode_in_table(int inumber) {
+    return inumber >= 0 && inumber < __atomic_load_n(&inode_capacity, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Checks if the inumber identifies an i-node in use.
+ */
+static inline int inode_valid(int inumber) {
+    return inode_in_table(inumber) && inode_hot_at(inumber)->nodeType != T_NONE;
+}
+
+
+/*
+ * Returns the number of i-nodes the table can hold right now.
+ */
+int inode_table_capacity() {
+    return __atomic_load_n(&inode_capacity, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Allocates the next segment of the table.
+ * The segment is fully initialized before being published, so readers
+ * of the existing segments are never stopped.
+ * Input:
+ *  - seen_capacity: capacity observed by the caller before growing
+ * Returns: SUCCESS or FAIL (table can't grow more)
+ */
+static int inode_table_grow(int seen_capacity) {
+    int segment, size;
+    char *block;
+    InodeLock *locks;
+    InodeHot *hot;
+    InodeCold *cold;
+
+    if (pthread_mutex_lock(&inode_table_grow_lock) != 0) {
+        fprintf(stderr, "Error: problem locking the inode table\n");
+        exit(EXIT_FAILURE);
+    }
+
+    //* Another thread already grew the table
+    if (inode_capacity != seen_capacity) {
+        pthread_mutex_unlock(&inode_table_grow_lock);
+        return SUCCESS;
+    }
+
+    segment = 31 - __builtin_clz((unsigned int) inode_capacity + INODE_SEGMENT_BASE) - INODE_SEGMENT_SHIFT;
+    if (segment >= MAX_INODE_SEGMENTS) {
+        pthread_mutex_unlock(&inode_table_grow_lock);
+        return FAIL;
+    }
+
+    size = INODE_SEGMENT_BASE << segment;
+    if (posix_memalign((void **) &block, CACHE_LINE_SIZE,
+                       size * (sizeof(InodeLock) + sizeof(InodeHot) + sizeof(InodeCold))) != 0) {
+        pthread_mutex_unlock(&inode_table_grow_lock);
+        return FAIL;
+    }
+    locks = (InodeLock *) block;
+    hot = (InodeHot *) (locks + size);
+    cold = (InodeCold *) (hot + size);
+
+    for (int i = 0; i < size; i++) {
+        pthread_rwlock_init(&locks[i].lock, NULL);
+        locks[i].version = 0;
+        hot[i].nodeType = T_NONE;
+        hot[i].data.dir = NULL;
+        cold[i].next_free = FREE_INODE;
+        cold[i].generation = 0;
+        cold[i].dirty_epoch = 0;
+    }
+
+    __atomic_store_n(&inode_table[segment], block, __ATOMIC_RELEASE);
+    __atomic_store_n(&inode_capacity, inode_capacity + size, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&inode_table_grow_lock);
+    return SUCCESS;
+}
+
+
+//* Lock the inode inumber for write, making its version odd
+void wrLock(int inumber){
+    InodeLock *inode = inode_lock_at(inumber);
+
+    if(pthread_rwlock_wrlock(&(inode->lock)) != 0){
+        fprintf(stderr, "Error: problem locking in wrlock\n");
+        exit(EXIT_FAILURE);
+    }
+    __atomic_store_n(&inode->version, inode->version + 1, __ATOMIC_RELAXED);
+    /* the odd version must be visible before any change to the i-node */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+//* Try to lock the inode inumber for write, without waiting
+int tryWrLock(int inumber){
+    InodeLock *inode = inode_lock_at(inumber);
+
+    if (pthread_rwlock_trywrlock(&(inode->lock)) != 0) {
+        return FAIL;
+    }
+    __atomic_store_n(&inode->version, inode->version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return SUCCESS;
+}
+
+
+//* Lock the inode inumber for read
+void rdLock(int inumber){
+    if(pthread_rwlock_rdlock(&(inode_lock_at(inumber)->lock)) != 0){
+        fprintf(stderr, "Error: problem locking in rdlock\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+//* Try to lock the inode inumber for read, without waiting for its writer
+int tryRdLock(int inumber){
+    return pthread_rwlock_tryrdlock(&(inode_lock_at(inumber)->lock)) == 0 ? SUCCESS : FAIL;
+}
+
+
+//* Unlock the inode inumber. The version is only odd if it was locked for write
+void unlock(int inumber){
+    InodeLock *inode = inode_lock_at(inumber);
+
+    if (inode->version & 1) {
+        __atomic_store_n(&inode->version, inode->version + 1, __ATOMIC_RELEASE);
+    }
+    if(pthread_rwlock_unlock(&(inode->lock)) != 0){
+        fprintf(stderr, "Error: problem unlocking\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+ * Starts an optimistic read of the i-node.
+ * Returns: the version of the i-node; if odd, it is being written
+ */
+unsigned int inode_read_begin(int inumber) {
+    return __atomic_load_n(&inode_lock_at(inumber)->version, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Checks that the i-node didn't change since inode_read_begin.
+ * Returns: SUCCESS or FAIL
+ */
+int inode_read_validate(int inumber, unsigned int version) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if ((version & 1) || __atomic_load_n(&inode_lock_at(inumber)->version, __ATOMIC_RELAXED) != version) {
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+
+/*
+ * Sleeps for synchronization testing.
+ */
+void insert_delay(int cycles) {
+    if (delay_skipped) {
+        return;
+    }
+    for (int i = 0; i < cycles; i++) {}
+}
+
+
+/*
+ * Turns the testing delay off or back on. Only called while no other
+ * thread runs operations.
+ */
+void insert_delay_skip(int skip) {
+    delay_skipped = skip;
+}
+
+
+/*
+ * Hash of an entry name (FNV-1a).
+ */
+static unsigned int dir_hash(char *name) {
+    unsigned int hash = 2166136261u;
+
+    for (; *name != '\0'; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+/*
+ * Allocates a table of free directory entries.
+ */
+static DirEntry *dir_entries_alloc(int capacity) {
+    DirEntry *entries = slab_alloc(sizeof(DirEntry) * capacity);
+
+    if (entries == NULL) {
+        fprintf(stderr, "Error: problem allocating directory entries\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < capacity; i++) {
+        entries[i].inumber = FREE_INODE;
+    }
+    return entries;
+}
+
+
+/*
+ * Allocates an empty directory.
+ */
+static Directory *dir_alloc() {
+    Directory *dir = slab_alloc(sizeof(Directory));
+
+    if (dir == NULL) {
+        fprintf(stderr, "Error: problem allocating directory\n");
+        exit(EXIT_FAILURE);
+    }
+    dir->size = 0;
+    dir->capacity = DIR_INITIAL_CAPACITY;
+    dir->entries = dir_entries_alloc(DIR_INITIAL_CAPACITY);
+    return dir;
+}
+
+
+/*
+ * Releases an entry table, unless it is in a mapped checkpoint file.
+ */
+static void dir_entries_release(DirEntry *entries, void (*release)(void *)) {
+    for (int i = 0; i < dir_mapped_count; i++) {
+        if ((char *) entries >= dir_mapped[i].base && (char *) entries < dir_mapped[i].base + dir_mapped[i].size) {
+            return;
+        }
+    }
+    release(entries);
+}
+
+
+/*
+ * Adds the memory of a mapped checkpoint file, whose entry tables the
+ * directories use in place until they grow.
+ * Returns: SUCCESS, or FAIL if too many files are mapped
+ */
+int dir_entries_map(void *base, size_t size) {
+    if (dir_mapped_count == MAX_MAPPED_IMAGES) {
+        return FAIL;
+    }
+    dir_mapped[dir_mapped_count].base = base;
+    dir_mapped[dir_mapped_count].size = size;
+    dir_mapped_count++;
+    return SUCCESS;
+}
+
+
+/*
+ * Adds the i-node to the dirty stack of the current epoch, if it isn't
+ * there yet. The caller holds its write lock.
+ */
+static void inode_mark_dirty(int inumber) {
+    InodeCold *cold = inode_cold_at(inumber);
+    unsigned int epoch = __atomic_load_n(&inode_dirty_epoch, __ATOMIC_ACQUIRE);
+    int *head = &inode_dirty_head[epoch & 1];
+    int next;
+
+    if (cold->dirty_epoch == epoch) {
+        return;
+    }
+    cold->dirty_epoch = epoch;
+    next = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+    do {
+        cold->next_dirty[epoch & 1] = next;
+    } while (!__atomic_compare_exchange_n(head, &next, inumber, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+
+/*
+ * Ends the dirty epoch. Must run between operations: at the cut of a
+ * checkpoint snapshot, or on start.
+ * Input:
+ *  - parity: filled with the parity of the epoch that ended
+ * Returns: first i-node changed in it, FREE_INODE if none; the others
+ * follow with inode_dirty_next until the next cut
+ */
+int inode_dirty_cut(unsigned int *parity) {
+    unsigned int epoch = __atomic_fetch_add(&inode_dirty_epoch, 1, __ATOMIC_ACQ_REL);
+
+    *parity = epoch & 1;
+    return __atomic_exchange_n(&inode_dirty_head[epoch & 1], FREE_INODE, __ATOMIC_ACQ_REL);
+}
+
+
+/*
+ * Returns the i-node after inumber in the dirty stack of an ended epoch.
+ */
+int inode_dirty_next(int inumber, unsigned int parity) {
+    return inode_cold_at(inumber)->next_dirty[parity];
+}
+
+
+/*
+ * Releases the memory of the data of an i-node.
+ * Input:
+ *  - release: slab_free, or reclaim_retire if optimistic readers may see it
+ */
+static void inode_data_free(type nType, union Data *data, void (*release)(void *)) {
+    if (nType == T_DIRECTORY && data->dir) {
+        dir_entries_release(data->dir->entries, release);
+        release(data->dir);
+    }
+    else if (nType == T_FILE && data->file) {
+        for (int k = 0; k < FILE_MAX_EXTENTS; k++) {
+            if (data->file->extents[k]) {
+                release(data->file->extents[k]);
+            }
+        }
+        release(data->file);
+    }
+    __atomic_store_n(&data->dir, NULL, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Finds the slot of an entry name.
+ * Returns:
+ *  index of the entry with that name, or
+ *  -(index + 1) of the free slot that ends the probe sequence
+ */
+static int dir_find_slot(Directory *dir, char *name, unsigned int hash) {
+    int mask = dir->capacity - 1;
+
+    for (int i = hash & mask; ; i = (i + 1) & mask) {
+        DirEntry *entry = &dir->entries[i];
+
+        if (entry->inumber == FREE_INODE) {
+            return -(i + 1);
+        }
+        if (entry->hash == hash && strcmp(entry->name, name) == 0) {
+            return i;
+        }
+    }
+}
+
+
+/*
+ * Doubles the capacity of a directory, rehashing with the stored hashes.
+ * The new entries are published before the new capacity, so optimistic
+ * readers never use a capacity larger than the entries they see.
+ */
+static void dir_grow(Directory *dir) {
+    DirEntry *old_entries = dir->entries;
+    int old_capacity = dir->capacity;
+    int capacity = old_capacity * 2;
+    int mask = capacity - 1;
+    DirEntry *entries = dir_entries_alloc(capacity);
+
+    for (int i = 0; i < old_capacity; i++) {
+        if (old_entries[i].inumber != FREE_INODE) {
+            int j = old_entries[i].hash & mask;
+
+            while (entries[j].inumber != FREE_INODE) {
+                j = (j + 1) & mask;
+            }
+            entries[j] = old_entries[i];
+        }
+    }
+
+    __atomic_store_n(&dir->entries, entries, __ATOMIC_RELEASE);
+    __atomic_store_n(&dir->capacity, capacity, __ATOMIC_RELEASE);
+    dir_entries_release(old_entries, reclaim_retire);
+}
+
+
+/*
+ * Looks for an entry in a directory.
+ * Input:
+ *  - dir: directory to search
+ *  - sub_name: name of the entry
+ * Returns:
+ *  inumber: of the entry, if found
+ *     FAIL: otherwise
+ */
+int dir_lookup_entry(Directory *dir, char *sub_name) {
+    int slot;
+
+    if (dir == NULL) {
+        return FAIL;
+    }
+    slot = dir_find_slot(dir, sub_name, dir_hash(sub_name));
+    return slot >= 0 ? dir->entries[slot].inumber : FAIL;
+}
+
+
+/*
+ * Looks for an entry of a directory i-node without locking it.
+ * The result is only meaningful if inode_read_validate(inumber, version)
+ * succeeds afterwards; the caller must be inside reclaim_enter/exit.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - version: version returned by inode_read_begin
+ *  - sub_name: name of the entry
+ *  - locked: if the caller holds the i-node lock, so it can't change
+ * Returns:
+ *  inumber: of the entry, if found
+ *     FAIL: otherwise
+ */
+int inode_lookup_child(int inumber, unsigned int version, char *sub_name, int locked) {
+    InodeHot *inode = inode_hot_at(inumber);
+    unsigned int hash = dir_hash(sub_name);
+    type nType = __atomic_load_n(&inode->nodeType, __ATOMIC_RELAXED);
+    Directory *dir = __atomic_load_n(&inode->data.dir, __ATOMIC_ACQUIRE);
+    DirEntry *entries;
+    int capacity, mask;
+
+    /* the type and the pointer must match before dir is dereferenced */
+    if (nType != T_DIRECTORY || dir == NULL || (!locked && inode_read_validate(inumber, version) == FAIL)) {
+        return FAIL;
+    }
+
+    capacity = __atomic_load_n(&dir->capacity, __ATOMIC_ACQUIRE);
+    entries = __atomic_load_n(&dir->entries, __ATOMIC_ACQUIRE);
+    mask = capacity - 1;
+
+    for (int n = 0, i = hash & mask; n < capacity; n++, i = (i + 1) & mask) {
+        int sub_inumber = __atomic_load_n(&entries[i].inumber, __ATOMIC_RELAXED);
+
+        if (sub_inumber == FREE_INODE) {
+            return FAIL;
+        }
+        if (entries[i].hash == hash && strncmp(entries[i].name, sub_name, MAX_FILE_NAME) == 0) {
+            return inode_in_table(sub_inumber) ? sub_inumber : FAIL;
+        }
+    }
+    return FAIL;
+}
+
+
+/*
+ * Pushes a deleted i-node to the free i-nodes stack.
+ */
+static void inode_free_push(int inumber) {
+    unsigned long long head, new_head;
+
+    head = __atomic_load_n(&inode_free_head, __ATOMIC_ACQUIRE);
+    do {
+        inode_cold_at(inumber)->next_free = (int) (head & 0xFFFFFFFFu) - 1;
+        new_head = (head & ~0xFFFFFFFFull) | (unsigned int) (inumber + 1);
+    } while (!__atomic_compare_exchange_n(&inode_free_head, &head, new_head, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+
+/*
+ * Takes a free i-node without touching the locks of the live ones:
+ * first from the stack of deleted i-nodes, then from the never used ones.
+ * Returns:
+ *  inumber: identifier of the free i-node
+ *     FAIL: if the table can't grow more
+ */
+static int inode_alloc() {
+    unsigned long long head, new_head;
+    int inumber;
+
+    head = __atomic_load_n(&inode_free_head, __ATOMIC_ACQUIRE);
+    while ((head & 0xFFFFFFFFu) != 0) {
+        inumber = (int) (head & 0xFFFFFFFFu) - 1;
+        new_head = ((head >> 32) + 1) << 32 | (unsigned int) (inode_cold_at(inumber)->next_free + 1);
+        if (__atomic_compare_exchange_n(&inode_free_head, &head, new_head, 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            return inumber;
+        }
+    }
+
+    inumber = __atomic_fetch_add(&inode_next_unused, 1, __ATOMIC_RELAXED);
+    while (1) {
+        int capacity = inode_table_capacity();
+
+        if (inumber < capacity) {
+            return inumber;
+        }
+        if (inode_table_grow(capacity) == FAIL) {
+            return FAIL;
+        }
+    }
+}
+
+
+/*
+ * Initializes the i-nodes table with its first segment.
+ */
+void inode_table_init() {
+    if (inode_table_grow(0) == FAIL) {
+        fprintf(stderr, "Error: problem allocating the inode table\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+ * Releases the allocated memory for the i-nodes tables.
+ */
+
+void inode_table_destroy() {
+    for (int segment = 0; segment < MAX_INODE_SEGMENTS && inode_table[segment]; segment++) {
+        int size = INODE_SEGMENT_BASE << segment;
+        InodeLock *locks = (InodeLock *) inode_table[segment];
+        InodeHot *hot = (InodeHot *) (locks + size);
+
+        for (int i = 0; i < size; i++) {
+            pthread_rwlock_destroy(&locks[i].lock);
+            inode_data_free(hot[i].nodeType, &hot[i].data, slab_free);
+        }
+        free(inode_table[segment]);
+        inode_table[segment] = NULL;
+    }
+    reclaim_destroy();
+    inode_capacity = 0;
+    inode_free_head = 0;
+    inode_next_unused = 0;
+}
+
+
+/*
+ * Copies the type and the used entries of the i-node into image.
+ * The caller holds the i-node lock.
+ */
+static void inode_image_copy(int inumber, CowImage *image) {
+    image->nodeType = inode_hot_at(inumber)->nodeType;
+    image->count = 0;
+
+    if (image->nodeType == T_DIRECTORY) {
+        Directory *dir = inode_hot_at(inumber)->data.dir;
+
+        image->entries = malloc(sizeof(DirEntry) * (dir->size > 0 ? dir->size : 1));
+        if (image->entries == NULL) {
+            fprintf(stderr, "Error: problem allocating directory entries\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < dir->capacity; i++) {
+            if (dir->entries[i].inumber != FREE_INODE) {
+                image->entries[image->count++] = dir->entries[i];
+            }
+        }
+    }
+}
+
+
+/*
+ * Saves the i-node for the snapshot of the running operation, if it
+ * still needs it, before its first change. The caller holds the
+ * i-node write lock.
+ */
+static void inode_cow_save(int inumber) {
+    CowImage *image = cow_image(inumber);
+
+    if (image != NULL) {
+        inode_image_copy(inumber, image);
+        image->state = COW_SAVED;
+    }
+}
+
+
+/*
+ * Creates a new i-node in the table with the given information.
+ * The table grows when every slot is in use.
+ * The slot comes from the free i-nodes allocator in O(1). A free slot
+ * can still be locked by an operation that found it before it was
+ * deleted, and the caller holds the parent, out of inumber order with
+ * it: such slots are only tried, put aside, and pushed back once
+ * another slot is taken.
+ * Input:
+ *  - nType: the type of the node (file or directory)
+ * Returns:
+ *  inumber: identifier of the new i-node, if successfully created
+ *     FAIL: if an error occurs
+ */
+int inode_create(type nType) {
+    /* Used for testing synchronization speedup */
+    insert_delay(DELAY);
+
+    int inumber, skipped = FREE_INODE;
+    InodeHot *inode;
+
+    while ((inumber = inode_alloc()) != FAIL && tryWrLock(inumber) == FAIL) {
+        inode_cold_at(inumber)->next_free = skipped;
+        skipped = inumber;
+    }
+    while (skipped != FREE_INODE) {
+        int next = inode_cold_at(skipped)->next_free;
+
+        inode_free_push(skipped);
+        skipped = next;
+    }
+    if (inumber == FAIL) {
+        return FAIL;
+    }
+
+    inode_cow_save(inumber);
+    inode_mark_dirty(inumber);
+    inode = inode_hot_at(inumber);
+    inode->nodeType = nType;
+
+    if (nType == T_DIRECTORY) {
+        /* Initializes entry table */
+        inode->data.dir = dir_alloc();
+    }
+    else {
+        inode->data.file = NULL;
+    }
+    unlock(inumber);
+    return inumber;
+}
+
+
+/*
+ * Returns the free slot of the given inumber, growing the table up to
+ * it, or NULL if the inumber is invalid or in use.
+ */
+static InodeHot *inode_restore_slot(int inumber) {
+    if (inumber < 0) {
+        return NULL;
+    }
+    while (inumber >= inode_table_capacity()) {
+        if (inode_table_grow(inode_table_capacity()) == FAIL) {
+            return NULL;
+        }
+    }
+    if (inode_hot_at(inumber)->nodeType != T_NONE) {
+        return NULL;
+    }
+    //* Replay threads restore different i-nodes at once
+    int next = __atomic_load_n(&inode_next_unused, __ATOMIC_RELAXED);
+    while (inumber >= next && !__atomic_compare_exchange_n(&inode_next_unused, &next, inumber + 1, 1,
+                                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    inode_mark_dirty(inumber);
+    return inode_hot_at(inumber);
+}
+
+
+/*
+ * Drops an i-node a newer checkpoint file replaces, if it is in use.
+ * Only used on start, before any other thread runs.
+ */
+void inode_forget(int inumber) {
+    if (inode_valid(inumber)) {
+        inode_data_free(inode_hot_at(inumber)->nodeType, &inode_hot_at(inumber)->data, slab_free);
+        inode_hot_at(inumber)->nodeType = T_NONE;
+    }
+}
+
+
+/*
+ * Creates the i-node with the given inumber, as the log recorded it.
+ * Only used on replay, where the threads change different i-nodes.
+ * Input:
+ *  - inumber: identifier the i-node had
+ *  - nType: the type of the node (file or directory)
+ * Returns: SUCCESS or FAIL
+ */
+int inode_restore(int inumber, type nType) {
+    InodeHot *inode = inode_restore_slot(inumber);
+
+    if (inode == NULL || (nType != T_FILE && nType != T_DIRECTORY)) {
+        return FAIL;
+    }
+    inode->nodeType = nType;
+    inode->data.dir = NULL;
+    if (nType == T_DIRECTORY) {
+        inode->data.dir = dir_alloc();
+    }
+    return SUCCESS;
+}
+
+
+/*
+ * Creates the directory i-node with the given inumber, using the entry
+ * table of a checkpoint as it is.
+ * Only used on start, before any other thread runs.
+ * Input:
+ *  - inumber: identifier the i-node had
+ *  - size: entries in use
+ *  - capacity: slots of the table, a power of 2
+ *  - entries: the table
+ * Returns: SUCCESS or FAIL
+ */
+int inode_restore_dir(int inumber, int size, int capacity, DirEntry *entries) {
+    InodeHot *inode = inode_restore_slot(inumber);
+    Directory *dir;
+
+    if (inode == NULL) {
+        return FAIL;
+    }
+    if ((dir = slab_alloc(sizeof(Directory))) == NULL) {
+        fprintf(stderr, "Error: problem allocating directory\n");
+        exit(EXIT_FAILURE);
+    }
+    dir->size = size;
+    dir->capacity = capacity;
+    dir->entries = entries;
+    inode->nodeType = T_DIRECTORY;
+    inode->data.dir = dir;
+    return SUCCESS;
+}
+
+
+/*
+ * Rebuilds the free i-nodes stack with the i-nodes left free by the
+ * replay, lowest inumbers on top.
+ */
+void inode_free_rebuild() {
+    inode_free_head = 0;
+    for (int inumber = inode_next_unused - 1; inumber >= 0; inumber--) {
+        if (inode_hot_at(inumber)->nodeType == T_NONE) {
+            inode_free_push(inumber);
+        }
+    }
+}
+
+
+/*
+ * Deletes the i-node.
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns: SUCCESS or FAIL
+ */
+int inode_delete(int inumber) {
+    /* Used for testing synchronization speedup */
+    insert_delay(DELAY);
+
+    if (!inode_valid(inumber)) {
+        log_printf(LOG_DEBUG, "inode_delete: invalid inumber\n");
+        return FAIL;
+    } 
+
+    inode_cow_save(inumber);
+    inode_mark_dirty(inumber);
+    inode_data_free(inode_hot_at(inumber)->nodeType, &inode_hot_at(inumber)->data, reclaim_retire);
+    inode_hot_at(inumber)->nodeType = T_NONE;
+    __atomic_store_n(&inode_cold_at(inumber)->generation, inode_cold_at(inumber)->generation + 1, __ATOMIC_RELAXED);
+
+    inode_free_push(inumber);
+    return SUCCESS;
+}
+
+
+/*
+ * Copies the contents of the i-node into the arguments.
+ * Only the fields referenced by non-null arguments are copied.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - nType: pointer to type
+ *  - data: pointer to data
+ * Returns: SUCCESS or FAIL
+ */
+int inode_get(int inumber, type *nType, union Data *data) {
+    /* Used for testing synchronization speedup */
+    insert_delay(DELAY);
+
+    if (!inode_valid(inumber)) {
+        log_printf(LOG_DEBUG, "inode_get: invalid inumber %d\n", inumber);
+        return FAIL;
+    }
+    
+    if (nType)
+        *nType = inode_hot_at(inumber)->nodeType;
+
+    if (data)
+        *data = inode_hot_at(inumber)->data;
+
+    return SUCCESS;
+}
+
+
+/*
+ * Returns the generation of the i-node, which changes when it is deleted.
+ * Callers hold the i-node lock or validate its version afterwards.
+ */
+unsigned int inode_generation(int inumber) {
+    return __atomic_load_n(&inode_cold_at(inumber)->generation, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Returns the number of bytes extent k of a file holds.
+ */
+static inline int file_extent_capacity(int k) {
+    return SLAB_PAYLOAD(FILE_EXTENT_BASE << k);
+}
+
+
+/*
+ * Finds the extent that holds a file offset.
+ * Input:
+ *  - offset: position in the file
+ *  - start: filled with the offset where the extent starts
+ * Returns: index of the extent, or FAIL if past the max file size
+ */
+static int file_extent_of(int offset, int *start) {
+    *start = 0;
+    for (int k = 0; k < FILE_MAX_EXTENTS; k++) {
+        if (offset < *start + file_extent_capacity(k)) {
+            return k;
+        }
+        *start += file_extent_capacity(k);
+    }
+    return FAIL;
+}
+
+
+/*
+ * Writes to a file at an offset, growing it if needed. Gaps left by
+ * writes past the end read as zeros. The caller holds the write lock.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - buffer: data to write
+ *  - len: number of bytes
+ *  - offset: position in the file
+ * Returns: number of bytes written, or FAIL
+ */
+int inode_file_write(int inumber, char *buffer, int len, int offset) {
+    InodeHot *inode = inode_hot_at(inumber);
+    File *file;
+    int written = 0, start, k;
+
+    if (inode->nodeType != T_FILE || offset < 0 || len < 0 || offset > INT_MAX - len) {
+        return FAIL;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    if (file_extent_of(offset + len - 1, &start) == FAIL) {
+        return FAIL;
+    }
+
+    if ((file = inode->data.file) == NULL) {
+        if ((file = slab_alloc(sizeof(File))) == NULL) {
+            fprintf(stderr, "Error: problem allocating file\n");
+            exit(EXIT_FAILURE);
+        }
+        file->size = 0;
+        for (k = 0; k < FILE_MAX_EXTENTS; k++) {
+            file->extents[k] = NULL;
+        }
+        inode->data.file = file;
+    }
+
+    //* Every extent before the written ones must exist, to read as zeros
+    for (k = 0; k <= file_extent_of(offset + len - 1, &start); k++) {
+        if (file->extents[k] == NULL) {
+            if ((file->extents[k] = slab_alloc(file_extent_capacity(k))) == NULL) {
+                fprintf(stderr, "Error: problem allocating file extent\n");
+                exit(EXIT_FAILURE);
+            }
+            memset(file->extents[k], 0, file_extent_capacity(k));
+        }
+    }
+
+    for (k = file_extent_of(offset, &start); written < len; start += file_extent_capacity(k++)) {
+        int capacity = file_extent_capacity(k);
+        int from = offset + written - start;
+        int count = capacity - from < len - written ? capacity - from : len - written;
+
+        memcpy(file->extents[k] + from, buffer + written, count);
+        written += count;
+    }
+
+    if (offset + len > file->size) {
+        file->size = offset + len;
+    }
+    return written;
+}
+
+
+/*
+ * Maps part of a file to the extents that hold it, without copying.
+ * The iovecs stay valid while the caller holds the i-node lock.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - offset: position in the file
+ *  - len: max number of bytes
+ *  - iov: array with FILE_MAX_EXTENTS entries
+ *  - iovcnt: filled with the number of entries used
+ * Returns: number of bytes mapped (0 past the end), or FAIL if not a file
+ */
+int inode_file_map(int inumber, int offset, int len, struct iovec *iov, int *iovcnt) {
+    InodeHot *inode = inode_hot_at(inumber);
+    File *file = inode->data.file;
+    int mapped = 0, start, k;
+
+    *iovcnt = 0;
+    if (inode->nodeType != T_FILE || offset < 0 || len < 0) {
+        return FAIL;
+    }
+    if (file == NULL || offset >= file->size) {
+        return 0;
+    }
+    if (len > file->size - offset) {
+        len = file->size - offset;
+    }
+
+    for (k = file_extent_of(offset, &start); mapped < len; start += file_extent_capacity(k++)) {
+        int capacity = file_extent_capacity(k);
+        int from = offset + mapped - start;
+        int count = capacity - from < len - mapped ? capacity - from : len - mapped;
+
+        iov[*iovcnt].iov_base = file->extents[k] + from;
+        iov[(*iovcnt)++].iov_len = count;
+        mapped += count;
+    }
+    return mapped;
+}
+
+
+/*
+ * Returns the size of a file, or FAIL if not a file. The caller holds
+ * the i-node lock.
+ */
+int inode_file_size(int inumber) {
+    InodeHot *inode = inode_hot_at(inumber);
+
+    if (inode->nodeType != T_FILE) {
+        return FAIL;
+    }
+    return inode->data.file == NULL ? 0 : inode->data.file->size;
+}
+
+
+/*
+ * Resets an entry for a directory.
+ * The entries after it in the probe sequence are shifted back, so the
+ * table never needs tombstones.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - sub_inumber: identifier of the sub i-node entry
+ *  - sub_name: name of the sub i-node entry
+ * Returns: SUCCESS or FAIL
+ */
+int dir_reset_entry(int inumber, int sub_inumber, char *sub_name) {
+    Directory *dir;
+    int slot, mask;
+
+    /* Used for testing synchronization speedup */
+    insert_delay(DELAY);    
+
+    if (!inode_valid(inumber)) {
+        log_printf(LOG_DEBUG, "inode_reset_entry: invalid inumber\n");
+        return FAIL;
+    }
+
+    if (inode_hot_at(inumber)->nodeType != T_DIRECTORY) {
+        log_printf(LOG_DEBUG, "inode_reset_entry: can only reset entry to directories\n");
+        return FAIL;
+    }
+
+    if (!inode_valid(sub_inumber)) {
+        log_printf(LOG_DEBUG, "inode_reset_entry: invalid entry inumber\n");
+        return FAIL;
+    }
+
+    dir = inode_hot_at(inumber)->data.dir;
+    slot = dir_find_slot(dir, sub_name, dir_hash(sub_name));
+    if (slot < 0 || dir->entries[slot].inumber != sub_inumber) {
+        return FAIL;
+    }
+    inode_cow_save(inumber);
+    inode_mark_dirty(inumber);
+
+    mask = dir->capacity - 1;
+    for (int next = (slot + 1) & mask; dir->entries[next].inumber != FREE_INODE; next = (next + 1) & mask) {
+        int home = dir->entries[next].hash & mask;
+
+        /* move the entry back if its home is not in (slot, next] */
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            dir->entries[slot] = dir->entries[next];
+            slot = next;
+        }
+    }
+    dir->entries[slot].inumber = FREE_INODE;
+    dir->entries[slot].name[0] = '\0';
+    dir->size--;
+
+    return SUCCESS;
+}
+
+
+/*
+ * Adds an entry to the i-node directory data.
+ * The directory grows when it gets 3/4 full.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - sub_inumber: identifier of the sub i-node entry
+ *  - sub_name: name of the sub i-node entry 
+ * Returns: SUCCESS or FAIL
+ */
+int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
+    Directory *dir;
+    unsigned int hash;
+    int slot;
+
+    /* Used for testing synchronization speedup */
+    insert_delay(DELAY);
+
+    if (!inode_valid(inumber)) {
+        log_printf(LOG_DEBUG, "inode_add_entry: invalid inumber\n");
+        return FAIL;
+    }
+
+    if (strlen(sub_name) >= MAX_FILE_NAME) {
+        log_printf(LOG_DEBUG, "inode_add_entry: name too long\n");
+        return FAIL;
+    }
+
+    if (inode_hot_at(inumber)->nodeType != T_DIRECTORY) {
+        log_printf(LOG_DEBUG, "inode_add_entry: can only add entry to directories\n");
+        return FAIL;
+    }
+
+    if (!inode_valid(sub_inumber)) {
+        log_printf(LOG_DEBUG, "inode_add_entry: invalid entry inumber\n");
+        return FAIL;
+    }
+
+    if (strlen(sub_name) == 0 ) {
+        log_printf(LOG_DEBUG, "inode_add_entry: \
+               entry name must be non-empty\n");
+        return FAIL;
+    }
+
+    dir = inode_hot_at(inumber)->data.dir;
+    hash = dir_hash(sub_name);
+    if (dir_find_slot(dir, sub_name, hash) >= 0) {
+        log_printf(LOG_DEBUG, "inode_add_entry: entry %s already exists\n", sub_name);
+        return FAIL;
+    }
+
+    inode_cow_save(inumber);
+    inode_mark_dirty(inumber);
+    if ((dir->size + 1) * 4 > dir->capacity * 3) {
+        dir_grow(dir);
+    }
+    slot = dir_find_slot(dir, sub_name, hash);
+
+    slot = -slot - 1;
+    dir->entries[slot].inumber = sub_inumber;
+    dir->entries[slot].hash = hash;
+    strcpy(dir->entries[slot].name, sub_name);
+    dir->size++;
+    return SUCCESS;
+}
+
+
+/*
+ * Returns the image of the i-node in a snapshot: its saved image if it
+ * changed since, or the live one, read under its lock and kept so later
+ * changes don't matter.
+ * Input:
+ *  - snapshot: snapshot to read
+ *  - inumber: identifier of the i-node, reachable from the snapshot
+ */
+CowImage *inode_image(CowSnapshot *snapshot, int inumber) {
+    CowImage *image = &snapshot->images[inumber];
+
+    rdLock(inumber);
+    if (image->state == COW_LIVE) {
+        inode_image_copy(inumber, image);
+        image->state = COW_READ;
+    }
+    unlock(inumber);
+    return image;
+}
+
+
+/*
+ * Prints the i-nodes table, as it was when the snapshot was taken.
+ * No lock is held while printing or while going down to the children.
+ * Input:
+ *  - snapshot: snapshot to print
+ *  - inumber: identifier of the i-node
+ *  - name: pointer to the name of current file/dir
+ */
+void inode_print_tree(FILE *fp, CowSnapshot *snapshot, int inumber, char *name) {
+    CowImage *image = inode_image(snapshot, inumber);
+
+    if (image->nodeType == T_FILE || image->nodeType == T_DIRECTORY) {
+        fprintf(fp, "%s\n", name);
+    }
+
+    for (int i = 0; i < image->count; i++) {
+        char path[MAX_PATH_SIZE];
+        if (snprintf(path, sizeof(path), "%s/%s", name, image->entries[i].name) > sizeof(path)) {
+            fprintf(stderr, "truncation when building full path\n");
+        }
+        inode_print_tree(fp, snapshot, image->entries[i].inumber, path);
+    }
+}
@@ -1,63 +1,145 @@
-#ifndef INODES_H
-#define INODES_H
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <pthread.h>
-#include "../tecnicofs-api-constants.h"
-
-/* FS root inode number */
-#define FS_ROOT 0
-
-#define FREE_INODE -1
-#define INODE_TABLE_SIZE 50
-#define MAX_DIR_ENTRIES 20
-
-#define SUCCESS 0
-#define FAIL -1
-
-#define DELAY 5000000
-
-/*
- * Contains the name of the entry and respective i-number
- */
-typedef struct dirEntry {
-	char name[MAX_FILE_NAME];
-	int inumber;
-} DirEntry;
-
-/*
- * Data is either text (file) or entries (DirEntry)
- */
-union Data {
-	char *fileContents; /* for files */
-	DirEntry *dirEntries; /* for directories */
-};
-
-/*
- * I-node definition
- */
-typedef struct inode_t {    
-	pthread_rwlock_t lock;
-	type nodeType;
-	union Data data;
-    /* more i-node attributes will be added in future exercises */
-} inode_t;
-
-void wrLock(int inumber);
-int trywrlock(int inumber);
-void rdLock(int inumber);
-void unlock(int inumber);
-void insert_delay(int cycles);
-void inode_table_init();
-void inode_table_destroy();
-int inode_create(type nType);
-int inode_delete(int inumber);
-int inode_get(int inumber, type *nType, union Data *data);
-int inode_set_file(int inumber, char *fileContents, int len);
-int dir_reset_entry(int inumber, int sub_inumber);
-int dir_add_entry(int inumber, int sub_inumber, char *sub_name);
-void inode_print_tree(FILE *fp, int inumber, char *name);
-
-
-#endif /* INODES_H */
+#ifndef INODES_H
+#define INODES_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "../tecnicofs-api-constants.h"
+
+/* FS root inode number */
+#define FS_ROOT 0
+
+#define FREE_INODE -1
+
+/* Directories are hash tables that double when 3/4 full */
+#define DIR_INITIAL_CAPACITY 8
+
+/*
+ * The inode table is a list of segments allocated on demand.
+ * Segment k holds (INODE_SEGMENT_BASE << k) inodes, so the table
+ * doubles every time it grows and old segments never move.
+ */
+#define INODE_SEGMENT_SHIFT 6
+#define INODE_SEGMENT_BASE (1 << INODE_SEGMENT_SHIFT)
+#define MAX_INODE_SEGMENTS 24
+#define MAX_INODES (INODE_SEGMENT_BASE * ((1 << MAX_INODE_SEGMENTS) - 1))
+
+#define CACHE_LINE_SIZE 64
+
+/* Checkpoint files whose entry tables directories may use in place */
+#define MAX_MAPPED_IMAGES 16
+
+/*
+ * File contents are kept in extents that double in size: extent k holds
+ * FILE_EXTENT_BASE << k bytes, less the slab header, so small files
+ * waste little and big ones need few extents.
+ */
+#define FILE_EXTENT_BASE 256
+#define FILE_MAX_EXTENTS 16
+
+#define SUCCESS 0
+#define FAIL -1
+
+#define DELAY 5000000
+
+/*
+ * Contains the name of the entry, its hash and respective i-number
+ */
+typedef struct dirEntry {
+	char name[MAX_FILE_NAME];
+	int inumber;
+	unsigned int hash;
+} DirEntry;
+
+/*
+ * Open-addressing (linear probing) table of DirEntry, keyed by name.
+ * Free slots have inumber FREE_INODE; capacity is a power of 2.
+ */
+typedef struct directory {
+	int size;
+	int capacity;
+	DirEntry *entries;
+} Directory;
+
+/*
+ * Contents of a file: extents are allocated when first written
+ */
+typedef struct file {
+	int size;
+	char *extents[FILE_MAX_EXTENTS];
+} File;
+
+/*
+ * Data is either contents (File) or entries (Directory)
+ */
+union Data {
+	File *file; /* for files */
+	Directory *dir; /* for directories */
+};
+
+/*
+ * I-node definition, split by how the fields are accessed. A segment of
+ * the table keeps each part in its own array (locks, then hot, then
+ * cold), so locking an i-node doesn't evict its neighbours' data.
+ */
+
+/* Lock and version: written by every writer, one cache line per i-node */
+typedef struct inode_lock {
+	pthread_rwlock_t lock;
+	unsigned int version; /* odd while locked for write, see inode_read_begin */
+} __attribute__((aligned(CACHE_LINE_SIZE))) InodeLock;
+
+/* Read by every lookup, packed densely */
+typedef struct inode_hot {
+	type nodeType;
+	union Data data;
+} InodeHot;
+
+/* Only used when the i-node is created or deleted */
+typedef struct inode_cold {
+	int next_free; /* next i-node in the free i-nodes stack */
+	unsigned int generation; /* bumped every time the i-node is deleted */
+	unsigned int dirty_epoch; /* last checkpoint epoch it changed in */
+	int next_dirty[2]; /* next i-node in the dirty stack of each epoch parity */
+    /* more i-node attributes will be added in future exercises */
+} InodeCold;
+
+struct cow_snapshot;
+struct cow_image;
+
+void wrLock(int inumber);
+int tryWrLock(int inumber);
+void rdLock(int inumber);
+int tryRdLock(int inumber);
+void unlock(int inumber);
+unsigned int inode_read_begin(int inumber);
+int inode_read_validate(int inumber, unsigned int version);
+int inode_lookup_child(int inumber, unsigned int version, char *sub_name, int locked);
+void insert_delay(int cycles);
+void insert_delay_skip(int skip);
+int inode_table_capacity();
+void inode_table_init();
+void inode_table_destroy();
+int inode_create(type nType);
+int inode_restore(int inumber, type nType);
+int inode_restore_dir(int inumber, int size, int capacity, DirEntry *entries);
+void inode_free_rebuild();
+void inode_forget(int inumber);
+int inode_dirty_cut(unsigned int *parity);
+int inode_dirty_next(int inumber, unsigned int parity);
+int inode_delete(int inumber);
+int inode_get(int inumber, type *nType, union Data *data);
+unsigned int inode_generation(int inumber);
+int inode_file_write(int inumber, char *buffer, int len, int offset);
+int inode_file_map(int inumber, int offset, int len, struct iovec *iov, int *iovcnt);
+int inode_file_size(int inumber);
+int dir_lookup_entry(Directory *dir, char *sub_name);
+int dir_reset_entry(int inumber, int sub_inumber, char *sub_name);
+int dir_add_entry(int inumber, int sub_inumber, char *sub_name);
+int dir_entries_map(void *base, size_t size);
+struct cow_image *inode_image(struct cow_snapshot *snapshot, int inumber);
+void inode_print_tree(FILE *fp, struct cow_snapshot *snapshot, int inumber, char *name);
+
+
+#endif /* INODES_H */
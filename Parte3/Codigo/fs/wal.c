@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "wal.h"
+#include "replay.h"
+#include "log.h"
+
+//* Records appended but not yet written: one is filled while the other is written
+typedef struct wal_buffer {
+    char *data;
+    size_t used, size;
+} WalBuffer;
+
+int wal_fd = -1;
+WalBuffer wal_buffers[2];
+int wal_current = 0;
+
+//* Log offsets: end of the last record appended, and of those on disk
+unsigned long long wal_appended = 0;
+unsigned long long wal_durable = 0;
+
+//* Set while a thread writes the buffer that isn't current
+int wal_writing = 0;
+pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t wal_written = PTHREAD_COND_INITIALIZER;
+
+//* End of the last record the thread appended
+static __thread unsigned long long wal_last = 0;
+
+
+/*
+ * Checksum of a record, from the field after the checksum (FNV-1a).
+ */
+static uint32_t wal_checksum(char *record, size_t length) {
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = offsetof(WalRecord, op); i < length; i++) {
+        hash = (hash ^ (unsigned char) record[i]) * 16777619u;
+    }
+    return hash;
+}
+
+
+/*
+ * Writes all the data to the log, exiting if it can't.
+ */
+static void wal_write(char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(wal_fd, data, len);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            fprintf(stderr, "Error: problem writing the log\n");
+            exit(EXIT_FAILURE);
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+
+/*
+ * Reads the log from start and redoes its valid records, as if in order.
+ * The first record that is incomplete or fails its checksum was torn by
+ * a crash: it and anything after it are cut off.
+ * Input:
+ *  - apply: redoes one record
+ *  - start: offset of the first record to redo
+ * Returns: bytes of valid records
+ */
+static size_t wal_replay(wal_apply_t apply, size_t start) {
+    struct stat st;
+    char *data;
+    size_t size, valid = start, done = 0;
+    ReplayEntry *entries = NULL;
+    int count = 0, capacity = 0;
+
+    if (fstat(wal_fd, &st) != 0) {
+        fprintf(stderr, "Error: problem reading the log\n");
+        exit(EXIT_FAILURE);
+    }
+    size = st.st_size;
+    if (size < start) {
+        fprintf(stderr, "Error: the log is shorter than the checkpoint\n");
+        exit(EXIT_FAILURE);
+    }
+    //* Only what follows the checkpoint is read: data starts at offset start
+    if ((data = malloc(size > start ? size - start : 1)) == NULL) {
+        fprintf(stderr, "Error: problem reading the log\n");
+        exit(EXIT_FAILURE);
+    }
+    while (done < size - start) {
+        ssize_t n = pread(wal_fd, data + done, size - start - done, start + done);
+
+        if (n <= 0) {
+            fprintf(stderr, "Error: problem reading the log\n");
+            exit(EXIT_FAILURE);
+        }
+        done += n;
+    }
+
+    while (size - valid >= sizeof(WalRecord)) {
+        WalRecord record;
+        char *name, *target_name = NULL;
+        size_t body, len;
+
+        memcpy(&record, data + (valid - start), sizeof(record));
+        if (record.length <= sizeof(record) || record.length > WAL_MAX_RECORD
+            || record.length > size - valid
+            || wal_checksum(data + (valid - start), record.length) != record.checksum) {
+            break;
+        }
+
+        name = data + (valid - start) + sizeof(record);
+        body = record.length - sizeof(record);
+        if ((len = strnlen(name, body)) == body) {
+            break;
+        }
+        if (record.op == WAL_MOVE) {
+            target_name = name + len + 1;
+            if (strnlen(target_name, body - len - 1) == body - len - 1) {
+                break;
+            }
+        }
+        if (count == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 1024;
+            if ((entries = realloc(entries, capacity * sizeof(ReplayEntry))) == NULL) {
+                fprintf(stderr, "Error: problem reading the log\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        entries[count].record = record;
+        entries[count].name = name;
+        entries[count].target_name = target_name;
+        valid += record.length;
+        count++;
+    }
+
+    if (valid < size) {
+        log_printf(LOG_WARN, "Log: cutting %zu bytes of a torn record\n", size - valid);
+        if (ftruncate(wal_fd, valid) != 0 || fdatasync(wal_fd) != 0) {
+            fprintf(stderr, "Error: problem truncating the log\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    replay_run(entries, count, apply);
+    free(entries);
+    free(data);
+    return valid;
+}
+
+
+/*
+ * Opens the log named by TECNICOFS_WAL, if any, and replays it.
+ * Must run before any other thread changes the file system.
+ * Input:
+ *  - apply: redoes one record
+ *  - start: bytes of the log a checkpoint already includes
+ */
+void wal_open(wal_apply_t apply, unsigned long long start) {
+    char *path = getenv("TECNICOFS_WAL");
+    size_t valid;
+
+    if (path == NULL || *path == '\0') {
+        return;
+    }
+    if ((wal_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+        fprintf(stderr, "Error: can't open the log %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    valid = wal_replay(apply, start);
+    if (lseek(wal_fd, valid, SEEK_SET) < 0) {
+        fprintf(stderr, "Error: problem reading the log\n");
+        exit(EXIT_FAILURE);
+    }
+    wal_appended = wal_durable = valid;
+
+    for (int i = 0; i < 2; i++) {
+        wal_buffers[i].used = 0;
+        wal_buffers[i].size = WAL_BUFFER_SIZE;
+        if ((wal_buffers[i].data = malloc(WAL_BUFFER_SIZE)) == NULL) {
+            fprintf(stderr, "Error: problem allocating the log buffers\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+
+/*
+ * Writes what is left of the log and closes it.
+ */
+void wal_close() {
+    if (wal_fd < 0) {
+        return;
+    }
+    wal_flush(wal_position());
+    close(wal_fd);
+    wal_fd = -1;
+    for (int i = 0; i < 2; i++) {
+        free(wal_buffers[i].data);
+    }
+}
+
+
+/*
+ * Appends the record of a change to the log. The caller still holds
+ * the locks of the i-nodes it changed.
+ * Input:
+ *  - op: the change
+ *  - nodeType: type of the i-node created
+ *  - parent: directory the entry was added to or removed from
+ *  - target: directory a moved entry was added to
+ *  - inumber: i-node of the entry
+ *  - name: name of the entry
+ *  - target_name: new name of a moved entry, or NULL
+ */
+void wal_append(wal_op op, type nodeType, int parent, int target, int inumber, char *name, char *target_name) {
+    char record[WAL_MAX_RECORD];
+    WalRecord header;
+    size_t len = sizeof(header);
+    WalBuffer *buffer;
+
+    if (wal_fd < 0) {
+        return;
+    }
+
+    strcpy(record + len, name);
+    len += strlen(name) + 1;
+    if (target_name != NULL) {
+        strcpy(record + len, target_name);
+        len += strlen(target_name) + 1;
+    }
+    memset(&header, 0, sizeof(header));
+    header.length = len;
+    header.op = op;
+    header.nodeType = nodeType;
+    header.parent = parent;
+    header.target = target;
+    header.inumber = inumber;
+    memcpy(record, &header, sizeof(header));
+    header.checksum = wal_checksum(record, len);
+    memcpy(record, &header, sizeof(header));
+
+    pthread_mutex_lock(&wal_lock);
+    buffer = &wal_buffers[wal_current];
+    if (buffer->used + len > buffer->size) {
+        buffer->size *= 2;
+        if ((buffer->data = realloc(buffer->data, buffer->size)) == NULL) {
+            fprintf(stderr, "Error: problem allocating the log buffers\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(buffer->data + buffer->used, record, len);
+    buffer->used += len;
+    wal_appended += len;
+    wal_last = wal_appended;
+    pthread_mutex_unlock(&wal_lock);
+}
+
+
+/*
+ * Returns the end of the last record appended, 0 without a log.
+ */
+unsigned long long wal_position() {
+    unsigned long long position;
+
+    pthread_mutex_lock(&wal_lock);
+    position = wal_appended;
+    pthread_mutex_unlock(&wal_lock);
+    return position;
+}
+
+
+/*
+ * Waits until the records the thread appended are on disk.
+ */
+void wal_commit() {
+    wal_flush(wal_last);
+}
+
+
+/*
+ * Waits until the log is on disk up to lsn. If no thread is writing,
+ * this one writes and syncs everything appended so far, for the threads
+ * waiting too.
+ */
+void wal_flush(unsigned long long lsn) {
+    if (wal_fd < 0 || lsn == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&wal_lock);
+    while (wal_durable < lsn) {
+        WalBuffer *buffer;
+        unsigned long long end;
+
+        if (wal_writing) {
+            pthread_cond_wait(&wal_written, &wal_lock);
+            continue;
+        }
+        wal_writing = 1;
+        buffer = &wal_buffers[wal_current];
+        wal_current = !wal_current;
+        end = wal_appended;
+        pthread_mutex_unlock(&wal_lock);
+
+        wal_write(buffer->data, buffer->used);
+        if (fdatasync(wal_fd) != 0) {
+            fprintf(stderr, "Error: problem syncing the log\n");
+            exit(EXIT_FAILURE);
+        }
+        buffer->used = 0;
+
+        pthread_mutex_lock(&wal_lock);
+        wal_durable = end;
+        wal_writing = 0;
+        pthread_cond_broadcast(&wal_written);
+    }
+    pthread_mutex_unlock(&wal_lock);
+}
@@ -0,0 +1,57 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include "../tecnicofs-api-constants.h"
+
+/*
+ * Write-ahead log of the namespace. create, delete and move append a
+ * record of the change they made while they still hold the locks of
+ * the i-nodes it touched, so the records of changes to the same i-node
+ * are in the order they were made. Records name i-nodes by inumber,
+ * never by path: the ancestors of those i-nodes aren't locked and may
+ * be moved meanwhile. Before replying, an operation waits for its
+ * record to be on disk; one thread writes and syncs what every thread
+ * appended meanwhile, so concurrent operations share the fsync (group
+ * commit). On start the log is replayed and a torn tail cut off.
+ * The log is kept in the file named by TECNICOFS_WAL; without it
+ * nothing is logged.
+ *
+ * The locks are released before the wait, so other operations can see
+ * a change before it is on disk, and a crash can lose a change someone
+ * has seen. Only the operation that made it is promised durability.
+ * What replay rebuilds is still a state the tree went through: a
+ * change that depends on another is appended after it, and a crash only
+ * cuts off the tail of the log. Holding the locks through the fsync
+ * would close this gap, but creates in one directory would then each
+ * wait for a whole fsync of their own, under the parent's lock.
+ */
+#define WAL_BUFFER_SIZE (64 * 1024)
+
+typedef enum wal_op { WAL_CREATE = 1, WAL_DELETE, WAL_MOVE } wal_op;
+
+/* Header of a record, followed by its names, each ended by '\0' */
+typedef struct wal_record {
+	uint32_t length; /* of the whole record */
+	uint32_t checksum; /* FNV-1a of what follows it */
+	uint8_t op;
+	uint8_t nodeType; /* of the i-node created */
+	uint16_t pad;
+	int32_t parent; /* directory the entry is added to or removed from */
+	int32_t target; /* directory a moved entry is added to */
+	int32_t inumber; /* i-node of the entry */
+} WalRecord;
+
+#define WAL_MAX_RECORD (sizeof(WalRecord) + 2 * MAX_FILE_NAME)
+
+/* Redoes a record on replay: name is of the entry, target_name its new name on MOVE */
+typedef void (*wal_apply_t)(WalRecord *record, char *name, char *target_name);
+
+void wal_open(wal_apply_t apply, unsigned long long start);
+void wal_close();
+void wal_append(wal_op op, type nodeType, int parent, int target, int inumber, char *name, char *target_name);
+unsigned long long wal_position();
+void wal_commit();
+void wal_flush(unsigned long long lsn);
+
+#endif /* WAL_H */
@@ -1,25 +1,37 @@
+#define _GNU_SOURCE /* recvmmsg, sendmmsg */
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <string.h>
 #include <strings.h>
 #include <ctype.h>
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
 #include "fs/operations.h"
+#include "fs/dcache.h"
+#include "fs/slab.h"
+#include "fs/log.h"
+#include "tecnicofs-protocol.h"
+#include "tecnicofs-shm.h"
 
-#define MAX_INPUT_SIZE 100
+//* Messages taken by one recvmmsg and replies sent by one sendmmsg
+#define MMSG_BATCH 32
+//* Buffers for requests received and not yet run
+#define REQUEST_SLOTS (4 * MMSG_BATCH)
 
 int numberThreads = 0;
+//* Listening socket, and the epoll set of it and of the sessions
 int sockfd;
-
-void errorParse(){
-    fprintf(stderr, "Error: command invalid\n");
-    exit(EXIT_FAILURE);
-}
-
+int epollfd;
 
 int setAddr(char *path, struct sockaddr_un *addr) {
 
@@ -34,95 +46,1114 @@ int setAddr(char *path, struct sockaddr_un *addr) {
 }
 
 
-void *applyCommands(){
-    struct sockaddr_un client_addr;
-    socklen_t addrlen = sizeof(struct sockaddr_un);
-    FILE *outFile; 
-    char command[MAX_INPUT_SIZE];
-    char name[MAX_INPUT_SIZE];
-    char target[MAX_INPUT_SIZE];
-    char token;
-    int numTokens;
-    int result;
-    
-    while(1){
-        result = recvfrom(sockfd, command, sizeof(command), 0,(struct sockaddr *)&client_addr, &addrlen);
-        if (result <= 0) continue;
+//* File opened with OPEN: the i-node it resolved to and how
+typedef struct handle {
+    int inumber;
+    unsigned int generation;
+    permission mode; /* NONE if the handle is free */
+} handle;
 
-        numTokens = sscanf(command, "%c %s %s", &token, name, target);
-        if (numTokens < 2){
-            fprintf(stderr, "Error: invalid command in Queue\n");
-            exit(EXIT_FAILURE);
+/*
+ * Connection of a client. Idle, it costs its socket and this struct:
+ * requests are received into the shared slots only once they arrive,
+ * and the handles are allocated with the first OPEN.
+ */
+typedef struct session {
+    int fd;
+    int refs; /* the reactor, requests being run and the shm thread */
+    TfsShm *shm; /* rings negotiated with MOUNT_SHM, if any */
+    handle *handles; /* MAX_OPEN_FILES of them, or NULL */
+    pthread_mutex_t handlesLock;
+} session;
+
+
+/*
+ * Drops a reference to a session, closing it with the last one.
+ */
+void sessionRelease(session *s){
+    if (__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (s->shm != NULL) {
+            munmap(s->shm, sizeof(TfsShm));
         }
-        
-        switch (token){
-            case 'c':
-                switch (target[0]){
-                    case 'f':
-                        printf("Create file: %s\n", name);
-                        result = create(name, T_FILE);
-                        break;
-                    case 'd':
-                        printf("Create directory: %s\n", name);
-                        result =  create(name, T_DIRECTORY);
-                        break;
-                    default:
-                        fprintf(stderr, "Error: invalid node type \n");
-                        exit(EXIT_FAILURE);
-                }
+        close(s->fd);
+        pthread_mutex_destroy(&s->handlesLock);
+        free(s->handles);
+        free(s);
+    }
+}
+
+
+/*
+ * Gives a session a handle to a file.
+ * Returns: the handle, or TECNICOFS_ERROR_MAXED_OPEN_FILES
+ */
+int sessionOpen(session *s, int inumber, unsigned int generation, permission mode){
+    int fd = TECNICOFS_ERROR_MAXED_OPEN_FILES;
+
+    pthread_mutex_lock(&s->handlesLock);
+    if (s->handles == NULL && (s->handles = calloc(MAX_OPEN_FILES, sizeof(handle))) == NULL) {
+        fprintf(stderr, "Error: unable to allocate handles\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        if (s->handles[i].mode == NONE) {
+            s->handles[i].inumber = inumber;
+            s->handles[i].generation = generation;
+            s->handles[i].mode = mode;
+            fd = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s->handlesLock);
+    return fd;
+}
+
+
+/*
+ * Copies a handle of a session that allows the given mode.
+ * Returns: SUCCESS, TECNICOFS_ERROR_FILE_NOT_OPEN or
+ * TECNICOFS_ERROR_INVALID_MODE
+ */
+int sessionHandle(session *s, int fd, permission mode, handle *h){
+    int result = TECNICOFS_ERROR_FILE_NOT_OPEN;
+
+    pthread_mutex_lock(&s->handlesLock);
+    if (s->handles != NULL && fd >= 0 && fd < MAX_OPEN_FILES && s->handles[fd].mode != NONE) {
+        *h = s->handles[fd];
+        result = (h->mode & mode) == mode ? SUCCESS : TECNICOFS_ERROR_INVALID_MODE;
+    }
+    pthread_mutex_unlock(&s->handlesLock);
+    return result;
+}
+
+
+/*
+ * Frees a handle of a session.
+ * Returns: SUCCESS or TECNICOFS_ERROR_FILE_NOT_OPEN
+ */
+int sessionClose(session *s, int fd){
+    int result = TECNICOFS_ERROR_FILE_NOT_OPEN;
+
+    pthread_mutex_lock(&s->handlesLock);
+    if (s->handles != NULL && fd >= 0 && fd < MAX_OPEN_FILES && s->handles[fd].mode != NONE) {
+        s->handles[fd].mode = NONE;
+        result = SUCCESS;
+    }
+    pthread_mutex_unlock(&s->handlesLock);
+    return result;
+}
+
+
+//* Replies without payload held by a worker to be sent together
+typedef struct replies {
+    int count;
+    TfsReplyHeader headers[MMSG_BATCH];
+    session *sessions[MMSG_BATCH];
+    struct iovec iov[MMSG_BATCH];
+    struct mmsghdr msgs[MMSG_BATCH];
+} replies;
+
+//* Client a request is answered to, on its session or on its rings
+typedef struct reply_to {
+    session *session;
+    TfsShm *shm; /* set to reply on the rings */
+    replies *pending; /* NULL to reply at once */
+    TfsRequestHeader *request;
+} reply_to;
+
+
+/*
+ * Sends the replies held by a worker with as few syscalls as possible:
+ * one per run of replies to the same session. Replies to sessions the
+ * client closed are dropped.
+ */
+void flushReplies(replies *r){
+    int first, last, sent, res;
+
+    for (first = 0; first < r->count; first = last) {
+        for (last = first + 1; last < r->count && r->sessions[last] == r->sessions[first]; last++) {
+        }
+        for (sent = first; sent < last; sent += res) {
+            res = sendmmsg(r->sessions[first]->fd, r->msgs + sent, last - sent, MSG_NOSIGNAL);
+            if (res <= 0) {
                 break;
-            case 'l': 
-                result = lookfor(name);
-                if (result >= 0){
-                    printf("Search: %s found\n", name);
-                }
-                else{
-                    printf("Search: %s not found\n", name);
-                }
+            }
+        }
+    }
+    r->count = 0;
+}
+
+
+/*
+ * Sends the reply to a request, with the payload taken from the given
+ * buffers.
+ * Input:
+ *  - to: client and request
+ *  - status: SUCCESS or FAIL
+ *  - value: result of the operation
+ *  - data: payload buffers, datacnt <= FILE_MAX_EXTENTS
+ */
+void sendReply(reply_to *to, int status, int value, struct iovec *data, int datacnt){
+    TfsReplyHeader header;
+    struct iovec iov[FILE_MAX_EXTENTS + 1];
+    struct msghdr msg;
+
+    header.version = TFS_PROTOCOL_VERSION;
+    header.opcode = to->request->opcode;
+    header.flags = 0;
+    header.request_id = to->request->request_id;
+    header.status = status;
+    header.value = value;
+    header.length = 0;
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    for (int i = 0; i < datacnt; i++) {
+        iov[i + 1] = data[i];
+        header.length += data[i].iov_len;
+    }
+
+    if (to->shm != NULL) {
+        tfs_ring_put(to->shm, &to->shm->replies, iov, datacnt + 1);
+        return;
+    }
+
+    //* Payloads can't outlive the call (reads send from locked extents)
+    if (to->pending != NULL && datacnt == 0) {
+        replies *r = to->pending;
+        int i = r->count++;
+
+        r->headers[i] = header;
+        r->sessions[i] = to->session;
+        r->iov[i].iov_base = &r->headers[i];
+        r->iov[i].iov_len = sizeof(header);
+        memset(&r->msgs[i], 0, sizeof(struct mmsghdr));
+        r->msgs[i].msg_hdr.msg_iov = &r->iov[i];
+        r->msgs[i].msg_hdr.msg_iovlen = 1;
+        if (r->count == MMSG_BATCH) {
+            flushReplies(r);
+        }
+        return;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = datacnt + 1;
+    sendmsg(to->session->fd, &msg, MSG_NOSIGNAL);
+}
+
+
+/*
+ * Replies to a read with the data straight from the file's extents.
+ */
+void sendRead(int result, struct iovec *data, int datacnt, void *arg){
+    sendReply(arg, result < 0 ? FAIL : SUCCESS, result, data, datacnt);
+}
+
+
+/*
+ * Runs one request. Reads are answered by read_file itself, so they can
+ * only be run with a client to reply to.
+ * Input:
+ *  - header: header of the request
+ *  - payload: arguments of the request
+ *  - to: client the reply of a read goes to, or NULL
+ *  - valid: set to 0 if the request is malformed
+ * Returns: result of the operation
+ */
+int applyRequest(TfsRequestHeader *header, TfsBuffer *payload, reply_to *to, int *valid){
+    FILE *outFile; 
+    char *name, *target;
+    int32_t nodeType, offset, len, fd, mode;
+    int result = FAIL;
+    unsigned int generation;
+    long hits, misses;
+    SlabStats slab;
+    handle h;
+
+    switch (header->version == TFS_PROTOCOL_VERSION ? header->opcode : 0){
+        case TFS_OP_CREATE:
+            if (tfs_get_int(payload, &nodeType) != 0 || tfs_get_path(payload, &name) != 0) {
+                *valid = 0;
+                break;
+            }
+            switch (nodeType){
+                case T_FILE:
+                    log_printf(LOG_INFO, "Create file: %s\n", name);
+                    result = create(name, T_FILE);
+                    break;
+                case T_DIRECTORY:
+                    log_printf(LOG_INFO, "Create directory: %s\n", name);
+                    result =  create(name, T_DIRECTORY);
+                    break;
+                default:
+                    log_printf(LOG_ERROR, "Error: invalid node type\n");
+                    *valid = 0;
+            }
+            break;
+        case TFS_OP_LOOKUP: 
+            if (tfs_get_path(payload, &name) != 0) {
+                *valid = 0;
                 break;
-            case 'd':
-                printf("Delete: %s\n", name);
-                result = delete(name);
+            }
+            result = lookfor(name);
+            if (result >= 0){
+                log_printf(LOG_INFO, "Search: %s found\n", name);
+            }
+            else{
+                log_printf(LOG_INFO, "Search: %s not found\n", name);
+            }
+            break;
+        case TFS_OP_DELETE:
+            if (tfs_get_path(payload, &name) != 0) {
+                *valid = 0;
                 break;
+            }
+            log_printf(LOG_INFO, "Delete: %s\n", name);
+            result = delete(name);
+            break;
 
-            case 'm':
-                printf("Move: %s to %s\n", name, target);
-                result = move(name, target);
+        case TFS_OP_MOVE:
+            if (tfs_get_path(payload, &name) != 0 || tfs_get_path(payload, &target) != 0) {
+                *valid = 0;
                 break;
+            }
+            log_printf(LOG_INFO, "Move: %s to %s\n", name, target);
+            result = move(name, target);
+            break;
 
-            case 'p':
-                printf("Print tree to %s\n", name);
-                if((outFile = fopen(name, "w")) == NULL){
-                    fprintf(stderr, "Error: problem opening %s\n",name);
-                    exit(EXIT_FAILURE);
-                }
-                result = print_tecnicofs_tree(outFile);
-                fclose(outFile);
+        case TFS_OP_WRITE:
+            if (tfs_get_int(payload, &offset) != 0 || tfs_get_path(payload, &name) != 0) {
+                *valid = 0;
                 break;
+            }
+            len = tfs_remaining(payload);
+            log_printf(LOG_INFO, "Write: %s at %d, %d bytes\n", name, offset, len);
+            result = write_file(name, payload->data + payload->pos, len, offset);
+            break;
 
-            default: { /* error */
-                fprintf(stderr, "Error: command to apply\n");
+        case TFS_OP_READ:
+            if (to == NULL || tfs_get_int(payload, &offset) != 0 || tfs_get_int(payload, &len) != 0
+                || tfs_get_path(payload, &name) != 0 || len < 0) {
+                *valid = 0;
+                break;
+            }
+            log_printf(LOG_INFO, "Read: %s at %d, %d bytes\n", name, offset, len);
+            result = read_file(name, len > MAX_IO_SIZE ? MAX_IO_SIZE : len, offset, sendRead, to);
+            break;
+
+        case TFS_OP_OPEN:
+            if (to == NULL || tfs_get_int(payload, &mode) != 0 || tfs_get_path(payload, &name) != 0) {
+                *valid = 0;
+                break;
+            }
+            log_printf(LOG_INFO, "Open: %s\n", name);
+            if (mode != READ && mode != WRITE && mode != RW) {
+                result = TECNICOFS_ERROR_INVALID_MODE;
+            }
+            else if ((result = open_file(name, &generation)) == FAIL) {
+                result = TECNICOFS_ERROR_FILE_NOT_FOUND;
+            }
+            else {
+                result = sessionOpen(to->session, result, generation, mode);
+            }
+            break;
+
+        case TFS_OP_CLOSE:
+            if (to == NULL || tfs_get_int(payload, &fd) != 0) {
+                *valid = 0;
+                break;
+            }
+            log_printf(LOG_INFO, "Close: %d\n", fd);
+            result = sessionClose(to->session, fd);
+            break;
+
+        case TFS_OP_WRITE_HANDLE:
+            if (to == NULL || tfs_get_int(payload, &fd) != 0 || tfs_get_int(payload, &offset) != 0) {
+                *valid = 0;
+                break;
+            }
+            len = tfs_remaining(payload);
+            log_printf(LOG_INFO, "Write: handle %d at %d, %d bytes\n", fd, offset, len);
+            if ((result = sessionHandle(to->session, fd, WRITE, &h)) == SUCCESS) {
+                result = write_handle(h.inumber, h.generation, payload->data + payload->pos, len, offset);
+            }
+            break;
+
+        //* Replied by read_handle, or here if it doesn't get to run
+        case TFS_OP_READ_HANDLE:
+            if (to == NULL || tfs_get_int(payload, &fd) != 0 || tfs_get_int(payload, &offset) != 0
+                || tfs_get_int(payload, &len) != 0 || len < 0) {
+                *valid = 0;
+                break;
+            }
+            log_printf(LOG_INFO, "Read: handle %d at %d, %d bytes\n", fd, offset, len);
+            if ((result = sessionHandle(to->session, fd, READ, &h)) == SUCCESS) {
+                result = read_handle(h.inumber, h.generation, len > MAX_IO_SIZE ? MAX_IO_SIZE : len,
+                                     offset, sendRead, to);
+            }
+            else {
+                sendRead(result, NULL, 0, to);
+            }
+            break;
+
+        case TFS_OP_STAT:
+            if (to == NULL || tfs_get_int(payload, &fd) != 0) {
+                *valid = 0;
+                break;
+            }
+            log_printf(LOG_INFO, "Stat: handle %d\n", fd);
+            if ((result = sessionHandle(to->session, fd, NONE, &h)) == SUCCESS) {
+                result = stat_handle(h.inumber, h.generation);
+            }
+            break;
+
+        case TFS_OP_PRINT:
+            if (tfs_get_path(payload, &name) != 0) {
+                *valid = 0;
+                break;
+            }
+            log_printf(LOG_INFO, "Print tree to %s\n", name);
+            if((outFile = fopen(name, "w")) == NULL){
+                fprintf(stderr, "Error: problem opening %s\n",name);
                 exit(EXIT_FAILURE);
             }
+            result = print_tecnicofs_tree(outFile);
+            fclose(outFile);
+            dcache_stats(&hits, &misses);
+            log_printf(LOG_INFO, "Dentry cache: %ld hits, %ld misses\n", hits, misses);
+            slab_stats(&slab);
+            log_printf(LOG_INFO, "Slab: %ld allocs, %ld frees, %ld bytes in use, %ld bytes reserved\n",
+                   slab.allocs, slab.frees, slab.bytes_in_use, slab.bytes_reserved);
+            break;
+
+        default: { /* error */
+            *valid = 0;
         }
-        sendto(sockfd, &result, sizeof(int), 0, (struct sockaddr *)&client_addr, addrlen);
+    }
+
+    if (!*valid) {
+        log_printf(LOG_ERROR, "Error: malformed request\n");
+        return FAIL;
+    }
+    return result;
+}
+
+
+//* Requests of one BATCH, run by its thread and, if independent, by the helpers
+typedef struct batch {
+    int count;
+    TfsRequestHeader headers[TFS_MAX_BATCH];
+    TfsBuffer payloads[TFS_MAX_BATCH];
+    TfsResult results[TFS_MAX_BATCH];
+    int next; /* next request to run, taken with an atomic increment */
+    int helpers; /* helpers running requests of the batch */
+    struct batch *nextBatch;
+} batch;
+
+//* Parallel batches with requests left to run
+batch *batchQueue = NULL;
+pthread_mutex_t batchLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t batchPosted = PTHREAD_COND_INITIALIZER;
+pthread_cond_t batchFinished = PTHREAD_COND_INITIALIZER;
+
+
+/*
+ * Runs requests of the batch until none is left, then takes it out of
+ * the queue so no more helpers join.
+ */
+void runBatch(batch *b){
+    int i;
+
+    while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->count) {
+        int valid = 1;
+        int result = applyRequest(&b->headers[i], &b->payloads[i], NULL, &valid);
+
+        b->results[i].status = result < 0 ? FAIL : SUCCESS;
+        b->results[i].value = result;
+    }
+
+    pthread_mutex_lock(&batchLock);
+    for (batch **prev = &batchQueue; *prev != NULL; prev = &(*prev)->nextBatch) {
+        if (*prev == b) {
+            *prev = b->nextBatch;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&batchLock);
+}
+
+
+/*
+ * Helper thread: runs requests of the parallel batches posted by the
+ * threads that received them.
+ */
+void *batchHelper(){
+    batch *b;
+
+    while(1){
+        pthread_mutex_lock(&batchLock);
+        while (batchQueue == NULL) {
+            pthread_cond_wait(&batchPosted, &batchLock);
+        }
+        b = batchQueue;
+        b->helpers++;
+        pthread_mutex_unlock(&batchLock);
+
+        runBatch(b);
+
+        pthread_mutex_lock(&batchLock);
+        b->helpers--;
+        pthread_cond_broadcast(&batchFinished);
+        pthread_mutex_unlock(&batchLock);
     }
     return NULL;
 }
 
 
+/*
+ * Runs a BATCH request: in order by this thread, or spread over the
+ * helpers if its requests are independent.
+ * Input:
+ *  - header: header of the batch
+ *  - payload: count and requests
+ *  - b: filled with the results
+ * Returns: number of requests, or FAIL if malformed
+ */
+int applyBatch(TfsRequestHeader *header, TfsBuffer *payload, batch *b){
+    int32_t count;
+
+    if (tfs_get_int(payload, &count) != 0 || count < 0 || count > TFS_MAX_BATCH) {
+        return FAIL;
+    }
+
+    //* Every request is checked to be complete before any runs
+    for (int i = 0; i < count; i++) {
+        if (tfs_get(payload, &b->headers[i], sizeof(TfsRequestHeader)) != 0
+            || b->headers[i].opcode == TFS_OP_BATCH
+            || tfs_get_slice(payload, &b->payloads[i], b->headers[i].length) != 0) {
+            return FAIL;
+        }
+    }
+    b->count = count;
+    b->next = 0;
+    b->helpers = 0;
+
+    if (!(header->flags & TFS_FLAG_PARALLEL)) {
+        runBatch(b);
+        return count;
+    }
+
+    pthread_mutex_lock(&batchLock);
+    b->nextBatch = batchQueue;
+    batchQueue = b;
+    pthread_cond_broadcast(&batchPosted);
+    pthread_mutex_unlock(&batchLock);
+
+    runBatch(b);
+
+    //* The batch is out of the queue, wait for the helpers still in it
+    pthread_mutex_lock(&batchLock);
+    while (b->helpers > 0) {
+        pthread_cond_wait(&batchFinished, &batchLock);
+    }
+    pthread_mutex_unlock(&batchLock);
+    return count;
+}
+
+
+void *serveShm(void *arg);
+
+
+/*
+ * Maps the shared memory of a session that asked for it and starts a
+ * thread serving its rings. The mapping lives as long as the session.
+ * Returns: SUCCESS, or FAIL if invalid or the session already has one
+ */
+int mountShm(TfsBuffer *payload, session *s){
+    char *name;
+    TfsShm *shm, *none = NULL;
+    struct stat st;
+    pthread_t tid;
+    int fd;
+
+    if (tfs_get_path(payload, &name) != 0 || (fd = shm_open(name, O_RDWR, 0)) < 0) {
+        return FAIL;
+    }
+    //* Touching a page past the end of a shorter object would raise SIGBUS
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(TfsShm)) {
+        close(fd);
+        return FAIL;
+    }
+    shm = mmap(NULL, sizeof(TfsShm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        return FAIL;
+    }
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != TFS_SHM_MAGIC) {
+        munmap(shm, sizeof(TfsShm));
+        return FAIL;
+    }
+
+    shm->server = getpid();
+    if (!__atomic_compare_exchange_n(&s->shm, &none, shm, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        munmap(shm, sizeof(TfsShm));
+        return FAIL;
+    }
+    __atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+    if (pthread_create(&tid, NULL, serveShm, s) != 0) {
+        fprintf(stderr, "Error: problems creating thread\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(tid);
+    log_printf(LOG_INFO, "Mount shared memory: %s\n", name);
+    return SUCCESS;
+}
+
+
+/*
+ * Runs a request received on a session or on its ring and replies to it.
+ * Input:
+ *  - request: header and payload, parsed in place
+ *  - size: bytes of the request
+ *  - to: client to reply to
+ *  - b: room for the requests of a batch
+ */
+void handleRequest(char *request, int size, reply_to *to, batch *b){
+    TfsRequestHeader header;
+    TfsBuffer payload;
+    struct iovec results;
+    int result, valid;
+
+    if (size < (int) sizeof(TfsRequestHeader)) return;
+
+    memcpy(&header, request, sizeof(header));
+    to->request = &header;
+    tfs_buffer_init(&payload, request + sizeof(header), size - sizeof(header));
+    valid = header.length == size - sizeof(header) && header.version == TFS_PROTOCOL_VERSION;
+
+    if (valid && header.opcode == TFS_OP_BATCH) {
+        if ((result = applyBatch(&header, &payload, b)) == FAIL) {
+            log_printf(LOG_ERROR, "Error: malformed request\n");
+            sendReply(to, FAIL, FAIL, NULL, 0);
+            return;
+        }
+        results.iov_base = b->results;
+        results.iov_len = result * sizeof(TfsResult);
+        sendReply(to, SUCCESS, result, &results, 1);
+        return;
+    }
+
+    if (valid && header.opcode == TFS_OP_MOUNT_SHM && to->shm == NULL) {
+        result = mountShm(&payload, to->session);
+    }
+    else if (valid) {
+        result = applyRequest(&header, &payload, to, &valid);
+    }
+    else {
+        log_printf(LOG_ERROR, "Error: malformed request\n");
+        result = FAIL;
+    }
+
+    //* Reads already replied with their data
+    if (!valid || (header.opcode != TFS_OP_READ && header.opcode != TFS_OP_READ_HANDLE)) {
+        sendReply(to, result < 0 ? FAIL : SUCCESS, result, NULL, 0);
+    }
+}
+
+
+//* Request received on the socket, waiting for or being run by a worker
+typedef struct slot {
+    char request[TFS_MAX_REQUEST];
+    int size;
+    reply_to to;
+    struct slot *next;
+} slot;
+
+slot *freeSlots = NULL;
+pthread_mutex_t slotsLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Requests routed to a worker, in order of arrival. The owner takes
+ * from the front and idle workers steal from the back.
+ */
+typedef struct workQueue {
+    pthread_mutex_t lock;
+    slot *first, *last;
+    int count;
+    int idle; /* the owner waits for work, under workLock */
+    pthread_cond_t posted;
+} __attribute__((aligned(64))) workQueue;
+
+workQueue *queues;
+//* Idle workers wait under it, for requests or their turn to poll
+pthread_mutex_t workLock = PTHREAD_MUTEX_INITIALIZER;
+int idleWorkers = 0;
+//* Whether a worker waits on epoll for the others, under workLock
+int polling = 0;
+//* Whether a thief can run beside the worker it steals from
+int manyCpus = 0;
+
+
+/*
+ * Accepts the clients waiting to connect, each in a session of its own.
+ */
+void acceptSessions(){
+    struct epoll_event event;
+    session *s;
+    int fd;
+
+    while ((fd = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+        if ((s = malloc(sizeof(session))) == NULL) {
+            fprintf(stderr, "Error: unable to allocate session\n");
+            exit(EXIT_FAILURE);
+        }
+        s->fd = fd;
+        s->refs = 1;
+        s->shm = NULL;
+        s->handles = NULL;
+        pthread_mutex_init(&s->handlesLock, NULL);
+        event.events = EPOLLIN;
+        event.data.ptr = s;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            sessionRelease(s);
+        }
+    }
+}
+
+
+/*
+ * Ends a session the client closed. Requests of it still running keep
+ * it until they are done.
+ */
+void closeSession(session *s){
+    TfsShm *shm = __atomic_load_n(&s->shm, __ATOMIC_ACQUIRE);
+
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, s->fd, NULL);
+    if (shm != NULL) {
+        tfs_shm_close(shm);
+    }
+    sessionRelease(s);
+}
+
+
+/*
+ * Chooses the worker of a request by the first component of its path,
+ * so the requests on a subtree find its i-nodes in that worker's cache.
+ * Those without a path stay with the other requests of their session.
+ */
+int requestWorker(slot *r){
+    TfsRequestHeader header;
+    TfsBuffer payload;
+    int32_t skip = 0, value;
+    unsigned int hash = 2166136261u;
+    char *path;
+
+    //* Too short for a header: handleRequest drops it
+    if (r->size < (int) sizeof(header)) {
+        return 0;
+    }
+    memcpy(&header, r->request, sizeof(header));
+    tfs_buffer_init(&payload, r->request + sizeof(header), r->size - sizeof(header));
+    switch (header.opcode) {
+        case TFS_OP_READ:
+            skip = 2;
+            break;
+        case TFS_OP_CREATE:
+        case TFS_OP_WRITE:
+        case TFS_OP_OPEN:
+            skip = 1;
+            break;
+        case TFS_OP_LOOKUP:
+        case TFS_OP_DELETE:
+        case TFS_OP_MOVE:
+            break;
+        default:
+            skip = -1;
+    }
+    for (int i = 0; i < skip; i++) {
+        tfs_get_int(&payload, &value);
+    }
+    if (skip < 0 || tfs_get_path(&payload, &path) != 0) {
+        return ((uintptr_t) r->to.session / sizeof(session)) % numberThreads;
+    }
+
+    //* FNV-1a of the first component, ignoring leading slashes
+    while (*path == '/') {
+        path++;
+    }
+    for (; *path != '\0' && *path != '/'; path++) {
+        hash = (hash ^ (unsigned char) *path) * 16777619u;
+    }
+    return hash % numberThreads;
+}
+
+
+/*
+ * Queues a received request for its worker, waking it, or another idle
+ * worker to steal it if that one is busy. The worker that received it
+ * runs its own requests after polling: it only wakes a thief for those
+ * past the first, and only if the thief has a CPU of its own.
+ */
+void postRequest(slot *r, int self){
+    int worker = requestWorker(r);
+    workQueue *q = &queues[worker];
+
+    r->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->last == NULL) {
+        q->first = r;
+    }
+    else {
+        q->last->next = r;
+    }
+    q->last = r;
+    __atomic_store_n(&q->count, q->count + 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&q->lock);
+
+    if ((worker != self || (manyCpus && __atomic_load_n(&q->count, __ATOMIC_SEQ_CST) > 1))
+        && __atomic_load_n(&idleWorkers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&workLock);
+        if (!q->idle) {
+            for (int i = 0; i < numberThreads; i++) {
+                if (queues[i].idle) {
+                    q = &queues[i];
+                    break;
+                }
+            }
+        }
+        pthread_cond_signal(&q->posted);
+        pthread_mutex_unlock(&workLock);
+    }
+}
+
+
+/*
+ * Receives the requests a session has ready, many per syscall, into
+ * free slots and queues them for the workers. Those that don't fit are
+ * left for the next round of epoll.
+ */
+void receiveSession(session *s, int self){
+    slot *slots[MMSG_BATCH];
+    struct mmsghdr msgs[MMSG_BATCH];
+    struct iovec iov[MMSG_BATCH];
+    int count, received, closed = 0;
+
+    pthread_mutex_lock(&slotsLock);
+    for (count = 0; count < MMSG_BATCH && freeSlots != NULL; count++) {
+        slots[count] = freeSlots;
+        freeSlots = freeSlots->next;
+    }
+    pthread_mutex_unlock(&slotsLock);
+    if (count == 0) {
+        return;
+    }
+
+    memset(msgs, 0, count * sizeof(struct mmsghdr));
+    for (int i = 0; i < count; i++) {
+        iov[i].iov_base = slots[i]->request;
+        iov[i].iov_len = TFS_MAX_REQUEST;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    if ((received = recvmmsg(s->fd, msgs, count, MSG_DONTWAIT, NULL)) < 0) {
+        closed = errno != EAGAIN && errno != EWOULDBLOCK;
+        received = 0;
+    }
+    //* The end of the connection reads as an empty message
+    for (int i = 0; i < received; i++) {
+        if (msgs[i].msg_len == 0) {
+            received = i;
+            closed = 1;
+        }
+    }
+
+    __atomic_add_fetch(&s->refs, received, __ATOMIC_RELAXED);
+    for (int i = 0; i < received; i++) {
+        slots[i]->size = msgs[i].msg_len;
+        slots[i]->to.session = s;
+        postRequest(slots[i], self);
+    }
+
+    if (received < count) {
+        pthread_mutex_lock(&slotsLock);
+        for (int i = received; i < count; i++) {
+            slots[i]->next = freeSlots;
+            freeSlots = slots[i];
+        }
+        pthread_mutex_unlock(&slotsLock);
+    }
+
+    if (closed) {
+        closeSession(s);
+    }
+}
+
+
+/*
+ * Waits on the listening socket and on every session at once, accepting
+ * clients and receiving the requests that arrive. A request so usually
+ * runs on the thread that received it, without a switch to another.
+ * With more than one CPU, an idle worker polls while this one runs them.
+ */
+void pollRequests(int self){
+    struct epoll_event events[MMSG_BATCH];
+    int ready;
+
+    if ((ready = epoll_wait(epollfd, events, MMSG_BATCH, -1)) < 0) {
+        ready = 0;
+    }
+    for (int i = 0; i < ready; i++) {
+        if (events[i].data.ptr == NULL) {
+            acceptSessions();
+        }
+        else {
+            receiveSession(events[i].data.ptr, self);
+        }
+    }
+
+    pthread_mutex_lock(&workLock);
+    polling = 0;
+    for (int i = 0; manyCpus && i < numberThreads; i++) {
+        if (queues[i].idle) {
+            pthread_cond_signal(&queues[i].posted);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&workLock);
+}
+
+
+/*
+ * Takes requests from a queue: from the front, for its owner, or from
+ * the back, for a thief. Either takes half, so the rest can be stolen.
+ * Returns: the first request, linked to the others up to last, or NULL
+ */
+slot *takeRequests(workQueue *q, int steal, slot **last){
+    slot *first;
+    int share;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->count == 0) {
+        pthread_mutex_unlock(&q->lock);
+        return NULL;
+    }
+    share = (q->count + 1) / 2;
+    if (share > MMSG_BATCH) {
+        share = MMSG_BATCH;
+    }
+
+    if (!steal) {
+        first = *last = q->first;
+        for (int i = 1; i < share; i++) {
+            *last = (*last)->next;
+        }
+        q->first = (*last)->next;
+        if (q->first == NULL) {
+            q->last = NULL;
+        }
+        (*last)->next = NULL;
+    }
+    else if (share == q->count) {
+        first = q->first;
+        *last = q->last;
+        q->first = q->last = NULL;
+    }
+    else {
+        slot *keep = q->first;
+
+        for (int i = 1; i < q->count - share; i++) {
+            keep = keep->next;
+        }
+        first = keep->next;
+        *last = q->last;
+        keep->next = NULL;
+        q->last = keep;
+    }
+    __atomic_store_n(&q->count, q->count - share, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&q->lock);
+    return first;
+}
+
+
+/*
+ * Steals from the longest queue of the other workers.
+ * Returns: as takeRequests, NULL if they are all empty
+ */
+slot *stealRequests(int self, slot **last){
+    slot *first = NULL;
+
+    while (first == NULL) {
+        int victim = -1, longest = 0;
+
+        for (int i = 1; i < numberThreads; i++) {
+            int w = (self + i) % numberThreads;
+            int count = __atomic_load_n(&queues[w].count, __ATOMIC_SEQ_CST);
+
+            if (count > longest) {
+                victim = w;
+                longest = count;
+            }
+        }
+        if (victim < 0) {
+            return NULL;
+        }
+        first = takeRequests(&queues[victim], 1, last);
+    }
+    return first;
+}
+
+
+/*
+ * Waits until some queue has requests, or until no worker polls and
+ * there are slots to receive into. Without slots, the workers running
+ * their requests free them and poll when they are done.
+ * Returns: 1 if the worker is to poll, 0 if there are requests
+ */
+int waitRequests(int self){
+    int queued = 0, poll = 0;
+
+    pthread_mutex_lock(&workLock);
+    queues[self].idle = 1;
+    __atomic_add_fetch(&idleWorkers, 1, __ATOMIC_SEQ_CST);
+    while (!queued && !poll) {
+        for (int i = 0; i < numberThreads && !queued; i++) {
+            queued = __atomic_load_n(&queues[i].count, __ATOMIC_SEQ_CST) > 0;
+        }
+        poll = !queued && !polling && __atomic_load_n(&freeSlots, __ATOMIC_SEQ_CST) != NULL;
+        if (!queued && !poll) {
+            pthread_cond_wait(&queues[self].posted, &workLock);
+        }
+    }
+    __atomic_sub_fetch(&idleWorkers, 1, __ATOMIC_SEQ_CST);
+    queues[self].idle = 0;
+    if (poll) {
+        polling = 1;
+    }
+    pthread_mutex_unlock(&workLock);
+    return poll;
+}
+
+
+/*
+ * Worker: runs the requests routed to it, or stolen from the others
+ * when it has none, and sends their replies together. When there are
+ * none to steal either, it polls for the others or waits.
+ */
+void *applyCommands(void *arg){
+    int self = (intptr_t) arg;
+    replies pending;
+    batch b;
+    slot *first, *last;
+
+    pending.count = 0;
+    while(1){
+        if ((first = takeRequests(&queues[self], 0, &last)) == NULL
+            && (first = stealRequests(self, &last)) == NULL) {
+            if (waitRequests(self)) {
+                pollRequests(self);
+            }
+            continue;
+        }
+
+        for (slot *s = first; s != NULL; s = s->next) {
+            s->to.shm = NULL;
+            s->to.pending = &pending;
+            handleRequest(s->request, s->size, &s->to, &b);
+        }
+        flushReplies(&pending);
+        for (slot *s = first; s != NULL; s = s->next) {
+            sessionRelease(s->to.session);
+        }
+
+        pthread_mutex_lock(&slotsLock);
+        last->next = freeSlots;
+        __atomic_store_n(&freeSlots, first, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&slotsLock);
+    }
+    return NULL;
+}
+
+
+/*
+ * Thread of a session with shared memory: runs the requests of its
+ * ring until the client unmounts, exits or closes it. The client can
+ * still write a request in the ring, so each one is copied out before
+ * it is parsed. A request longer than any valid one ends the session.
+ */
+void *serveShm(void *arg){
+    session *s = arg;
+    TfsShm *shm = s->shm;
+    reply_to to;
+    batch b;
+    char *request, *copy;
+    uint32_t size;
+
+    if ((copy = malloc(TFS_MAX_REQUEST)) == NULL) {
+        fprintf(stderr, "Error: unable to allocate request buffer\n");
+        exit(EXIT_FAILURE);
+    }
+    to.session = s;
+    to.shm = shm;
+    to.pending = NULL;
+    while (tfs_ring_peek(shm, &shm->requests, &request, &size) == 0) {
+        if (size > TFS_MAX_REQUEST) {
+            log_printf(LOG_WARN, "Shared memory request of %u bytes, closing the session\n", size);
+            break;
+        }
+        memcpy(copy, request, size);
+        tfs_ring_release(&shm->requests, size);
+        handleRequest(copy, size, &to, &b);
+    }
+    free(copy);
+    sessionRelease(s);
+    return NULL;
+}
+
+
 void threadPool(){
-    pthread_t tid[numberThreads];
+    pthread_t tid[numberThreads], helper;
+    slot *slots;
     int i;
 
+    if ((slots = malloc(REQUEST_SLOTS * sizeof(slot))) == NULL) {
+        fprintf(stderr, "Error: unable to allocate request buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < REQUEST_SLOTS; i++) {
+        slots[i].next = freeSlots;
+        freeSlots = &slots[i];
+    }
+    manyCpus = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+    if (posix_memalign((void **) &queues, 64, numberThreads * sizeof(workQueue)) != 0) {
+        fprintf(stderr, "Error: unable to allocate work queues\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < numberThreads; i++) {
+        pthread_mutex_init(&queues[i].lock, NULL);
+        pthread_cond_init(&queues[i].posted, NULL);
+        queues[i].first = queues[i].last = NULL;
+        queues[i].count = 0;
+        queues[i].idle = 0;
+    }
+
     //* Creates threads
     for(i=0; i<numberThreads; i++){ 
-        if(pthread_create (&tid[i], NULL, applyCommands, NULL) != 0){
+        if(pthread_create (&tid[i], NULL, applyCommands, (void *) (intptr_t) i) != 0){
             fprintf(stderr, "Error: problems creating thread\n");
             exit(EXIT_FAILURE);
         }
     }
 
+    //* The thread that receives a parallel batch runs it too
+    for(i=1; i<numberThreads; i++){ 
+        if(pthread_create (&helper, NULL, batchHelper, NULL) != 0){
+            fprintf(stderr, "Error: problems creating thread\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(helper);
+    }
+
 
     //* Joins threads
     for(i = 0 ; i < numberThreads ; i++){
@@ -131,12 +1162,15 @@ void threadPool(){
             exit(EXIT_FAILURE);
         }
     }
+    free(queues);
+    free(slots);
 }
 
 int main(int argc, char* argv[]){
     char *path;
     struct sockaddr_un addr;
     socklen_t addrlen;
+    struct epoll_event event;
 
 
     if(argc != 3){
@@ -149,7 +1183,7 @@ int main(int argc, char* argv[]){
         exit(EXIT_FAILURE);
     }
 
-    if ((sockfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+    if ((sockfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0)) < 0) {
         fprintf(stderr,"Server: can't open socket\n");
         exit(EXIT_FAILURE);
     }
@@ -163,6 +1197,23 @@ int main(int argc, char* argv[]){
         exit(EXIT_FAILURE);
     }
 
+    if (listen(sockfd, SOMAXCONN) < 0) {
+        fprintf(stderr,"Server: listen error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    //* The listening socket is the only one without a session
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if ((epollfd = epoll_create1(EPOLL_CLOEXEC)) < 0
+        || epoll_ctl(epollfd, EPOLL_CTL_ADD, sockfd, &event) < 0) {
+        fprintf(stderr,"Server: can't create epoll set\n");
+        exit(EXIT_FAILURE);
+    }
+
+    //* Logger first: init_fs may already log
+    log_init();
+
     //* init filesystem 
     init_fs();
 
@@ -171,6 +1222,7 @@ int main(int argc, char* argv[]){
 
     //* Release allocated memory
     destroy_fs();
+    log_destroy();
 
     exit(EXIT_SUCCESS);
 }
\ No newline at end of file
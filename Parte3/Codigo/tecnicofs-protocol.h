@@ -0,0 +1,198 @@
+/* tecnicofs-protocol.h */
+#ifndef TECNICOFS_PROTOCOL_H
+#define TECNICOFS_PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+#include "tecnicofs-api-constants.h"
+
+/*
+ * Binary protocol between the clients and the server. Every datagram
+ * is a fixed header followed by `length` bytes of payload. Integers are
+ * in host order (the sockets are local) and paths are a uint16_t length,
+ * '\0' included, followed by the chars, so the server can use them in
+ * place. Payload of each request:
+ *  - CREATE: int32 node type, path
+ *  - DELETE, LOOKUP, PRINT: path
+ *  - MOVE: origin path, destiny path
+ *  - WRITE: int32 offset, path, then the data up to the end
+ *  - READ: int32 offset, int32 length, path
+ *  - BATCH: int32 count, then count requests of any other kind but READ
+ *    and those on handles, each with its own header and payload
+ *  - MOUNT_SHM: name of a shared memory object with a TfsShm, see
+ *    tecnicofs-shm.h; only on the socket
+ *  - OPEN: int32 permission, path
+ *  - CLOSE, STAT: int32 handle
+ *  - WRITE_HANDLE: int32 handle, int32 offset, then the data
+ *  - READ_HANDLE: int32 handle, int32 offset, int32 length
+ * Replies have a status (SUCCESS or FAIL) and a typed value: the inumber
+ * for LOOKUP, the handle for OPEN, the size for STAT, the number of
+ * bytes for writes and reads; reads carry the data as payload. Failed
+ * requests may have a TECNICOFS_ERROR_* code as value. BATCH replies have the count as value and one
+ * TfsResult per request as payload, in the order of the requests.
+ */
+#define TFS_PROTOCOL_VERSION 1
+
+enum tfs_opcode {
+	TFS_OP_CREATE = 1,
+	TFS_OP_DELETE,
+	TFS_OP_LOOKUP,
+	TFS_OP_MOVE,
+	TFS_OP_PRINT,
+	TFS_OP_WRITE,
+	TFS_OP_READ,
+	TFS_OP_BATCH,
+	TFS_OP_MOUNT_SHM,
+	TFS_OP_OPEN,
+	TFS_OP_CLOSE,
+	TFS_OP_WRITE_HANDLE,
+	TFS_OP_READ_HANDLE,
+	TFS_OP_STAT
+};
+
+/* Flag of BATCH requests: their requests are independent, in any order */
+#define TFS_FLAG_PARALLEL 0x1
+/* Max requests in one BATCH */
+#define TFS_MAX_BATCH 256
+
+typedef struct tfs_request_header {
+	uint8_t version;
+	uint8_t opcode;
+	uint16_t flags;
+	uint32_t request_id;
+	uint32_t length;
+} TfsRequestHeader;
+
+typedef struct tfs_reply_header {
+	uint8_t version;
+	uint8_t opcode;
+	uint16_t flags;
+	uint32_t request_id;
+	int32_t status;
+	int32_t value;
+	uint32_t length;
+} TfsReplyHeader;
+
+typedef struct tfs_result {
+	int32_t status;
+	int32_t value;
+} TfsResult;
+
+/* Largest request: a write with the longest path and MAX_IO_SIZE bytes */
+#define TFS_MAX_REQUEST (sizeof(TfsRequestHeader) + 2 * (sizeof(uint16_t) + MAX_PATH_SIZE) \
+                         + 2 * sizeof(int32_t) + MAX_IO_SIZE)
+
+/*
+ * Cursor over a request or reply being built or parsed
+ */
+typedef struct tfs_buffer {
+	char *data;
+	size_t size;
+	size_t pos;
+} TfsBuffer;
+
+
+static inline void tfs_buffer_init(TfsBuffer *buffer, void *data, size_t size) {
+	buffer->data = data;
+	buffer->size = size;
+	buffer->pos = 0;
+}
+
+
+/*
+ * Appends bytes to the buffer.
+ * Returns: 0, or -1 if they don't fit
+ */
+static inline int tfs_put(TfsBuffer *buffer, const void *src, size_t n) {
+	if (n > buffer->size - buffer->pos) {
+		return -1;
+	}
+	memcpy(buffer->data + buffer->pos, src, n);
+	buffer->pos += n;
+	return 0;
+}
+
+
+static inline int tfs_put_int(TfsBuffer *buffer, int32_t value) {
+	return tfs_put(buffer, &value, sizeof(value));
+}
+
+
+static inline int tfs_put_path(TfsBuffer *buffer, const char *path) {
+	size_t len = strlen(path) + 1;
+	uint16_t prefix = len;
+
+	if (len > MAX_PATH_SIZE) {
+		return -1;
+	}
+	if (tfs_put(buffer, &prefix, sizeof(prefix)) != 0) {
+		return -1;
+	}
+	return tfs_put(buffer, path, len);
+}
+
+
+/*
+ * Reads bytes from the buffer.
+ * Returns: 0, or -1 if there aren't enough
+ */
+static inline int tfs_get(TfsBuffer *buffer, void *dest, size_t n) {
+	if (n > buffer->size - buffer->pos) {
+		return -1;
+	}
+	memcpy(dest, buffer->data + buffer->pos, n);
+	buffer->pos += n;
+	return 0;
+}
+
+
+static inline int tfs_get_int(TfsBuffer *buffer, int32_t *value) {
+	return tfs_get(buffer, value, sizeof(*value));
+}
+
+
+/*
+ * Takes the next n bytes as a buffer of their own, without copying.
+ * Returns: 0, or -1 if there aren't enough
+ */
+static inline int tfs_get_slice(TfsBuffer *buffer, TfsBuffer *slice, size_t n) {
+	if (n > buffer->size - buffer->pos) {
+		return -1;
+	}
+	tfs_buffer_init(slice, buffer->data + buffer->pos, n);
+	buffer->pos += n;
+	return 0;
+}
+
+
+/*
+ * Reads a path without copying it.
+ * Returns: 0 with path pointing into the buffer, or -1 if malformed
+ */
+static inline int tfs_get_path(TfsBuffer *buffer, char **path) {
+	uint16_t len;
+
+	if (sizeof(len) > buffer->size - buffer->pos) {
+		return -1;
+	}
+	memcpy(&len, buffer->data + buffer->pos, sizeof(len));
+	buffer->pos += sizeof(len);
+
+	if (len == 0 || len > MAX_PATH_SIZE || len > buffer->size - buffer->pos
+	    || buffer->data[buffer->pos + len - 1] != '\0') {
+		return -1;
+	}
+	*path = buffer->data + buffer->pos;
+	buffer->pos += len;
+	return 0;
+}
+
+
+/*
+ * Returns the bytes left to parse.
+ */
+static inline size_t tfs_remaining(TfsBuffer *buffer) {
+	return buffer->size - buffer->pos;
+}
+
+#endif /* TECNICOFS_PROTOCOL_H */
@@ -0,0 +1,250 @@
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "tecnicofs-shm.h"
+
+
+static uint32_t ring_align(uint32_t len) {
+    return (len + sizeof(uint32_t) + 7) & ~7u;
+}
+
+
+static void futex_wait(uint32_t *addr, uint32_t value) {
+    struct timespec timeout = { TFS_RING_TIMEOUT_SEC, 0 };
+
+    syscall(SYS_futex, addr, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+
+static void futex_wake(uint32_t *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+
+/*
+ * Checks if the process on the other side of the rings is gone.
+ */
+static int shm_peer_gone(TfsShm *shm) {
+    pid_t peer = getpid() == shm->client ? shm->server : shm->client;
+
+    if (__atomic_load_n(&shm->closed, __ATOMIC_ACQUIRE)) {
+        return 1;
+    }
+    return peer != 0 && kill(peer, 0) != 0 && errno == ESRCH;
+}
+
+
+/*
+ * Returns how many times to poll a ring before sleeping on it. With a
+ * single CPU the other side can't move while this one polls, so it
+ * sleeps at once.
+ */
+static int ring_spins() {
+    static int spins = -1;
+
+    if (spins < 0) {
+        spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? TFS_RING_SPINS : 0;
+    }
+    return spins;
+}
+
+
+/*
+ * Waits until the word moves from value, polling first and then sleeping
+ * on it. The other side wakes the sleepers it sees in waiters.
+ * Returns: 0, or -1 if the other side is gone
+ */
+static int ring_wait(TfsShm *shm, uint32_t *word, uint32_t *waiters, uint32_t value) {
+    for (int i = 0; i < ring_spins(); i++) {
+        if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != value) {
+            return 0;
+        }
+    }
+    while (__atomic_load_n(word, __ATOMIC_ACQUIRE) == value) {
+        if (shm_peer_gone(shm)) {
+            return -1;
+        }
+        __atomic_store_n(waiters, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(word, __ATOMIC_SEQ_CST) == value) {
+            futex_wait(word, value);
+        }
+        __atomic_store_n(waiters, 0, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+
+//* Moves a position forward and wakes the other side if it sleeps on it
+static void ring_advance(uint32_t *word, uint32_t *waiters, uint32_t value) {
+    __atomic_store_n(word, value, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST)) {
+        futex_wake(word);
+    }
+}
+
+
+/*
+ * Initializes the rings of a new shared segment, owned by the caller.
+ */
+void tfs_shm_init(TfsShm *shm) {
+    TfsRing *rings[] = { &shm->requests, &shm->replies };
+
+    for (int i = 0; i < 2; i++) {
+        rings[i]->head = rings[i]->head_waiters = 0;
+        rings[i]->tail = rings[i]->tail_waiters = 0;
+    }
+    shm->client = getpid();
+    shm->server = 0;
+    shm->closed = 0;
+    __atomic_store_n(&shm->magic, TFS_SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Checks if a message of len bytes can be put without waiting.
+ */
+int tfs_ring_fits(TfsRing *ring, uint32_t len) {
+    uint32_t total = ring_align(len), tail = ring->tail;
+    uint32_t room = TFS_RING_SIZE - (tail & (TFS_RING_SIZE - 1));
+
+    if (room < total) {
+        total += room;
+    }
+    return TFS_RING_SIZE - (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) >= total;
+}
+
+
+//* Checks if a message can be taken without waiting
+int tfs_ring_ready(TfsRing *ring) {
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head;
+}
+
+
+/*
+ * Appends a message made of the given buffers, waiting for room.
+ * Returns: 0, or -1 if the message can never fit or the other side is gone
+ */
+int tfs_ring_put(TfsShm *shm, TfsRing *ring, struct iovec *iov, int iovcnt) {
+    uint32_t len = 0, total, tail = ring->tail, index, room;
+
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    total = ring_align(len);
+    if (total > TFS_RING_SIZE / 2) {
+        return -1;
+    }
+
+    index = tail & (TFS_RING_SIZE - 1);
+    room = TFS_RING_SIZE - index;
+    //* The message must be contiguous, so a short end of the ring is skipped
+    if (room < total) {
+        uint32_t head;
+
+        while (TFS_RING_SIZE - (tail - (head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))) < room) {
+            if (ring_wait(shm, &ring->head, &ring->head_waiters, head) != 0) {
+                return -1;
+            }
+        }
+        *(uint32_t *) (ring->data + index) = TFS_RING_WRAP;
+        tail += room;
+        index = 0;
+    }
+
+    for (uint32_t head; TFS_RING_SIZE - (tail - (head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))) < total; ) {
+        if (ring_wait(shm, &ring->head, &ring->head_waiters, head) != 0) {
+            return -1;
+        }
+    }
+
+    *(uint32_t *) (ring->data + index) = len;
+    index += sizeof(uint32_t);
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(ring->data + index, iov[i].iov_base, iov[i].iov_len);
+        index += iov[i].iov_len;
+    }
+    ring_advance(&ring->tail, &ring->tail_waiters, tail + total);
+    return 0;
+}
+
+
+/*
+ * Waits for the next message and returns it in place. It stays valid,
+ * and the producer can't reuse its room, until tfs_ring_release. The
+ * producer can still write it: a consumer that doesn't trust it must
+ * copy it before use.
+ * Returns: 0, or -1 if the other side is gone or wrote a length that
+ * goes past the end of the ring
+ */
+int tfs_ring_peek(TfsShm *shm, TfsRing *ring, char **msg, uint32_t *len) {
+    uint32_t head = ring->head, tail, index;
+
+    while (1) {
+        while ((tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) == head) {
+            if (ring_wait(shm, &ring->tail, &ring->tail_waiters, head) != 0) {
+                return -1;
+            }
+        }
+        index = head & (TFS_RING_SIZE - 1);
+        *len = __atomic_load_n((uint32_t *) (ring->data + index), __ATOMIC_RELAXED);
+        if (*len != TFS_RING_WRAP) {
+            break;
+        }
+        if (TFS_RING_SIZE - index > tail - head) {
+            return -1;
+        }
+        head += TFS_RING_SIZE - index;
+        ring_advance(&ring->head, &ring->head_waiters, head);
+    }
+
+    //* The message must end before the ring does and be all published
+    if (*len > TFS_RING_SIZE - index - sizeof(uint32_t) || ring_align(*len) > tail - head) {
+        return -1;
+    }
+    *msg = ring->data + index + sizeof(uint32_t);
+    return 0;
+}
+
+
+/*
+ * Frees the room of the message returned by tfs_ring_peek.
+ */
+void tfs_ring_release(TfsRing *ring, uint32_t len) {
+    ring_advance(&ring->head, &ring->head_waiters, ring->head + ring_align(len));
+}
+
+
+/*
+ * Takes the next message, scattering it over the given buffers; bytes
+ * that don't fit are dropped.
+ * Returns: length of the message, or -1 if the other side is gone
+ */
+int tfs_ring_get(TfsShm *shm, TfsRing *ring, struct iovec *iov, int iovcnt) {
+    char *msg;
+    uint32_t len, done = 0;
+
+    if (tfs_ring_peek(shm, ring, &msg, &len) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < iovcnt && done < len; i++) {
+        uint32_t count = len - done < iov[i].iov_len ? len - done : iov[i].iov_len;
+
+        memcpy(iov[i].iov_base, msg + done, count);
+        done += count;
+    }
+    tfs_ring_release(ring, len);
+    return len;
+}
+
+
+/*
+ * Marks the rings closed and wakes the server if it sleeps on them.
+ */
+void tfs_shm_close(TfsShm *shm) {
+    __atomic_store_n(&shm->closed, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&shm->requests.tail);
+}
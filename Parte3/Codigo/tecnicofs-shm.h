@@ -0,0 +1,57 @@
+/* tecnicofs-shm.h */
+#ifndef TECNICOFS_SHM_H
+#define TECNICOFS_SHM_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Shared-memory transport for clients on the same machine. The client
+ * creates a TfsShm, maps it and asks the server to map it too with a
+ * MOUNT_SHM request on the socket; from then on the protocol messages
+ * go through the rings instead of the socket. Each ring has a single
+ * producer and a single consumer. Messages are a uint32_t length and
+ * the bytes, padded to 8; one that doesn't fit before the end of the
+ * ring leaves a TFS_RING_WRAP marker and starts over at the beginning.
+ * Positions are free running counters that double as futex words: a
+ * consumer with nothing to read sleeps on tail, a producer without room
+ * sleeps on head.
+ */
+#define TFS_SHM_MAGIC 0x74667331
+#define TFS_RING_SIZE (256 * 1024)
+#define TFS_RING_WRAP 0xFFFFFFFFu
+/* Polls of an empty or full ring before sleeping on it, with more than one CPU */
+#define TFS_RING_SPINS 2000
+/* A sleeping side checks every second that the other process lives */
+#define TFS_RING_TIMEOUT_SEC 1
+
+typedef struct tfs_ring {
+	uint32_t head; /* written by the consumer */
+	uint32_t head_waiters;
+	char pad0[56];
+	uint32_t tail; /* written by the producer */
+	uint32_t tail_waiters;
+	char pad1[56];
+	char data[TFS_RING_SIZE];
+} TfsRing;
+
+typedef struct tfs_shm {
+	uint32_t magic;
+	uint32_t closed; /* set by the client when it unmounts */
+	pid_t client;
+	pid_t server;
+	TfsRing requests; /* client to server */
+	TfsRing replies; /* server to client */
+} TfsShm;
+
+void tfs_shm_init(TfsShm *shm);
+int tfs_ring_fits(TfsRing *ring, uint32_t len);
+int tfs_ring_ready(TfsRing *ring);
+int tfs_ring_put(TfsShm *shm, TfsRing *ring, struct iovec *iov, int iovcnt);
+int tfs_ring_peek(TfsShm *shm, TfsRing *ring, char **msg, uint32_t *len);
+void tfs_ring_release(TfsRing *ring, uint32_t len);
+int tfs_ring_get(TfsShm *shm, TfsRing *ring, struct iovec *iov, int iovcnt);
+void tfs_shm_close(TfsShm *shm);
+
+#endif /* TECNICOFS_SHM_H */